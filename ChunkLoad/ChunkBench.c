@@ -0,0 +1,1655 @@
+/*
+ * ChunkBench.c : headless benchmarks for ChunkLoad (console application, does not use SDL or any
+ *                SITGL widget, only UtilityLibLite).
+ *
+ * ChunkBench replay <file.trace> [options]
+ *   feed an allocation trace (recorded with renderTraceStart(), F8 in ChunkLoad) to the GPU bank
+ *   allocator, report ops/sec, peak bank count, peak memory used and fragmentation over time.
+ *
+ * ChunkBench blocks [options]
+ *   worker threads allocate 4Kb staging blocks as fast as they can, while main thread flushes them,
+ *   report block allocs/sec from 1 to 16 threads, with and without staging.alloc mutex.
+ *
+ * ChunkBench bitmap [options]
+ *   single slot alloc/free on a pool 90% full: BitPool vs linear scan of 32bit words, for staging
+ *   areas from 1Mb to 1Gb.
+ *
+ * ChunkBench workers [options]
+ *   generate all chunks of a map with 1 to N worker threads (mapSetThreadCount()), report chunks/sec,
+ *   utilization of workers, where tasks were taken (mesh run right after its last load, stolen from other
+ *   queues) and average time a worker was blocked by others.
+ *
+ * ChunkBench view [options]
+ *   time until all chunks in view have a mesh, spiral order against view priority (mapSetViewDir()):
+ *   on initial load and after flying forward a few chunks.
+ *
+ * ChunkBench stages [options]
+ *   generate all chunks of a map with a fixed number of workers, from 0 (all threads load and mesh) to N-1
+ *   loader threads (mapSetLoaderCount()), report chunks/sec, average queue depth and stall time of each stage
+ *   (mapGenStageStats()). Small staging area or upload budget will show backpressure.
+ *
+ * ChunkBench region <folder> [options]
+ *   write synthetic region files (sourceGenRegions()) in <folder>, then load all their chunks through the region
+ *   source (no meshing) with 1 to N threads: report chunks/sec and MB/sec read (compressed) and decompressed.
+ *   workers, view and stages accept -region <folder> to use these files instead of the simulated source.
+ *
+ * ChunkBench cache [options]
+ *   walk back and forth along X (waiting for the map to be fully loaded at each end), with and without chunk
+ *   cache (mapSetCacheSize()): report chunks loaded from chunkSource, cache hits/misses and time spent.
+ *
+ * ChunkBench prefetch [options]
+ *   fly in a straight line with 0 to 2 rings prefetched ahead (mapSetPrefetch()): report how many chunks that
+ *   entered the map were already resident, chunks prefetched for nothing and time until view was complete.
+ *
+ * ChunkBench resize [options]
+ *   change render distance following a list (mapSetRenderDist()) while threads are running: report time spent
+ *   in the call, longest frame (flush + mapTrimChunks()), time until new render area has a mesh and chunks
+ *   that were freed outside of it. Only growing beyond the chunk grid has to stop threads.
+ *
+ * ChunkBench drive [-seed n] [-script file] [options]
+ *   load test: camera follows a script, one command per line (# for comments), X and Z in blocks:
+ *     walk X Z [speed], sprint X Z [speed]: go to X, Z at speed blocks per frame (default 2 and 8)
+ *     teleport X Z, dist N (render distance), wait [frames] (until fully loaded if not set),
+ *     wander frames (random walk).
+ *   chunk sizes, loading delays and random walks only depend on seed (see sourceSeed), a built-in path
+ *   is used if there is no script. For each step and in total (CSV): frames, time, time-to-fully-loaded (longest
+ *   time from a change of the map: chunk crossed, teleport, render distance, until all chunks in render distance
+ *   were uploaded, -1 if it did not happen during the step), meshes, loads, chunks/sec, peak staging usage and
+ *   peak GPU banks. Latency of each stage of the pipeline (mapGenLatency()) is reported at the end, -latency
+ *   <file> writes it per worker thread too (JSON if file ends with .json, CSV otherwise).
+ *
+ * ChunkBench layout [options]
+ *   false sharing of scheduler state (ChunkState_t), packed (several chunks per cache line) against one cache line
+ *   per chunk (chunkStateStride): threads update states of interleaved chunks of a grid while reading neighbors
+ *   like the scheduler does (state updates/sec), then all chunks of a map are generated without loading delay.
+ *   Also counts cache lines holding states of chunks written by different threads: unlike timings, this does not
+ *   need several cores to show what the layout changes.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <math.h>
+#include "UtilityLibLite.h"
+#include "ChunkLoad.h"
+
+typedef struct Replay_t *   Replay;
+
+struct Replay_t                    /* one mesh from trace */
+{
+	Chunk_t     chunk;
+	ChunkData_t cd;
+	uint32_t    id;
+};
+
+static struct                      /* GPUTrace_t.chunk => Replay */
+{
+	Replay * table;
+	int      count, max;
+}	replays;
+
+static STRPTR allocModes[] = {"firstfit", "sizeclass"};
+static STRPTR stagingModes[] = {"mutex", "ring", "atomic"};
+
+extern struct Staging_t staging;
+int loadSpeed;                     /* needed by ChunkLoad.c */
+
+/* open addressing, linear probing */
+static Replay * replaySlot(Replay * table, int max, uint32_t id)
+{
+	int i = id * 2654435761u & (max - 1);
+	while (table[i] && table[i]->id != id)
+		i = (i + 1) & (max - 1);
+	return table + i;
+}
+
+static Replay replayGet(uint32_t id)
+{
+	Replay * slot;
+	int      i;
+
+	if (replays.count * 2 >= replays.max)
+	{
+		/* grow hash table */
+		Replay * old = replays.table;
+		int      max = replays.max;
+		replays.max = max ? max * 2 : 1024;
+		replays.table = calloc(sizeof *replays.table, replays.max);
+		for (i = 0; i < max; i ++)
+			if (old[i]) *replaySlot(replays.table, replays.max, old[i]->id) = old[i];
+		free(old);
+	}
+
+	slot = replaySlot(replays.table, replays.max, id);
+	if (*slot == NULL)
+	{
+		Replay replay = calloc(sizeof *replay, 1);
+		replay->id = id;
+		replay->chunk.color = id >> 4;
+		replay->cd.chunk = &replay->chunk;
+		replay->cd.Y = (id & 15) << 4;
+		replays.count ++;
+		*slot = replay;
+	}
+	return *slot;
+}
+
+static void replayReset(void)
+{
+	int i;
+	for (i = 0; i < replays.max; i ++)
+		free(replays.table[i]);
+	free(replays.table);
+	memset(&replays, 0, sizeof replays);
+}
+
+/* run the whole trace on <map>, call <stats> after each operation if not NULL */
+static int replayRun(Map map, GPUTrace recs, int count, int budget, int frame, void (*stats)(Map, GPUTrace))
+{
+	uint32_t next = frame * 1000;
+	int      ops  = 0;
+
+	for (; count > 0; count --, recs ++)
+	{
+		Replay replay = replayGet(recs->chunk);
+		ChunkData cd = &replay->cd;
+
+		if (recs->time >= next)
+		{
+			/* frame boundary */
+			if (budget > 0) renderCompactBanks(map, budget);
+			renderNextFrame(map);
+			next = (recs->time / (frame * 1000) + 1) * frame * 1000;
+		}
+
+		switch (recs->type) {
+		case GPU_TRACE_ALLOC:
+			if (cd->glBank) renderFreeArray(map, cd);
+			cd->glSize = recs->size;
+			renderStoreArrays(map, cd, recs->size);
+			break;
+		case GPU_TRACE_RESIZE:
+			cd->glSize = recs->size;
+			renderFinishMesh(map, cd);
+			break;
+		case GPU_TRACE_FREE:
+			if (cd->glBank) renderFreeArray(map, cd);
+			break;
+		default: /* GPU_TRACE_MOVE: depends on allocator policy */
+			continue;
+		}
+		ops ++;
+		if (stats) stats(map, recs);
+	}
+	return ops;
+}
+
+static struct                      /* stats collected by replayStats() */
+{
+	int peakBanks;
+	int peakUsed;
+	int peakReserved;
+	int sample, ops;
+}	replayPeak;
+
+static void replayStats(Map map, GPUTrace rec)
+{
+	struct GPUStats_t stats;
+
+	renderGetStats(map, &stats);
+	if (replayPeak.peakBanks < stats.banks)   replayPeak.peakBanks = stats.banks;
+	if (replayPeak.peakUsed  < stats.memUsed) replayPeak.peakUsed  = stats.memUsed;
+	if (replayPeak.peakReserved < stats.memReserved) replayPeak.peakReserved = stats.memReserved;
+
+	replayPeak.ops ++;
+	if (replayPeak.sample > 0 && replayPeak.ops % replayPeak.sample == 0)
+		fprintf(stdout, "%d,%.3f,%d,%d,%d,%d,%d,%.4f\n", replayPeak.ops, rec->time / 1000000., stats.banks, stats.memReserved,
+			stats.memUsed, stats.memLive, stats.memFree, stats.fragmentation);
+}
+
+static Map replayNewMap(int allocMode)
+{
+	Map map = calloc(sizeof *map, 1);
+	map->allocMode = allocMode;
+	map->gpuLock = MutexCreate();
+	/* mapGenFlush() checks staged meshes under genLock */
+	map->genLock = MutexCreate();
+	return map;
+}
+
+static void replayFreeMap(Map map)
+{
+	renderFreeBanks(map);
+	MutexDestroy(map->gpuLock);
+	MutexDestroy(map->genLock);
+	free(map);
+	replayReset();
+}
+
+static int benchReplay(int nb, char * argv[])
+{
+	STRPTR path   = NULL;
+	int    mode   = -1;
+	int    budget = 0;
+	int    frame  = 25;
+	int    sample = 0;
+	int    i;
+
+	for (i = 0; i < nb; i ++)
+	{
+		STRPTR arg = argv[i];
+		if (strcmp(arg, "-mode") == 0 && i+1 < nb)
+		{
+			arg = argv[++ i];
+			mode = strcmp(arg, allocModes[ALLOC_FIRSTFIT]) == 0 ? ALLOC_FIRSTFIT :
+			       strcmp(arg, allocModes[ALLOC_SIZECLASS]) == 0 ? ALLOC_SIZECLASS : -1;
+		}
+		else if (strcmp(arg, "-compact") == 0 && i+1 < nb) budget = atoi(argv[++ i]) * 1024;
+		else if (strcmp(arg, "-frame")   == 0 && i+1 < nb) frame  = atoi(argv[++ i]);
+		else if (strcmp(arg, "-sample")  == 0 && i+1 < nb) sample = atoi(argv[++ i]);
+		else path = arg;
+	}
+
+	if (path == NULL)
+	{
+		fprintf(stderr, "usage: ChunkBench replay <file.trace> [-mode firstfit|sizeclass] [-compact kb] [-frame ms] [-sample ops]\n");
+		return 1;
+	}
+	if (frame < 1) frame = 1;
+
+	FILE * in = fopen(path, "rb");
+	TEXT   magic[8];
+	if (in == NULL || fread(magic, 1, sizeof magic, in) != sizeof magic || memcmp(magic, GPU_TRACE_MAGIC, sizeof magic))
+	{
+		fprintf(stderr, "%s: not a valid trace file\n", path);
+		if (in) fclose(in);
+		return 1;
+	}
+
+	/* load everything in memory: don't want to benchmark I/O */
+	GPUTrace recs  = NULL;
+	int      count = 0, max = 0;
+	for (;;)
+	{
+		if (count == max)
+		{
+			max += 65536;
+			recs = realloc(recs, max * sizeof *recs);
+		}
+		if (fread(recs + count, sizeof *recs, 1, in) != 1) break;
+		count ++;
+	}
+	fclose(in);
+	fprintf(stderr, "%s: %d records\n", path, count);
+
+	for (i = ALLOC_FIRSTFIT; i <= ALLOC_SIZECLASS; i ++)
+	{
+		if (mode >= 0 && mode != i) continue;
+
+		/* first pass: timing only */
+		Map    map  = replayNewMap(i);
+		double time = FrameGetTime();
+		int    ops  = replayRun(map, recs, count, budget, frame, NULL);
+		time = FrameGetTime() - time;
+		replayFreeMap(map);
+
+		/* second pass: gather stats after each operation */
+		memset(&replayPeak, 0, sizeof replayPeak);
+		replayPeak.sample = sample;
+		if (sample > 0)
+			fprintf(stdout, "# %s: ops,time,banks,memReserved,memUsed,memLive,memFree,fragmentation\n", allocModes[i]);
+		map = replayNewMap(i);
+		replayRun(map, recs, count, budget, frame, replayStats);
+
+		struct GPUStats_t stats;
+		renderGetStats(map, &stats);
+		fprintf(stdout, "%s: %d ops in %.1f ms (%.0f ops/sec), peak banks: %d, peak memUsed: %d, peak reserved: %d, "
+			"final reserved/live: %d/%d, final fragmentation: %.2f%%, bytes moved: %d\n", allocModes[i], ops, time,
+			time > 0 ? ops * 1000 / time : 0, replayPeak.peakBanks, replayPeak.peakUsed, replayPeak.peakReserved,
+			stats.memReserved, stats.memLive, stats.fragmentation * 100, stats.bytesMoved);
+
+		replayFreeMap(map);
+	}
+	free(recs);
+	return 0;
+}
+
+/*
+ * staging blocks allocation: mapGenAllocMem() contention
+ */
+typedef struct Producer_t *   Producer;
+
+struct Producer_t                  /* one worker thread */
+{
+	struct Thread_t thread;
+	int             allocs;
+};
+
+static struct
+{
+	volatile int go, stop;
+	int          running;
+}	blockBench;
+
+static void blockProducer(void * arg)
+{
+	Producer prod = arg;
+
+	while (! blockBench.go);
+	while (! blockBench.stop)
+	{
+		/* single block meshes: all belong to chunk 0, layer 0 */
+		DATA32 mem = mapGenAllocMem(&prod->thread);
+		if (mem == NULL) break;
+		mem[0] = 0;
+		mem[1] = END_OF_LIST;
+		mapGenReady(mem);
+		prod->allocs ++;
+	}
+	__sync_fetch_and_sub(&blockBench.running, 1);
+}
+
+/* return block allocs/sec */
+static double blockRun(int mode, int count, int time, int size)
+{
+	struct Producer_t prods[16];
+	struct ChunkState_t state;
+	Chunk_t     chunk;
+	ChunkData_t cd;
+	Map         map = replayNewMap(ALLOC_SIZECLASS);
+	int         i, allocs;
+
+	/* consumer side: mapGenFlush() only needs the chunk a block belongs to */
+	memset(&chunk, 0, sizeof chunk);
+	memset(&cd, 0, sizeof cd);
+	memset(&state, 0, sizeof state);
+	state.cflags = CFLAG_HASMESH | CFLAG_GOTDATA;
+	chunk.state = &state;
+	chunk.layer[0] = &cd;
+	chunk.maxy = 1;
+	cd.chunk = &chunk;
+	cd.glSize = 4096 - 8;
+	map->chunks = &chunk;
+
+	staging.mode = mode;
+	staging.size = size;
+	mapInitStaging();
+	memset(prods, 0, sizeof prods);
+	memset(&blockBench, 0, sizeof blockBench);
+	blockBench.running = count;
+	for (i = 0; i < count; i ++)
+		ThreadCreate(blockProducer, prods + i);
+
+	double start = FrameGetTime(), elapsed;
+	blockBench.go = 1;
+	while ((elapsed = FrameGetTime() - start) < time)
+		mapGenFlush(map);
+
+	for (i = allocs = 0; i < count; allocs += prods[i].allocs, i ++);
+	blockBench.stop = 1;
+
+	/* threads might be waiting for a block */
+	while (__sync_fetch_and_add(&blockBench.running, 0) > 0)
+		mapGenFlush(map);
+
+	mapFreeStaging();
+	map->chunks = NULL;
+	replayFreeMap(map);
+
+	return allocs * 1000. / elapsed;
+}
+
+static int benchBlocks(int nb, char * argv[])
+{
+	int mode = -1;
+	int max  = 16;
+	int time = 1000;
+	int size = 1;
+	int i, count;
+
+	for (i = 0; i < nb; i ++)
+	{
+		STRPTR arg = argv[i];
+		if (strcmp(arg, "-mode") == 0 && i+1 < nb)
+		{
+			arg = argv[++ i];
+			mode = strcmp(arg, stagingModes[STAGING_BLOCKS]) == 0 ? STAGING_BLOCKS :
+			       strcmp(arg, stagingModes[STAGING_ATOMIC]) == 0 ? STAGING_ATOMIC : -2;
+		}
+		else if (strcmp(arg, "-threads") == 0 && i+1 < nb) max  = atoi(argv[++ i]);
+		else if (strcmp(arg, "-time")    == 0 && i+1 < nb) time = atoi(argv[++ i]);
+		else if (strcmp(arg, "-size")    == 0 && i+1 < nb) size = atoi(argv[++ i]);
+		else mode = -2;
+	}
+
+	if (mode == -2 || max < 1 || max > 16 || time < 1 || size < 1 || size > 1024)
+	{
+		fprintf(stderr, "usage: ChunkBench blocks [-mode mutex|atomic] [-threads max] [-time ms] [-size mb]\n");
+		return 1;
+	}
+
+	fprintf(stdout, "# threads,mode,allocs/sec\n");
+	for (count = 1; count <= max; count = count < max && count * 2 > max ? max : count * 2)
+	{
+		for (i = STAGING_BLOCKS; i <= STAGING_ATOMIC; i ++)
+		{
+			if (i == STAGING_RING || (mode >= 0 && mode != i)) continue;
+			fprintf(stdout, "%d,%s,%.0f\n", count, stagingModes[i], blockRun(i, count, time, size << 20));
+			fflush(stdout);
+		}
+		if (count == max) break;
+	}
+	return 0;
+}
+
+/*
+ * hierarchical bitmap (BitPool) vs what staging area used before
+ */
+static int legacyFirstFree(DATA32 usage, int count)
+{
+	static uint8_t multiplyDeBruijnBitPosition[] = {
+		0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+		31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+	};
+	int base, i;
+	for (i = count, base = 0; i > 0; i --, usage ++, base += 32)
+	{
+		uint32_t bits = *usage ^ 0xffffffff;
+		if (bits == 0) continue;
+		bits = multiplyDeBruijnBitPosition[((uint32_t)((bits & (~bits + 1)) * 0x077CB531U)) >> 27];
+		*usage |= 1u << bits;
+		return base + bits;
+	}
+	return -1;
+}
+
+/* free a random allocated slot, allocate a new one: return ns per pair */
+static double bitmapRun(int slots, int ops, Bool legacy)
+{
+	struct BitPool_t pool;
+	DATA32 usage  = calloc(slots / 32, 4);
+	int *  owned  = malloc(slots * sizeof *owned);
+	int    nb     = slots - slots / 10;
+	int    i, j;
+
+	bitPoolInit(&pool, slots);
+	srand(42);
+	for (i = 0; i < nb; i ++)
+		owned[i] = legacy ? legacyFirstFree(usage, slots / 32) : bitPoolAlloc(&pool);
+
+	/* same sequence for both */
+	double time = FrameGetTime();
+	for (i = 0; i < ops; i ++)
+	{
+		j = rand() % nb;
+		if (legacy)
+		{
+			usage[owned[j] >> 5] &= ~(1 << (owned[j] & 31));
+			owned[j] = legacyFirstFree(usage, slots / 32);
+		}
+		else
+		{
+			bitPoolFree(&pool, owned[j]);
+			owned[j] = bitPoolAlloc(&pool);
+		}
+	}
+	time = FrameGetTime() - time;
+
+	bitPoolRelease(&pool);
+	free(usage);
+	free(owned);
+	return time * 1e6 / ops;
+}
+
+static int benchBitmap(int nb, char * argv[])
+{
+	int ops = 200000;
+	int size;
+
+	if (nb == 2 && strcmp(argv[0], "-ops") == 0)
+		ops = atoi(argv[1]);
+	else if (nb > 0)
+	{
+		fprintf(stderr, "usage: ChunkBench bitmap [-ops count]\n");
+		return 1;
+	}
+
+	fprintf(stdout, "# staging (Mb),blocks,linear (ns/op),bitpool (ns/op)\n");
+	for (size = 1; size <= 1024; size *= 4)
+	{
+		int slots = size << 8;
+		double linear = bitmapRun(slots, ops, True);
+		fprintf(stdout, "%d,%d,%.1f,%.1f\n", size, slots, linear, bitmapRun(slots, ops, False));
+		fflush(stdout);
+	}
+	return 0;
+}
+
+/* -region <folder> option of other benchmarks */
+static Bool benchSource(STRPTR folder)
+{
+	chunkSource = sourceOpenRegions(folder);
+	if (chunkSource == NULL)
+	{
+		fprintf(stderr, "%s: not a folder\n", folder);
+		chunkSource = &sourceSimulated;
+		return False;
+	}
+	return True;
+}
+
+/*
+ * chunk loading/meshing throughput against number of worker threads
+ */
+static double workerRun(int count, int dist, float * load, int * locality, double * waited)
+{
+	int    XZ[2] = {8, 8};
+	int    total = (dist * 2 + 1) * (dist * 2 + 1);
+	int    meshed, i;
+	double start;
+	Map    map;
+
+	threadCount = count;
+	start = FrameGetTime();
+	map = mapInitFromPath(dist, XZ, ALLOC_SIZECLASS);
+
+	for (;;)
+	{
+		if (staging.total > 0) mapGenFlush(map);
+		renderNextFrame(map);
+		for (i = meshed = 0; i < threadCount; meshed += threads[i].chunks, i ++);
+		if (meshed >= total) break;
+		ThreadPause(1);
+	}
+	start = FrameGetTime() - start;
+
+	/* since threads were created */
+	mapGenThreadLoad(load, MAX_THREADS);
+	for (i = 0, locality[0] = locality[1] = 0, waited[0] = 0; i < threadCount; i ++)
+	{
+		locality[0] += threads[i].adjacent, locality[1] += threads[i].stolen;
+		waited[0] += threads[i].waited;
+	}
+	mapFreeAll(map);
+
+	return total * 1000. / start;
+}
+
+static int benchWorkers(int nb, char * argv[])
+{
+	int max  = mapGetCoreCount() * 2;
+	int dist = 8;
+	int i, count, err;
+
+	loadSpeed = 10;
+	for (i = err = 0; i < nb; i ++)
+	{
+		STRPTR arg = argv[i];
+		if      (strcmp(arg, "-threads") == 0 && i+1 < nb) max  = atoi(argv[++ i]);
+		else if (strcmp(arg, "-dist")    == 0 && i+1 < nb) dist = atoi(argv[++ i]);
+		else if (strcmp(arg, "-load")    == 0 && i+1 < nb) loadSpeed = atoi(argv[++ i]);
+		else if (strcmp(arg, "-region")  == 0 && i+1 < nb) err |= ! benchSource(argv[++ i]);
+		else err = 1;
+	}
+
+	if (max > MAX_THREADS) max = MAX_THREADS;
+	if (err || max < 1 || dist < 2 || dist > 31 || loadSpeed < 0)
+	{
+		fprintf(stderr, "usage: ChunkBench workers [-threads max] [-dist chunks] [-load ms] [-region folder]\n");
+		return 1;
+	}
+
+	fprintf(stdout, "# %d cores, load up to %d ms per chunk\n", mapGetCoreCount(), loadSpeed);
+	fprintf(stdout, "# workers,chunks/sec,min load,avg load,max load,adjacent,stolen,wait (ms)\n");
+	for (count = 1; count <= max; count = count < max && count * 2 > max ? max : count * 2)
+	{
+		float  load[MAX_THREADS], min = 1, sum = 0, peak = 0;
+		int    locality[2];
+		double waited;
+		double rate = workerRun(count, dist, load, locality, &waited);
+
+		for (i = 0; i < count; i ++)
+		{
+			if (min  > load[i]) min  = load[i];
+			if (peak < load[i]) peak = load[i];
+			sum += load[i];
+		}
+		fprintf(stdout, "%d,%.1f,%.2f,%.2f,%.2f,%d,%d,%.1f\n", count, rate, min, sum / count, peak, locality[0], locality[1], waited / count);
+		fflush(stdout);
+		if (count == max) break;
+	}
+	return 0;
+}
+
+/*
+ * time until all chunks in view have a mesh: spiral order against view priority
+ */
+static int viewMeshed(Map map)
+{
+	int dist = map->maxDist >> 1;
+	int area = map->mapArea;
+	int dx, dz, meshed;
+
+	for (dz = -dist, meshed = 0; dz <= dist; dz ++)
+	{
+		for (dx = -dist; dx <= dist; dx ++)
+		{
+			Chunk c = map->chunks + (map->mapX + dx + area) % area + (map->mapZ + dz + area) % area * area;
+			if ((c->state->cflags & CFLAG_HASMESH) && c->X == (CPOS(map->cx) + dx) << 4 && c->Z == (CPOS(map->cz) + dz) << 4)
+				meshed ++;
+		}
+	}
+	return meshed;
+}
+
+/* wait until all chunks in view, then all chunks in range have a mesh: time in ms since <start> */
+static void viewWait(Map map, double start, double * view, double * all)
+{
+	int total = map->maxDist * map->maxDist;
+
+	for (view[0] = all[0] = 0; view[0] == 0 || all[0] == 0; ThreadPause(1))
+	{
+		if (staging.total > 0) mapGenFlush(map);
+		renderNextFrame(map);
+		if (view[0] == 0 && map->viewStart == 0) view[0] = FrameGetTime() - start;
+		if (all[0] == 0 && viewMeshed(map) == total) all[0] = FrameGetTime() - start;
+	}
+}
+
+static int benchView(int nb, char * argv[])
+{
+	int   workers = mapGetCoreCount();
+	int   dist    = 8;
+	int   moves   = 8;
+	int   step    = 20;
+	float fov     = VIEW_FOV;
+	int   i, prio, err;
+
+	loadSpeed = 10;
+	for (i = err = 0; i < nb; i ++)
+	{
+		STRPTR arg = argv[i];
+		if      (strcmp(arg, "-threads") == 0 && i+1 < nb) workers = atoi(argv[++ i]);
+		else if (strcmp(arg, "-dist")    == 0 && i+1 < nb) dist  = atoi(argv[++ i]);
+		else if (strcmp(arg, "-load")    == 0 && i+1 < nb) loadSpeed = atoi(argv[++ i]);
+		else if (strcmp(arg, "-region")  == 0 && i+1 < nb) err |= ! benchSource(argv[++ i]);
+		else if (strcmp(arg, "-fov")     == 0 && i+1 < nb) fov   = atof(argv[++ i]);
+		else if (strcmp(arg, "-moves")   == 0 && i+1 < nb) moves = atoi(argv[++ i]);
+		else if (strcmp(arg, "-step")    == 0 && i+1 < nb) step  = atoi(argv[++ i]);
+		else err = 1;
+	}
+
+	if (err || workers < 1 || workers > MAX_THREADS || dist < 2 || dist > 31 || loadSpeed < 0 || fov < 10 || fov > 180 || moves < 1)
+	{
+		fprintf(stderr, "usage: ChunkBench view [-threads count] [-dist chunks] [-load ms] [-region folder] [-fov degrees] [-moves chunks] [-step ms]\n");
+		return 1;
+	}
+
+	fprintf(stdout, "# %d workers, load up to %d ms per chunk, fov %g, flying %d chunks (one every %d ms)\n",
+		workers, loadSpeed, fov, moves, step);
+	fprintf(stdout, "# order,initial view ms,initial all ms,flying view ms,flying all ms\n");
+	for (prio = 0; prio < 2; prio ++)
+	{
+		int    XZ[2] = {8, 8};
+		vec4   pos   = {8, 0, 8};
+		vec4   north = {0, 0, -1};
+		double start, load[2], fly[2];
+		Map    map;
+
+		threadCount = workers;
+		start = FrameGetTime();
+		map = mapInitFromPath(dist, XZ, ALLOC_SIZECLASS);
+		mapSetViewDir(map, north, fov, prio);
+		viewWait(map, start, load, load + 1);
+
+		for (i = 0; i < moves; i ++)
+		{
+			vec4 old;
+			memcpy(old, pos, sizeof old);
+			pos[VZ] -= 16;
+			mapMoveCenter(map, old, pos);
+			start = FrameGetTime();
+			/* keep uploading meshes in the meantime, timing starts from last move */
+			while (i < moves - 1 && FrameGetTime() - start < step)
+			{
+				if (staging.total > 0) mapGenFlush(map);
+				renderNextFrame(map);
+				ThreadPause(1);
+			}
+		}
+		viewWait(map, start, fly, fly + 1);
+		fprintf(stdout, "%s,%.0f,%.0f,%.0f,%.0f\n", prio ? "view" : "spiral", load[0], load[1], fly[0], fly[1]);
+		fflush(stdout);
+		mapFreeAll(map);
+	}
+	return 0;
+}
+
+/*
+ * pipeline: loader threads -> mesh threads -> upload, against number of loader threads
+ */
+static int benchStages(int nb, char * argv[])
+{
+	int workers = mapGetCoreCount() < 4 ? 4 : mapGetCoreCount();
+	int dist    = 8;
+	int i, loaders, err;
+
+	loadSpeed = 10;
+	for (i = err = 0; i < nb; i ++)
+	{
+		STRPTR arg = argv[i];
+		if      (strcmp(arg, "-threads") == 0 && i+1 < nb) workers = atoi(argv[++ i]);
+		else if (strcmp(arg, "-dist")    == 0 && i+1 < nb) dist = atoi(argv[++ i]);
+		else if (strcmp(arg, "-load")    == 0 && i+1 < nb) loadSpeed = atoi(argv[++ i]);
+		else if (strcmp(arg, "-region")  == 0 && i+1 < nb) err |= ! benchSource(argv[++ i]);
+		else if (strcmp(arg, "-staging") == 0 && i+1 < nb) staging.size = atoi(argv[++ i]) * 1024;
+		else if (strcmp(arg, "-budget")  == 0 && i+1 < nb) staging.budgetBytes = atoi(argv[++ i]) * 1024;
+		else err = 1;
+	}
+
+	if (err || workers < 2 || workers > MAX_THREADS || dist < 2 || dist > 31 || loadSpeed < 0 || staging.size < 0 || staging.budgetBytes < 0)
+	{
+		fprintf(stderr, "usage: ChunkBench stages [-threads count] [-dist chunks] [-load ms] [-region folder] [-staging Kb] [-budget Kb]\n");
+		return 1;
+	}
+
+	fprintf(stdout, "# %d workers, load up to %d ms per chunk, staging %d Kb, upload budget %d Kb per frame\n",
+		workers, loadSpeed, (staging.size < STAGING_MIN ? STAGING_MIN : staging.size) >> 10, staging.budgetBytes >> 10);
+	fprintf(stdout, "# loaders,meshers,chunks/sec,load depth,mesh depth,upload depth,load stall (ms),mesh stall (ms)\n");
+	for (loaders = 0; loaders < workers; loaders ++)
+	{
+		struct StageStats_t stats[STAGE_COUNT];
+		int    XZ[2] = {8, 8};
+		int    total = (dist * 2 + 1) * (dist * 2 + 1);
+		double depth[STAGE_COUNT] = {0};
+		double start;
+		int    samples;
+		Map    map;
+
+		threadCount   = workers;
+		threadLoaders = loaders;
+		start = FrameGetTime();
+		map = mapInitFromPath(dist, XZ, ALLOC_SIZECLASS);
+
+		for (samples = 1; ; samples ++)
+		{
+			if (staging.total > 0) mapGenFlush(map);
+			renderNextFrame(map);
+			mapGenStageStats(stats);
+			for (i = 0; i < STAGE_COUNT; depth[i] += stats[i].depth, i ++);
+			if (stats[STAGE_MESH].done >= total) break;
+			ThreadPause(1);
+		}
+		start = FrameGetTime() - start;
+
+		fprintf(stdout, "%d,%d,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", stats[STAGE_LOAD].threads * (loaders > 0),
+			stats[STAGE_MESH].threads, total * 1000. / start, depth[STAGE_LOAD] / samples, depth[STAGE_MESH] / samples,
+			depth[STAGE_UPLOAD] / samples, loaders > 0 ? stats[STAGE_LOAD].stalled / loaders : 0,
+			stats[STAGE_MESH].stalled / stats[STAGE_MESH].threads);
+		fflush(stdout);
+		mapFreeAll(map);
+	}
+	threadLoaders = 0;
+	return 0;
+}
+
+/*
+ * chunk cache: reloads saved when walking back and forth
+ */
+static int benchCache(int nb, char * argv[])
+{
+	int workers = mapGetCoreCount();
+	int dist    = 8;
+	int moves   = 12;
+	int trips   = 4;
+	int step    = 20;
+	int budget  = CACHE_SIZE;
+	int i, pass, err;
+
+	loadSpeed = 10;
+	for (i = err = 0; i < nb; i ++)
+	{
+		STRPTR arg = argv[i];
+		if      (strcmp(arg, "-threads") == 0 && i+1 < nb) workers = atoi(argv[++ i]);
+		else if (strcmp(arg, "-dist")    == 0 && i+1 < nb) dist = atoi(argv[++ i]);
+		else if (strcmp(arg, "-load")    == 0 && i+1 < nb) loadSpeed = atoi(argv[++ i]);
+		else if (strcmp(arg, "-region")  == 0 && i+1 < nb) err |= ! benchSource(argv[++ i]);
+		else if (strcmp(arg, "-moves")   == 0 && i+1 < nb) moves = atoi(argv[++ i]);
+		else if (strcmp(arg, "-trips")   == 0 && i+1 < nb) trips = atoi(argv[++ i]);
+		else if (strcmp(arg, "-step")    == 0 && i+1 < nb) step = atoi(argv[++ i]);
+		else if (strcmp(arg, "-cache")   == 0 && i+1 < nb) budget = atoi(argv[++ i]) * 1024;
+		else err = 1;
+	}
+
+	if (err || workers < 1 || workers > MAX_THREADS || dist < 2 || dist > 31 || loadSpeed < 0 || moves < 1 || trips < 1 || budget < 0)
+	{
+		fprintf(stderr, "usage: ChunkBench cache [-threads count] [-dist chunks] [-load ms] [-region folder] [-moves chunks] "
+			"[-trips count] [-step ms] [-cache Kb]\n");
+		return 1;
+	}
+
+	fprintf(stdout, "# %d workers, load up to %d ms per chunk, %d round trips of %d chunks (one every %d ms)\n",
+		workers, loadSpeed, trips, moves, step);
+	fprintf(stdout, "# cache (Kb),loaded,hits,misses,dropped,cached (Kb),time (ms)\n");
+	for (pass = 0; pass < 2; pass ++)
+	{
+		int    XZ[2] = {8, 8};
+		vec4   pos   = {8, 0, 8};
+		vec4   east  = {1, 0, 0};
+		int    loaded, hits, misses, dropped;
+		double start, view, all;
+		Map    map;
+
+		threadCount = workers;
+		map = mapInitFromPath(dist, XZ, ALLOC_SIZECLASS);
+		mapSetCacheSize(map, pass ? budget : 0);
+		mapSetViewDir(map, east, VIEW_FOV, True);
+		viewWait(map, FrameGetTime(), &view, &all);
+		/* initial load not included */
+		struct ChunkCache_t * cache = &map->cache;
+		loaded  = chunkSource->chunks;
+		hits    = cache->hits;
+		misses  = cache->misses;
+		dropped = cache->dropped;
+		start   = FrameGetTime();
+
+		for (i = 0; i < moves * trips * 2; i ++)
+		{
+			vec4   old;
+			double moved;
+			memcpy(old, pos, sizeof old);
+			pos[VX] += (i / moves) & 1 ? -16 : 16;
+			mapMoveCenter(map, old, pos);
+			/* at each end: until fully loaded */
+			if ((i + 1) % moves == 0)
+			{
+				east[VX] = - east[VX];
+				mapSetViewDir(map, east, VIEW_FOV, True);
+				viewWait(map, FrameGetTime(), &view, &all);
+				continue;
+			}
+			for (moved = FrameGetTime(); FrameGetTime() - moved < step; ThreadPause(1))
+			{
+				if (staging.total > 0) mapGenFlush(map);
+				renderNextFrame(map);
+			}
+		}
+		fprintf(stdout, "%d,%d,%d,%d,%d,%d,%.1f\n", pass ? budget >> 10 : 0, chunkSource->chunks - loaded,
+			cache->hits - hits, cache->misses - misses, cache->dropped - dropped, cache->bytes >> 10, FrameGetTime() - start);
+		fflush(stdout);
+		mapFreeAll(map);
+	}
+	return 0;
+}
+
+/*
+ * prefetch: chunks entering the map already loaded in cache
+ */
+static int benchPrefetch(int nb, char * argv[])
+{
+	int workers = mapGetCoreCount() < 2 ? 2 : mapGetCoreCount();
+	int dist    = 8;
+	int moves   = 32;
+	int step    = 40;
+	int i, rings, err;
+
+	loadSpeed = 10;
+	for (i = err = 0; i < nb; i ++)
+	{
+		STRPTR arg = argv[i];
+		if      (strcmp(arg, "-threads") == 0 && i+1 < nb) workers = atoi(argv[++ i]);
+		else if (strcmp(arg, "-dist")    == 0 && i+1 < nb) dist = atoi(argv[++ i]);
+		else if (strcmp(arg, "-load")    == 0 && i+1 < nb) loadSpeed = atoi(argv[++ i]);
+		else if (strcmp(arg, "-region")  == 0 && i+1 < nb) err |= ! benchSource(argv[++ i]);
+		else if (strcmp(arg, "-moves")   == 0 && i+1 < nb) moves = atoi(argv[++ i]);
+		else if (strcmp(arg, "-step")    == 0 && i+1 < nb) step = atoi(argv[++ i]);
+		else err = 1;
+	}
+
+	if (err || workers < 1 || workers > MAX_THREADS || dist < 2 || dist > 31 || loadSpeed < 0 || moves < 1 || step < 1)
+	{
+		fprintf(stderr, "usage: ChunkBench prefetch [-threads count] [-dist chunks] [-load ms] [-region folder] [-moves chunks] [-step ms]\n");
+		return 1;
+	}
+
+	fprintf(stdout, "# %d workers, load up to %d ms per chunk, flying %d chunks east (one every %d ms)\n",
+		workers, loadSpeed, moves, step);
+	fprintf(stdout, "# rings,entered,resident,resident %%,prefetched,unused,view ms\n");
+	for (rings = 0; rings <= 2; rings ++)
+	{
+		int    XZ[2] = {8, 8};
+		vec4   pos   = {8, 0, 8};
+		vec4   east  = {1, 0, 0};
+		int    hits, misses, prefetched;
+		double view, all, wait;
+		Map    map;
+
+		threadCount = workers;
+		map = mapInitFromPath(dist, XZ, ALLOC_SIZECLASS);
+		mapSetPrefetch(map, rings);
+		mapSetViewDir(map, east, VIEW_FOV, True);
+		viewWait(map, FrameGetTime(), &view, &all);
+
+		struct ChunkCache_t * cache = &map->cache;
+		hits   = cache->prefetchHits;
+		misses = cache->hits + cache->misses;
+		prefetched = cache->prefetched;
+
+		/* view time: average time until chunks in view have a mesh, after each move */
+		for (i = 0, wait = 0; i < moves; i ++)
+		{
+			vec4   old;
+			double start = FrameGetTime();
+			memcpy(old, pos, sizeof old);
+			pos[VX] += 16;
+			mapMoveCenter(map, old, pos);
+			for (view = 0; FrameGetTime() - start < step; ThreadPause(1))
+			{
+				if (staging.total > 0) mapGenFlush(map);
+				renderNextFrame(map);
+				if (view == 0 && map->viewStart == 0) view = FrameGetTime() - start;
+			}
+			if (view == 0)
+			{
+				viewWait(map, start, &view, &all);
+				view = all;
+			}
+			wait += view;
+		}
+		hits = cache->prefetchHits - hits;
+		misses = cache->hits + cache->misses - misses;
+		prefetched = cache->prefetched - prefetched;
+		fprintf(stdout, "%d,%d,%d,%.1f,%d,%d,%.1f\n", rings, misses, hits, misses ? hits * 100. / misses : 0,
+			prefetched, prefetched - hits, wait / moves);
+		fflush(stdout);
+		mapFreeAll(map);
+	}
+	return 0;
+}
+
+/*
+ * resize: stall of mapSetRenderDist() on main thread, and time until new render area is complete
+ */
+static int benchResize(int nb, char * argv[])
+{
+	int    workers = mapGetCoreCount() < 2 ? 2 : mapGetCoreCount();
+	int    dists[32];
+	int    count   = 0;
+	int    trim    = TRIM_CHUNKS;
+	STRPTR list    = "4,8,4,8,16,8,16,2";
+	int    i, err;
+
+	loadSpeed = 2;
+	for (i = err = 0; i < nb; i ++)
+	{
+		STRPTR arg = argv[i];
+		if      (strcmp(arg, "-threads") == 0 && i+1 < nb) workers = atoi(argv[++ i]);
+		else if (strcmp(arg, "-load")    == 0 && i+1 < nb) loadSpeed = atoi(argv[++ i]);
+		else if (strcmp(arg, "-region")  == 0 && i+1 < nb) err |= ! benchSource(argv[++ i]);
+		else if (strcmp(arg, "-dists")   == 0 && i+1 < nb) list = argv[++ i];
+		else if (strcmp(arg, "-trim")    == 0 && i+1 < nb) trim = atoi(argv[++ i]);
+		else err = 1;
+	}
+	for (; count < DIM(dists) && *list; count ++)
+	{
+		dists[count] = strtol(list, &list, 10);
+		if (dists[count] < 2 || dists[count] > 31) err = 1;
+		if (*list == ',') list ++;
+		else if (*list) err = 1;
+	}
+
+	if (err || count < 2 || workers < 1 || workers > MAX_THREADS || loadSpeed < 0 || trim < 1)
+	{
+		fprintf(stderr, "usage: ChunkBench resize [-threads count] [-load ms] [-region folder] [-dists d1,d2,...] [-trim chunks]\n");
+		return 1;
+	}
+
+	int  XZ[2] = {8, 8};
+	vec4 north = {0, 0, -1};
+	Map  map;
+
+	threadCount = workers;
+	map = mapInitFromPath(dists[0], XZ, ALLOC_SIZECLASS);
+	mapSetViewDir(map, north, VIEW_FOV, True);
+
+	fprintf(stdout, "# %d workers, load up to %d ms per chunk, %d chunks trimmed per frame\n", workers, loadSpeed, trim);
+	fprintf(stdout, "# from,to,grid,call ms,max frame ms,all ms,trimmed\n");
+	for (i = 0; i < count; i ++)
+	{
+		double start = FrameGetTime(), call = 0, frame = 0, all = 0;
+		int    trimmed = 0, idle = 0;
+
+		/* first one: initial load */
+		if (i > 0)
+		{
+			mapSetRenderDist(map, dists[i]);
+			frame = call = FrameGetTime() - start;
+		}
+		/* until render area is meshed and a whole pass over the grid found nothing to trim */
+		while (all == 0 || idle < map->mapArea)
+		{
+			double time = FrameGetTime();
+			int    freed;
+			if (staging.total > 0) mapGenFlush(map);
+			freed = mapTrimChunks(map, trim);
+			renderNextFrame(map);
+			time = FrameGetTime() - time;
+			if (frame < time) frame = time;
+			trimmed += freed;
+			idle = freed ? 0 : idle + 1;
+			if (all == 0 && viewMeshed(map) == map->maxDist * map->maxDist) all = FrameGetTime() - start;
+			ThreadPause(1);
+		}
+		fprintf(stdout, "%d,%d,%d,%.2f,%.2f,%.1f,%d\n", i ? dists[i-1] : 0, dists[i], (map->mapArea - 4) / 2,
+			call, frame, all, trimmed);
+		fflush(stdout);
+	}
+	mapFreeAll(map);
+	return 0;
+}
+
+/*
+ * drive: camera path from a script, deterministic for a given seed (chunk sizes and delays, random walks)
+ */
+#define DRIVE_WALK        2        /* blocks per frame */
+#define DRIVE_SPRINT      8
+#define DRIVE_TIMEOUT     60000    /* ms: max wait for map to be fully loaded */
+
+enum /* DriveStep_t.type */
+{
+	DRIVE_INIT,                    /* initial load (implicit first step) */
+	DRIVE_GOTO,                    /* walk or sprint to X, Z at <arg> blocks per frame */
+	DRIVE_TELEPORT,
+	DRIVE_DIST,                    /* mapSetRenderDist(arg) */
+	DRIVE_WAIT,                    /* <arg> frames, 0: until fully loaded */
+	DRIVE_WANDER                   /* random walk during <arg> frames */
+};
+
+struct DriveStep_t
+{
+	int   type;
+	int   arg;
+	float X, Z;
+	TEXT  line[48];
+};
+
+static STRPTR driveDefault =
+	"# walk and sprint away, teleport, change render distance on the way\n"
+	"walk 8 -504\n"
+	"sprint 1032 -504\n"
+	"dist 12\n"
+	"sprint 1032 520\n"
+	"teleport 20008 20008\n"
+	"wait\n"
+	"wander 200\n"
+	"dist 6\n"
+	"sprint 21032 20008\n"
+	"dist 10\n"
+	"wait\n";
+
+/* parse script in <buffer> (modified), returns number of steps or -1 on error */
+static int driveParse(STRPTR buffer, struct DriveStep_t * steps, int max)
+{
+	STRPTR line, next;
+	int    count, num;
+
+	for (line = buffer, count = 1, num = 1; line && *line; line = next, num ++)
+	{
+		struct DriveStep_t * step = steps + count;
+		TEXT  cmd[16];
+		float X, Z;
+		int   arg = 0, nb;
+
+		next = strchr(line, '\n');
+		if (next) *next ++ = 0;
+		nb = sscanf(line, "%15s %f %f %d", cmd, &X, &Z, &arg);
+		if (nb <= 0 || cmd[0] == '#') continue;
+		if (count == max)
+		{
+			fprintf(stderr, "line %d: too many steps (max %d)\n", num, max - 1);
+			return -1;
+		}
+		memset(step, 0, sizeof *step);
+		if ((strcmp(cmd, "walk") == 0 || strcmp(cmd, "sprint") == 0) && nb >= 3)
+		{
+			step->type = DRIVE_GOTO;
+			step->arg  = nb == 4 ? arg : cmd[0] == 'w' ? DRIVE_WALK : DRIVE_SPRINT;
+		}
+		else if (strcmp(cmd, "teleport") == 0 && nb == 3) step->type = DRIVE_TELEPORT;
+		else if (strcmp(cmd, "dist")     == 0 && nb == 2) step->type = DRIVE_DIST,   step->arg = X;
+		else if (strcmp(cmd, "wait")     == 0 && nb <= 2) step->type = DRIVE_WAIT,   step->arg = nb == 2 ? X : 0;
+		else if (strcmp(cmd, "wander")   == 0 && nb == 2) step->type = DRIVE_WANDER, step->arg = X;
+		else
+		{
+			fprintf(stderr, "line %d: invalid command: %s\n", num, line);
+			return -1;
+		}
+		if ((step->type == DRIVE_GOTO && step->arg < 1) || (step->type == DRIVE_DIST && (step->arg < 2 || step->arg > 31)) ||
+		    (step->type >= DRIVE_WAIT && step->arg < 0))
+		{
+			fprintf(stderr, "line %d: invalid value: %s\n", num, line);
+			return -1;
+		}
+		step->X = X;
+		step->Z = Z;
+		/* keep command as written for the report, without commas */
+		CopyString(step->line, line, sizeof step->line);
+		for (line = step->line; *line; line ++)
+			if (*line == ',' || *line == '\t') *line = ' ';
+		count ++;
+	}
+	strcpy(steps[0].line, "init");
+	return count;
+}
+
+/* all chunks in render distance have a mesh on GPU */
+static Bool driveLoaded(Map map)
+{
+	return staging.total == 0 && staging.pendingCount == 0 && viewMeshed(map) == map->maxDist * map->maxDist;
+}
+
+/* xorshift: random walk is reproducible (and does not depend on rand() state) */
+static uint32_t driveRandom(uint32_t * seed)
+{
+	uint32_t x = *seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *seed = x;
+}
+
+static int benchDrive(int nb, char * argv[])
+{
+	struct DriveStep_t steps[256];
+	int      workers = mapGetCoreCount() < 2 ? 2 : mapGetCoreCount();
+	int      loaders = 0;
+	int      dist    = 8;
+	int      frameMs = 25;
+	uint32_t seed    = 1;
+	STRPTR   script  = NULL;
+	STRPTR   latency = NULL;
+	STRPTR   buffer;
+	int      i, count, err;
+
+	loadSpeed = 5;
+	for (i = err = 0; i < nb; i ++)
+	{
+		STRPTR arg = argv[i];
+		if      (strcmp(arg, "-seed")    == 0 && i+1 < nb) seed = strtoul(argv[++ i], NULL, 10);
+		else if (strcmp(arg, "-script")  == 0 && i+1 < nb) script = argv[++ i];
+		else if (strcmp(arg, "-threads") == 0 && i+1 < nb) workers = atoi(argv[++ i]);
+		else if (strcmp(arg, "-loaders") == 0 && i+1 < nb) loaders = atoi(argv[++ i]);
+		else if (strcmp(arg, "-dist")    == 0 && i+1 < nb) dist = atoi(argv[++ i]);
+		else if (strcmp(arg, "-load")    == 0 && i+1 < nb) loadSpeed = atoi(argv[++ i]);
+		else if (strcmp(arg, "-region")  == 0 && i+1 < nb) err |= ! benchSource(argv[++ i]);
+		else if (strcmp(arg, "-frame")   == 0 && i+1 < nb) frameMs = atoi(argv[++ i]);
+		else if (strcmp(arg, "-staging") == 0 && i+1 < nb) staging.size = atoi(argv[++ i]) * 1024;
+		else if (strcmp(arg, "-latency") == 0 && i+1 < nb) latency = argv[++ i];
+		else if (strcmp(arg, "-mode")    == 0 && i+1 < nb)
+		{
+			arg = argv[++ i];
+			staging.mode = strcmp(arg, stagingModes[STAGING_BLOCKS]) == 0 ? STAGING_BLOCKS :
+			               strcmp(arg, stagingModes[STAGING_RING])   == 0 ? STAGING_RING :
+			               strcmp(arg, stagingModes[STAGING_ATOMIC]) == 0 ? STAGING_ATOMIC : -1;
+		}
+		else err = 1;
+	}
+
+	if (err || workers < 1 || workers > MAX_THREADS || loaders < 0 || loaders >= workers || dist < 2 || dist > 31 ||
+	    loadSpeed < 0 || frameMs < 1 || staging.size < 0 || staging.mode < 0)
+	{
+		fprintf(stderr, "usage: ChunkBench drive [-seed n] [-script file] [-threads count] [-loaders count] [-dist chunks] "
+			"[-load ms] [-region folder] [-frame ms] [-staging Kb] [-mode mutex|ring|atomic] [-latency file]\n");
+		return 1;
+	}
+
+	if (script)
+	{
+		FILE * in = fopen(script, "rb");
+		int    size;
+		if (in == NULL)
+		{
+			fprintf(stderr, "%s: %s\n", script, GetError());
+			return 1;
+		}
+		fseek(in, 0, SEEK_END); size = ftell(in); fseek(in, 0, SEEK_SET);
+		buffer = calloc(size + 1, 1);
+		fread(buffer, 1, size, in);
+		fclose(in);
+	}
+	else buffer = strdup(driveDefault);
+	count = driveParse(buffer, steps, DIM(steps));
+	free(buffer);
+	if (count < 0) return 1;
+
+	int    XZ[2] = {8, 8};
+	vec4   pos   = {8, 0, 8};
+	vec4   north = {0, 0, -1};
+	int    frames, meshes, loads, peakStaging, peakBanks;
+	double start, worst, changed;
+	Bool   complete;
+	Map    map;
+
+	sourceSeed    = seed;
+	threadCount   = workers;
+	threadLoaders = loaders;
+	map = mapInitFromPath(dist, XZ, ALLOC_SIZECLASS);
+	mapSetViewDir(map, north, VIEW_FOV, True);
+
+	fprintf(stdout, "# seed %u, %d workers (%d loaders), load up to %d ms per chunk, %d ms per frame, staging %s %d Kb\n",
+		seed, workers, loaders, loadSpeed, frameMs, stagingModes[staging.mode], staging.size >> 10);
+	fprintf(stdout, "# step,command,frames,time ms,loaded ms,meshes,loads,chunks/sec,peak staging Kb,peak banks\n");
+
+	start = changed = FrameGetTime();
+	complete = False;
+	for (i = frames = meshes = loads = peakStaging = peakBanks = 0, worst = 0; i < count; i ++)
+	{
+		struct DriveStep_t * step = steps + i;
+		struct GPUStats_t    stats;
+		double begin = FrameGetTime(), loaded = -1;
+		int    frame, j, done[2], staged = 0, banks = 0;
+		float  dirX = 0, dirZ = 0;
+
+		for (j = done[0] = done[1] = 0; j < threadCount; done[0] += threads[j].chunks, done[1] += threads[j].loads, j ++);
+
+		switch (step->type) {
+		case DRIVE_TELEPORT:
+		{
+			vec4 old;
+			memcpy(old, pos, sizeof old);
+			pos[VX] = step->X;
+			pos[VZ] = step->Z;
+			mapMoveCenter(map, old, pos);
+			changed = begin, complete = False;
+		}	break;
+		case DRIVE_DIST:
+			mapSetRenderDist(map, step->arg);
+			changed = begin, complete = False;
+		}
+
+		for (frame = 0; ; frame ++)
+		{
+			double time = FrameGetTime();
+			vec4   old;
+
+			/* move camera: looking where it is going */
+			memcpy(old, pos, sizeof old);
+			if (step->type == DRIVE_GOTO)
+			{
+				float dx  = step->X - pos[VX];
+				float dz  = step->Z - pos[VZ];
+				float len = sqrtf(dx * dx + dz * dz);
+				if (len <= step->arg) pos[VX] = step->X, pos[VZ] = step->Z;
+				else pos[VX] += dx * step->arg / len, pos[VZ] += dz * step->arg / len;
+				dirX = dx;
+				dirZ = dz;
+			}
+			else if (step->type == DRIVE_WANDER && frame < step->arg)
+			{
+				/* new direction (one of 8) every second or so */
+				if (frame % 40 == 0)
+				{
+					int dir = driveRandom(&seed) % 8;
+					dirX = dir == 0 || dir == 4 ? 0 : dir < 4 ? 1 : -1;
+					dirZ = dir == 2 || dir == 6 ? 0 : dir > 2 && dir < 6 ? 1 : -1;
+				}
+				pos[VX] += dirX * DRIVE_WALK;
+				pos[VZ] += dirZ * DRIVE_WALK;
+			}
+			if (old[VX] != pos[VX] || old[VZ] != pos[VZ])
+			{
+				mapSetViewDir(map, (vec4) {dirX, 0, dirZ}, VIEW_FOV, True);
+				/* map has changed: has to be loaded again */
+				if (mapMoveCenter(map, old, pos)) changed = time, complete = False;
+			}
+
+			if (staging.total > 0) mapGenFlush(map);
+			mapTrimChunks(map, TRIM_CHUNKS);
+			renderNextFrame(map);
+
+			/* what is in use at end of frame */
+			j = staging.mode == STAGING_RING ? staging.used : staging.total * 4096;
+			if (staged < j) staged = j;
+			renderGetStats(map, &stats);
+			if (banks < stats.banks) banks = stats.banks;
+			if (! complete && driveLoaded(map))
+			{
+				double lag = FrameGetTime() - changed;
+				if (loaded < lag) loaded = lag;
+				complete = True;
+			}
+
+			/* end of step */
+			switch (step->type) {
+			case DRIVE_GOTO:   if (pos[VX] == step->X && pos[VZ] == step->Z) goto next; break;
+			case DRIVE_WANDER: if (frame + 1 >= step->arg) goto next; break;
+			case DRIVE_INIT:   if (complete) goto next; break;
+			case DRIVE_WAIT:   if (step->arg > 0 ? frame + 1 >= step->arg : complete) goto next; break;
+			default:           goto next;
+			}
+			/* initial load and wait: not forever */
+			if (FrameGetTime() - begin > DRIVE_TIMEOUT) goto next;
+
+			time = frameMs - (FrameGetTime() - time);
+			if (time >= 1) ThreadPause(time);
+		}
+		next:
+		for (j = 0; j < threadCount; done[0] -= threads[j].chunks, done[1] -= threads[j].loads, j ++);
+		begin = FrameGetTime() - begin;
+		frame ++;
+		fprintf(stdout, "%d,%s,%d,%.1f,%.1f,%d,%d,%.1f,%d,%d\n", i, step->line, frame, begin, loaded,
+			-done[0], -done[1], begin > 0 ? -done[0] * 1000. / begin : 0, staged >> 10, banks);
+		fflush(stdout);
+
+		frames += frame;
+		meshes -= done[0];
+		loads  -= done[1];
+		if (peakStaging < staged) peakStaging = staged;
+		if (peakBanks < banks) peakBanks = banks;
+		if (worst < loaded) worst = loaded;
+	}
+	start = FrameGetTime() - start;
+	/* loaded ms: worst of all steps */
+	fprintf(stdout, "total,,%d,%.1f,%.1f,%d,%d,%.1f,%d,%d\n", frames, start, worst, meshes, loads, meshes * 1000. / start,
+		peakStaging >> 10, peakBanks);
+
+	/* per worker histograms are gone once threads are stopped */
+	struct LatencyStats_t lat[LAT_COUNT];
+	static STRPTR stages[] = {"queue", "load", "mesh", "stage", "flush", "total"};
+	mapGenLatency(lat, -1);
+	fprintf(stdout, "# stage,samples,avg ms,p50 ms,p99 ms,max ms\n");
+	for (i = 0; i < LAT_COUNT; i ++)
+		fprintf(stdout, "%s,%d,%.2f,%.2f,%.2f,%.2f\n", stages[i], lat[i].samples, lat[i].avg, lat[i].p50, lat[i].p99, lat[i].max);
+	if (latency)
+	{
+		STRPTR ext = strrchr(latency, '.');
+		if (! mapGenLatencyDump(latency, ext && strcmp(ext, ".json") == 0))
+			fprintf(stderr, "%s: %s\n", latency, GetError());
+	}
+	mapFreeAll(map);
+	threadLoaders = 0;
+	return 0;
+}
+
+/*
+ * scheduler state layout: threads write states of chunks next to each other
+ */
+static struct
+{
+	volatile int go, stop;
+	int          running;
+	Chunk        chunks;
+	int          area, threads;
+	int          ops[MAX_THREADS];
+	unsigned     sum[MAX_THREADS];
+}	layoutBench;
+
+static void layoutWorker(void * arg)
+{
+	int id   = (intptr_t) arg;
+	int area = layoutBench.area;
+	unsigned sum;
+	int ops, i, j;
+	/* 8 neighbors, grid does not wrap: only inner chunks are updated */
+	int around[] = {-area-1, -area, -area+1, -1, 1, area-1, area, area+1};
+
+	while (! layoutBench.go);
+	for (ops = sum = 0; ! layoutBench.stop; )
+	{
+		/* chunks are dealt like cards: neighbors belong to other threads */
+		for (i = area + 1 + id; i < area * (area - 1) - 1; i += layoutBench.threads)
+		{
+			Chunk c = layoutBench.chunks + i;
+			volatile struct ChunkState_t * state = c->state;
+
+			if (i % area == 0 || i % area == area - 1) continue;
+			/* mapGenWaitFor(): read mostly fields of neighbors */
+			for (j = 0; j < DIM(around); j ++)
+			{
+				Chunk n = c + around[j];
+				sum += n->X + n->Z + n->neighbor;
+			}
+			/* load task: claimed, loaded, one dependency less */
+			state->processing = 1;
+			state->cflags |= CFLAG_GOTDATA;
+			state->deps --;
+			state->gen ++;
+			state->processing = 0;
+			ops ++;
+		}
+	}
+	layoutBench.ops[id] = ops;
+	layoutBench.sum[id] = sum;
+	__sync_fetch_and_sub(&layoutBench.running, 1);
+}
+
+/* cache lines holding states written by more than one thread in layoutWorker() (does not need several cores) */
+static int layoutSharedLines(void)
+{
+	intptr_t line = -1;
+	int area = layoutBench.area;
+	int owner = -1, shared = 0, i;
+
+	/* states are allocated in chunk order (and never straddle lines): lines are met one after the other */
+	for (i = area + 1; i < area * (area - 1) - 1; i ++)
+	{
+		intptr_t start = (intptr_t) layoutBench.chunks[i].state / CACHE_LINE;
+		int      id    = (i - area - 1) % layoutBench.threads;
+
+		if (i % area == 0 || i % area == area - 1) continue;
+		if (start != line)
+			line = start, owner = id;
+		else if (owner >= 0 && owner != id)
+			owner = -1, shared ++;
+	}
+	return shared;
+}
+
+/* return state updates/sec */
+static double layoutRun(int count, int area, int time, int * shared)
+{
+	double start, elapsed;
+	int    i, ops;
+
+	memset(&layoutBench, 0, sizeof layoutBench);
+	layoutBench.chunks  = mapAllocArea(area);
+	layoutBench.area    = area;
+	layoutBench.threads = count;
+	layoutBench.running = count;
+	*shared = layoutSharedLines();
+	for (i = 0; i < area * area; layoutBench.chunks[i].X = i % area << 4, layoutBench.chunks[i].Z = i / area << 4, i ++);
+	for (i = 0; i < count; i ++)
+		ThreadCreate(layoutWorker, (APTR) (intptr_t) i);
+
+	start = FrameGetTime();
+	layoutBench.go = 1;
+	ThreadPause(time);
+	layoutBench.stop = 1;
+	while (__sync_fetch_and_add(&layoutBench.running, 0) > 0)
+		ThreadPause(1);
+	elapsed = FrameGetTime() - start;
+
+	for (i = ops = 0; i < count; ops += layoutBench.ops[i], i ++);
+	free(layoutBench.chunks);
+	return ops * 1000. / elapsed;
+}
+
+static int benchLayout(int nb, char * argv[])
+{
+	int count = 8;
+	int dist  = 8;
+	int time  = 1000;
+	int i, err;
+
+	loadSpeed = 0;
+	for (i = err = 0; i < nb; i ++)
+	{
+		STRPTR arg = argv[i];
+		if      (strcmp(arg, "-threads") == 0 && i+1 < nb) count = atoi(argv[++ i]);
+		else if (strcmp(arg, "-dist")    == 0 && i+1 < nb) dist  = atoi(argv[++ i]);
+		else if (strcmp(arg, "-time")    == 0 && i+1 < nb) time  = atoi(argv[++ i]);
+		else if (strcmp(arg, "-load")    == 0 && i+1 < nb) loadSpeed = atoi(argv[++ i]);
+		else err = 1;
+	}
+
+	if (err || count < 1 || count > MAX_THREADS || dist < 2 || dist > 31 || time < 1 || loadSpeed < 0)
+	{
+		fprintf(stderr, "usage: ChunkBench layout [-threads count] [-dist chunks] [-time ms] [-load ms]\n");
+		return 1;
+	}
+
+	fprintf(stdout, "# %d cores, %d threads, ChunkState_t: %d bytes, Chunk_t: %d bytes, ChunkData_t: %d bytes\n",
+		mapGetCoreCount(), count, (int) sizeof (struct ChunkState_t), (int) sizeof (Chunk_t), (int) sizeof (ChunkData_t));
+	if (mapGetCoreCount() < 2)
+		fprintf(stdout, "# single core: threads never write at the same time, timings cannot show false sharing\n");
+	fprintf(stdout, "# layout,stride,lines written by several threads,state updates/sec,chunks/sec\n");
+	for (i = 0; i < 2; i ++)
+	{
+		float  load[MAX_THREADS];
+		int    locality[2], shared;
+		double waited, updates, rate;
+
+		chunkStateStride = i == 0 ? sizeof (struct ChunkState_t) : CACHE_LINE;
+		updates = layoutRun(count, dist * 2 + 4, time, &shared);
+		rate    = workerRun(count, dist, load, locality, &waited);
+		fprintf(stdout, "%s,%d,%d,%.0f,%.1f\n", i == 0 ? "packed" : "padded", chunkStateStride, shared, updates, rate);
+		fflush(stdout);
+	}
+	chunkStateStride = CACHE_LINE;
+	return 0;
+}
+
+/*
+ * region files: raw loading throughput (mapping, decompression, mesh size estimation)
+ */
+static struct
+{
+	ChunkSource source;
+	int         next, count;       /* chunks left to load */
+	int         radius;
+	int         running;
+}	regionBench;
+
+static void regionLoader(void * arg)
+{
+	int   side = regionBench.radius * 2 + 1;
+	int   i, j;
+
+	while ((i = __sync_fetch_and_add(&regionBench.next, 1)) < regionBench.count)
+	{
+		Chunk_t chunk;
+		memset(&chunk, 0, sizeof chunk);
+		/* chunks around 8, 8: thread id is only used to pick a decompression buffer */
+		regionBench.source->load(regionBench.source, &chunk, (i % side - regionBench.radius) * 16 + 8,
+			(i / side - regionBench.radius) * 16 + 8, (intptr_t) arg);
+		for (j = 0; j < chunk.maxy; free(chunk.layer[j]), j ++);
+	}
+	__sync_fetch_and_sub(&regionBench.running, 1);
+}
+
+static int benchRegion(int nb, char * argv[])
+{
+	STRPTR folder = NULL;
+	int    max    = mapGetCoreCount();
+	int    radius = 48;
+	int    seed   = 1;
+	int    i, count, err;
+
+	for (i = err = 0; i < nb; i ++)
+	{
+		STRPTR arg = argv[i];
+		if      (strcmp(arg, "-radius")  == 0 && i+1 < nb) radius = atoi(argv[++ i]);
+		else if (strcmp(arg, "-seed")    == 0 && i+1 < nb) seed = atoi(argv[++ i]);
+		else if (strcmp(arg, "-threads") == 0 && i+1 < nb) max = atoi(argv[++ i]);
+		else if (folder == NULL && arg[0] != '-') folder = arg;
+		else err = 1;
+	}
+
+	if (max > MAX_THREADS) max = MAX_THREADS;
+	if (err || folder == NULL || max < 1 || radius < 1)
+	{
+		fprintf(stderr, "usage: ChunkBench region <folder> [-radius chunks] [-seed number] [-threads max]\n");
+		return 1;
+	}
+
+	double start = FrameGetTime();
+	int    bytes = sourceGenRegions(folder, 8, 8, radius, seed);
+	if (bytes < 0)
+	{
+		fprintf(stderr, "%s: can't write region files: %s\n", folder, GetError());
+		return 1;
+	}
+	regionBench.radius = radius;
+	regionBench.count  = (radius * 2 + 1) * (radius * 2 + 1);
+	fprintf(stdout, "# %d chunks written in %.1f ms, %d Kb on disk, %d cores\n", regionBench.count,
+		FrameGetTime() - start, bytes >> 10, mapGetCoreCount());
+	fprintf(stdout, "# threads,chunks/sec,read MB/sec,inflated MB/sec,empty,errors\n");
+
+	for (count = 1; count <= max; count = count < max && count * 2 > max ? max : count * 2)
+	{
+		/* files are mapped again: first pass includes page faults from the OS cache */
+		regionBench.source  = sourceOpenRegions(folder);
+		regionBench.next    = 0;
+		regionBench.running = count;
+
+		start = FrameGetTime();
+		for (i = 0; i < count; i ++)
+			ThreadCreate(regionLoader, (APTR) (intptr_t) i);
+		while (__sync_fetch_and_add(&regionBench.running, 0) > 0)
+			ThreadPause(1);
+		start = FrameGetTime() - start;
+
+		ChunkSource source = regionBench.source;
+		fprintf(stdout, "%d,%.1f,%.1f,%.1f,%d,%d\n", count, source->chunks * 1000. / start,
+			source->bytesRead / (1024. * 1024) * 1000. / start, source->bytesInflated / (1024. * 1024) * 1000. / start,
+			source->empty, source->errors);
+		fflush(stdout);
+		sourceClose(source);
+		if (count == max) break;
+	}
+	return 0;
+}
+
+int main(int nb, char * argv[])
+{
+	if (nb > 1 && strcmp(argv[1], "replay") == 0)
+		return benchReplay(nb - 2, argv + 2);
+	if (nb > 1 && strcmp(argv[1], "blocks") == 0)
+		return benchBlocks(nb - 2, argv + 2);
+	if (nb > 1 && strcmp(argv[1], "bitmap") == 0)
+		return benchBitmap(nb - 2, argv + 2);
+	if (nb > 1 && strcmp(argv[1], "workers") == 0)
+		return benchWorkers(nb - 2, argv + 2);
+	if (nb > 1 && strcmp(argv[1], "view") == 0)
+		return benchView(nb - 2, argv + 2);
+	if (nb > 1 && strcmp(argv[1], "stages") == 0)
+		return benchStages(nb - 2, argv + 2);
+	if (nb > 1 && strcmp(argv[1], "region") == 0)
+		return benchRegion(nb - 2, argv + 2);
+	if (nb > 1 && strcmp(argv[1], "cache") == 0)
+		return benchCache(nb - 2, argv + 2);
+	if (nb > 1 && strcmp(argv[1], "prefetch") == 0)
+		return benchPrefetch(nb - 2, argv + 2);
+	if (nb > 1 && strcmp(argv[1], "resize") == 0)
+		return benchResize(nb - 2, argv + 2);
+	if (nb > 1 && strcmp(argv[1], "drive") == 0)
+		return benchDrive(nb - 2, argv + 2);
+	if (nb > 1 && strcmp(argv[1], "layout") == 0)
+		return benchLayout(nb - 2, argv + 2);
+
+	fprintf(stderr, "usage: ChunkBench <command> [args]\n\nwhere command is:\n"
+		"  replay <file.trace>: replay an allocation trace recorded by ChunkLoad\n"
+		"  blocks: staging blocks allocation throughput, from 1 to 16 threads\n"
+		"  bitmap: staging block bitmap, single thread alloc/free\n"
+		"  workers: chunks/sec against number of worker threads\n"
+		"  view: time until chunks in view have a mesh, spiral order against view priority\n"
+		"  stages: loader / mesh / upload pipeline against number of loader threads\n"
+		"  region <folder>: write synthetic region files, loading throughput against number of threads\n"
+		"  cache: chunks loaded again when walking back and forth, with and without chunk cache\n"
+		"  prefetch: chunks already loaded when entering the map, against rings prefetched ahead\n"
+		"  resize: main thread stall of render distance changes, time until new area is complete\n"
+		"  drive: load test following a camera path script, deterministic for a given seed\n"
+		"  layout: false sharing of chunk scheduler state, packed against one cache line per chunk\n");
+	return 1;
+}
@@ -10,483 +10,1227 @@
 #include <stdlib.h>
 #include <malloc.h>
 #include <math.h>
-#include "SIT.h"
+#include "UtilityLibLite.h"
+#define BITPOOL_IMPL
 #include "ChunkLoad.h"
 
-struct Thread_t  threads[NUM_THREADS];
+struct Thread_t  threads[MAX_THREADS];
+int threadCount;
+int threadLoaders;
 struct Frustum_t frustum;
 struct Staging_t staging;
+int chunkStateStride = CACHE_LINE;
 
 int16_t chunkNeighbor[16*9];
-extern int loadSpeed;
 static volatile int threadStop;
+static double threadSample;
+static Semaphore threadDone;       /* one SemAdd() per thread exiting */
+void (*mapNotify)(void);
 
-static void renderFreeArray(ChunkData cd);
-
-#define END_OF_LIST        0xffffffff
 #define THREAD_EXIT_LOOP   1
 #define THREAD_EXIT        2
 
-/* thoroughly checks that all data structure are coherent */
-int checkMem(GPUBank bank)
+static void mapGenGrabReady(void);
+
+/*
+ * chunk cache: data of chunks leaving the map is kept (up to cache.budget bytes, least recently evicted
+ * are dropped first), chunkLoad() takes it back instead of asking chunkSource. Meshes are not kept.
+ */
+static inline CacheEntry * chunkCacheSlot(struct ChunkCache_t * cache, int X, int Z)
+{
+	uint32_t hash = (uint32_t) (X >> 4) * 73856093u ^ (uint32_t) (Z >> 4) * 19349663u;
+	return cache->hash + (hash & (CACHE_HASH - 1));
+}
+
+static void chunkCacheRemove(struct ChunkCache_t * cache, CacheEntry entry)
+{
+	CacheEntry * prev;
+	for (prev = chunkCacheSlot(cache, entry->X, entry->Z); *prev != entry; prev = &prev[0]->next);
+	*prev = entry->next;
+	ListRemove(&cache->lru, &entry->node);
+	cache->bytes -= entry->bytes;
+	cache->count --;
+}
+
+/* free oldest entries until cache fits within its budget (cache.lock must be held) */
+static void chunkCacheTrim(struct ChunkCache_t * cache, int budget)
 {
-	if (bank->freeItem > 0)
+	while (cache->bytes > budget)
 	{
-		GPUMem free = bank->usedList + bank->maxItems - 1;
-		GPUMem eof  = free - bank->freeItem + 1;
+		CacheEntry entry = (CacheEntry) cache->lru.lh_Head;
+		int i;
+		chunkCacheRemove(cache, entry);
+		for (i = 0; i < entry->maxy; free(entry->layer[i]), i ++);
+		free(entry);
+		cache->dropped ++;
+	}
+}
 
-		while (free > eof)
-		{
-			GPUMem next = free - 1;
+/* <c> is about to be recycled (or <prefetched>): keep its data (not on GPU), returns False if cache is disabled */
+static Bool chunkCacheAdd(struct ChunkCache_t * cache, Chunk c, Bool prefetched)
+{
+	CacheEntry entry, * slot;
+	int        bytes = sizeof *entry + c->maxy * sizeof (ChunkData_t);
+	int        i;
+
+	if (bytes > cache->budget || (entry = malloc(sizeof *entry)) == NULL)
+		return False;
+
+	entry->X = c->X;
+	entry->Z = c->Z;
+	entry->bytes = bytes;
+	entry->maxy  = c->maxy;
+	entry->prefetched = prefetched;
+	for (i = 0; i < c->maxy; i ++)
+	{
+		ChunkData cd = entry->layer[i] = c->layer[i];
+		if (cd) cd->chunk = NULL;
+	}
 
-			if (next->offset <= free->offset + free->size)
-				/* must be ordered by increasing <offset>, without range overlapping */
-				return 1;
+	MutexEnter(cache->lock);
+	slot = chunkCacheSlot(cache, c->X, c->Z);
+	entry->next = *slot;
+	*slot = entry;
+	ListAddTail(&cache->lru, &entry->node);
+	cache->bytes += bytes;
+	cache->count ++;
+	cache->prefetched += prefetched;
+	chunkCacheTrim(cache, cache->budget);
+	MutexLeave(cache->lock);
+	return True;
+}
 
-			free --;
-		}
+/* data of chunk at <X>, <Z> if it is still in cache: moved into <c> */
+static Bool chunkCacheGet(struct ChunkCache_t * cache, Chunk c, int X, int Z)
+{
+	CacheEntry entry;
+	int        i;
 
-		if (free->offset + free->size == bank->memUsed)
-			/* last block is freed: it should reduce the range of memory used */
-			return 2;
+	MutexEnter(cache->lock);
+	for (entry = *chunkCacheSlot(cache, X, Z); entry && (entry->X != X || entry->Z != Z); entry = entry->next);
+	if (entry)
+	{
+		chunkCacheRemove(cache, entry);
+		cache->hits ++;
+		cache->prefetchHits += entry->prefetched;
 	}
-	return 0;
+	else cache->misses ++;
+	MutexLeave(cache->lock);
+
+	if (entry)
+	{
+		for (i = 0; i < entry->maxy; i ++)
+		{
+			ChunkData cd = c->layer[i] = entry->layer[i];
+			if (cd) cd->chunk = c;
+		}
+		c->maxy = entry->maxy;
+		free(entry);
+		return True;
+	}
+	return False;
 }
 
-/* malloc()-like function */
-static int renderStoreArrays(Map map, ChunkData cd, int size)
+/* chunk at <X>, <Z> is in cache (won't be for long if cache is full) */
+static Bool chunkCacheHas(struct ChunkCache_t * cache, int X, int Z)
 {
-	GPUBank bank;
+	CacheEntry entry;
+	MutexEnter(cache->lock);
+	for (entry = *chunkCacheSlot(cache, X, Z); entry && (entry->X != X || entry->Z != Z); entry = entry->next);
+	MutexLeave(cache->lock);
+	return entry != NULL;
+}
 
-	if (size == 0)
+/* can be called from any thread: <keep> data in cache, chunk will be needed again if player comes back */
+static void chunkFree(Map map, Chunk c, Bool keep)
+{
+	int i;
+	for (i = 0; i < DIM(c->layer); i ++)
 	{
-		if (cd->glBank)
+		ChunkData cd = c->layer[i];
+		if (cd)
 		{
-			renderFreeArray(cd);
-			cd->glBank = NULL;
+			if (cd->glBank)
+				renderFreeArray(map, cd);
+			if (cd->glResBank)
+				renderCancelReserve(map, cd);
 		}
-		return -1;
 	}
+	if (! keep || (c->state->cflags & CFLAG_GOTDATA) == 0 || ! chunkCacheAdd(&map->cache, c, False))
+		for (i = 0; i < DIM(c->layer); free(c->layer[i]), i ++);
+	memset(c->layer, 0, sizeof c->layer);
+	memset(c->stamp, 0, sizeof c->stamp);
+	c->state->cflags = 0;
+	c->maxy = 0;
+}
 
-	for (bank = HEAD(map->gpuBanks); bank && bank->memAvail <= bank->memUsed + size /* bank is full */; NEXT(bank));
+Bool chunkLoad(Map map, Chunk chunk, int x, int z, int id)
+{
+	static int color = 0;
+	if (chunk->X != x || chunk->Z != z)
+	{
+		/* slot reused: meshes of previous chunk still in staging must not be uploaded */
+		MutexEnter(map->genLock);
+		chunk->state->gen ++;
+		chunkFree(map, chunk, True);
+		MutexLeave(map->genLock);
+	}
 
-	if (bank == NULL)
+	if ((chunk->state->cflags & CFLAG_GOTDATA) == 0)
 	{
-		bank = calloc(sizeof *bank, 1);
-		bank->memAvail = MEMPOOL;
-		bank->maxItems = MEMITEM;
-		bank->usedList = calloc(sizeof *bank->usedList, MEMITEM);
+		//fprintf(stderr, "thread %d: loaded chunk %d, %d: %d\n", id, x, z, chunk->state->processing);
+		chunk->X = x;
+		chunk->Z = z;
+		chunk->maxy = 0;
+		chunk->color = color ++;
 
-		#if 0
-		glGenVertexArrays(1, &bank->vaoTerrain);
-		/* will also init vboLocation and vboMDAI */
-		glGenBuffers(3, &bank->vboTerrain);
+		if (chunk->layer[0])
+			fprintf(stderr, "memory leak likely on chunkLoad()\n");
 
-		/* pre-configure terrain VAO: 5 bytes per vertex */
-		glBindVertexArray(bank->vaoTerrain);
-		glBindBuffer(GL_ARRAY_BUFFER, bank->vboTerrain);
-		/* this will allocate memory on the GPU: mem chunks of 20Mb */
-		glBufferData(GL_ARRAY_BUFFER, MEMPOOL, NULL, GL_STATIC_DRAW);
-		glVertexAttribIPointer(0, 4, GL_UNSIGNED_INT, VERTEX_DATA_SIZE, 0);
-		glEnableVertexAttribArray(0);
-		glVertexAttribIPointer(1, 3, GL_UNSIGNED_INT, VERTEX_DATA_SIZE, (void *) 16);
-		glEnableVertexAttribArray(1);
-		/* 16 bytes of per-instance data (3 float for loc and 1 uint for flags) */
-		glBindBuffer(GL_ARRAY_BUFFER, bank->vboLocation);
-		glVertexAttribPointer(2, 4, GL_FLOAT, 0, 0, 0);
-		glEnableVertexAttribArray(2);
-		glVertexAttribDivisor(2, 1);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		#endif
+		/* no chunk at this location: still loaded (empty) */
+		if (map->cache.budget == 0 || ! chunkCacheGet(&map->cache, chunk, x, z))
+			chunkSource->load(chunkSource, chunk, x, z, id);
+		return True;
+	}
+	return False;
+}
 
-		ListAddTail(&map->gpuBanks, &bank->node);
+/*
+ * task graph: a chunk is loaded by a TASK_LOAD, its mesh is generated by a TASK_MESH that is queued once
+ * the 3x3 chunks around have been loaded (ChunkState_t.deps). Each chunk is loaded once and threads never wait
+ * on each other: the thread that loads the last dependency of a mesh generates it right away.
+ *
+ * pipeline (threadLoaders > 0): loader threads only take TASK_LOAD, mesh threads TASK_MESH, main thread uploads
+ * (mapGenFlush()). Backpressure: mesh threads block when staging area is full, loader threads when mesh threads
+ * have STAGE_DEPTH runnable meshes each.
+ *
+ * prefetch: chunks beyond the lazy ring in the direction the player is moving are loaded with the lowest priority
+ * (TASK_PREFETCH, by loader threads) into map->cache, chunkLoad() will find them there once they enter the map.
+ *
+ * work queues: one per thread, sorted on priority (mapChunkPriority()): thread pops its own queue from the
+ * near end, unless another queue has much more urgent tasks (in view), when all are empty it steals from
+ * the far end of the others. Items are re-keyed in place when player moves or turns (mapGenRequeue(),
+ * mapSetViewDir()), threads keep running meanwhile.
+ */
+#define QUEUE_EMPTY       (1 << 30)
+#define PREFETCH_KEY      (1 << 29)   /* added to priority of TASK_PREFETCH: after any other task */
+#define PREFETCH_COS      0.7071f     /* chunks within 45 degrees of travel direction are prefetched */
+#define TASK_STAGE(type)  ((type) == TASK_MESH ? TASK_MESH : TASK_LOAD)
+#define QUEUE_FIRST(queue) \
+	((queue)->first = (queue)->head < (queue)->tail ? (queue)->items[(queue)->head].prio : QUEUE_EMPTY)
+
+/* 3x3 chunks around (bitfield: &1:+Z, &2:+X, &4:-Z, &8:-X), with offset in map coord */
+static uint8_t chunkAround[] = {12, 4, 6, 8, 0, 2, 9, 1, 3};
+#define DIR_DX(dir)       ((dir) & 8 ? -16 : (dir) & 2 ? 16 : 0)
+#define DIR_DZ(dir)       ((dir) & 4 ? -16 : (dir) & 1 ? 16 : 0)
+
+/* thread ids taking TASK_LOAD [0] / TASK_MESH [1] (all threads in both if threadLoaders == 0) */
+static int stageThreads[2][MAX_THREADS];
+static int stageCount[2];
+
+/* latency of stages after LAT_WORKER (main thread only), see mapGenLatency() */
+static struct Histogram_t latMain[LAT_COUNT - LAT_WORKER];
+
+/* log-linear bucket of <us>: values below HISTO_SUB are exact, then HISTO_SUB buckets per power of 2 */
+static int histoBucket(uint32_t us)
+{
+	int msb;
+	if (us < HISTO_SUB) return us;
+	msb = 31 - __builtin_clz(us);
+	return (msb - HISTO_LOG2 + 1) * HISTO_SUB + ((us >> (msb - HISTO_LOG2)) & (HISTO_SUB - 1));
+}
+
+static void histoAdd(Histogram histo, double ms)
+{
+	uint32_t us = ms <= 0 ? 0 : ms >= 4e6 ? 4000000000u : (uint32_t) (ms * 1000);
+	histo->count[histoBucket(us)] ++;
+	histo->samples ++;
+	histo->sum += us;
+	if (histo->max < us) histo->max = us;
+}
+
+/* semaphore threads taking <type> tasks sleep on */
+static Semaphore mapGenStageSem(Map map, int type)
+{
+	return TASK_STAGE(type) == TASK_LOAD && threadLoaders > 0 ? map->loadCount : map->genCount;
+}
+
+static void mapGenPushWork(Map map, WorkQueue queue, Chunk chunk, int type, int prio)
+{
+	struct WorkItem_t * item;
+	MutexEnter(queue->lock);
+	if (queue->tail == queue->max)
+	{
+		queue->max += 64;
+		queue->items = realloc(queue->items, queue->max * sizeof *queue->items);
 	}
+	item = queue->items + queue->tail ++;
+	item->chunk = chunk;
+	item->gen   = chunk->state->gen;
+	item->prio  = prio;
+	item->type  = type;
+	chunk->state->queued = type;
+	if (TASK_STAGE(type) == TASK_LOAD) queue->loads ++;
+	QUEUE_FIRST(queue);
+	MutexLeave(queue->lock);
+	SemAdd(mapGenStageSem(map, type), 1);
+}
+
+static void mapGenClearWork(WorkQueue queue)
+{
+	int i;
+	for (i = queue->head; i < queue->tail; queue->items[i].chunk->state->queued = 0, i ++);
+	queue->head = queue->tail = queue->loads = 0;
+	queue->first = QUEUE_EMPTY;
+}
 
-	/* check for free space in the bank */
-	GPUMem store = bank->usedList + bank->nbItem;
-	GPUMem free  = bank->usedList + bank->maxItems - 1;
-	GPUMem eof   = free - bank->freeItem + 1;
-	int    off   = bank->memUsed;
-	while (free >= eof)
+/* tasks of <type> in work queues (including obsolete items), read without lock: only a hint */
+static int mapGenDepth(int type)
+{
+	int i, depth;
+	for (i = depth = 0; i < threadCount; i ++)
 	{
-		/* first place available */
-		if (size <= free->size)
+		WorkQueue queue = &threads[i].work;
+		int loads = __atomic_load_n(&queue->loads, __ATOMIC_RELAXED);
+		depth += type == TASK_LOAD ? loads : __atomic_load_n(&queue->tail, __ATOMIC_RELAXED) -
+			__atomic_load_n(&queue->head, __ATOMIC_RELAXED) - loads;
+	}
+	return depth;
+}
+
+/* <extra>: 0 = render area, 1 = including the ring around (loaded for meshes of the border) */
+static Bool mapInRange(Map map, Chunk c, int extra)
+{
+	int dist = (map->maxDist >> 1) + extra;
+	return abs((c->X >> 4) - CPOS(map->cx)) <= dist && abs((c->Z >> 4) - CPOS(map->cz)) <= dist;
+}
+
+/* chunk at <dx>, <dz> (in chunks from player) is within horizontal field of view */
+static Bool mapInView(Map map, int dx, int dz)
+{
+	int dist = dx * dx + dz * dz;
+	/* chunks around player are visible whatever the direction */
+	return dist <= 2 || dx * map->viewX + dz * map->viewZ >= map->viewCos * sqrtf(dist);
+}
+
+/* generation order (lowest first): squared distance x4 in view, x8 - x24 outside depending on angle to view */
+static int mapChunkPriority(Map map, int dx, int dz)
+{
+	int dist = dx * dx + dz * dz;
+	if (! map->viewPrio || mapInView(map, dx, dz))
+		return dist * 4;
+	return dist * (int) (16 - 8 * (dx * map->viewX + dz * map->viewZ) / sqrtf(dist));
+}
+
+/* meshes before loads of same priority: they are closer to be done */
+static int mapTaskKey(Map map, Chunk c, int type)
+{
+	return mapChunkPriority(map, (c->X >> 4) - CPOS(map->cx), (c->Z >> 4) - CPOS(map->cz)) * 2 + (type == TASK_LOAD);
+}
+
+static Bool mapGenWaitFor(Map map, Chunk mesh, Chunk load, int dir);
+
+/* load is as urgent as the most urgent mesh waiting for it (genLock held) */
+static int mapLoadKey(Map map, Chunk c)
+{
+	int key = mapTaskKey(map, c, TASK_LOAD);
+	int i;
+	for (i = 0; i < DIM(chunkAround); i ++)
+	{
+		int   dir  = chunkAround[i];
+		Chunk mesh = c + map->chunkOffsets[c->neighbor + dir];
+		if (mapGenWaitFor(map, mesh, c, dir))
 		{
-			/* no need to keep track of such a small quantity (typical chunk mesh is around 10Kb) */
-			if (size + 2*4096 >= free->size)
-				size = free->size;
-			off = free->offset;
-			if (free->size == size)
-			{
-				/* freed slot entirely reused */
-				bank->freeItem --;
-				/* free list must be contiguous */
-				memmove(eof + 1, eof, (DATA8) free - (DATA8) eof);
-			}
-			else /* still some capacity left */
-			{
-				free->size -= size;
-				free->offset += size;
-			}
-			goto found;
+			int prio = mapTaskKey(map, mesh, TASK_LOAD);
+			if (prio < key) key = prio;
 		}
-		free --;
 	}
-	bank->memUsed += size;
-	found:
-	/* no free block big enough: alloc at the end */
-	if (bank->nbItem + bank->freeItem + 1 > bank->maxItems)
+	return key;
+}
+
+/* prefetched chunk <c> is still outside lazy ring and not too far */
+static Bool mapGenPrefetchWanted(Map map, Chunk c)
+{
+	return ! mapInRange(map, c, 1) && mapInRange(map, c, 1 + map->prefetchRings);
+}
+
+static int sortByWorkPrio(const void * item1, const void * item2)
+{
+	return ((struct WorkItem_t *)item1)->prio - ((struct WorkItem_t *)item2)->prio;
+}
+
+/* player has moved/turned: drop obsolete items and sort others on new priority (genLock held), return items left */
+static int mapGenRekeyWork(Map map, WorkQueue queue)
+{
+	struct WorkItem_t * item, * keep, * end;
+
+	MutexEnter(queue->lock);
+	queue->loads = 0;
+	for (item = keep = queue->items + queue->head, end = queue->items + queue->tail; item < end; item ++)
 	{
-		/* not enough items */
-		store = realloc(bank->usedList, (bank->maxItems + MEMITEM) * sizeof *store);
-		if (store)
+		Chunk c = item->chunk;
+		/* claimed by a thread or slot reused since */
+		if (c->state->queued != item->type || c->state->gen != item->gen) continue;
+		if (item->type == TASK_PREFETCH ? ! mapGenPrefetchWanted(map, c) : ! mapInRange(map, c, item->type == TASK_LOAD))
 		{
-			/* keep free list at the end */
-			fprintf(stderr, "reallocating from %d to %d\n", bank->maxItems, bank->maxItems+MEMITEM);
-			memmove(store + bank->maxItems + MEMITEM - bank->freeItem, store + bank->maxItems - bank->freeItem, bank->freeItem * sizeof *store);
-			memset(store + bank->maxItems - bank->freeItem, 0, MEMITEM * sizeof *store);
-			bank->maxItems += MEMITEM;
-			bank->usedList = store;
+			c->state->queued = 0;
+			continue;
 		}
-		else { fprintf(stderr, "alloc failed: aborting\n"); return -1; }
+		switch (item->type) {
+		case TASK_LOAD:     item->prio = mapLoadKey(map, c); break;
+		case TASK_MESH:     item->prio = mapTaskKey(map, c, TASK_MESH); break;
+		case TASK_PREFETCH: item->prio = PREFETCH_KEY + mapTaskKey(map, c, TASK_LOAD);
+		}
+		queue->loads += TASK_STAGE(item->type) == TASK_LOAD;
+		*keep ++ = *item;
 	}
-	store = bank->usedList + bank->nbItem;
-	store->size = size;
-	store->offset = off;
+	queue->tail = keep - queue->items;
+	/* items is NULL if queue has never been used */
+	if (queue->tail > queue->head)
+		qsort(queue->items + queue->head, queue->tail - queue->head, sizeof *item, sortByWorkPrio);
+	QUEUE_FIRST(queue);
+	MutexLeave(queue->lock);
+	return queue->tail - queue->head;
+}
 
-	bank->nbItem ++;
-	store->cd = cd;
-	store->id = cd->chunk->color;
-	cd->glSlot = bank->nbItem - 1;
-	cd->glSize = size;
-	cd->glBank = bank;
+/* angular sectors: chunks of one queue are next to each other (and will share neighbors) */
+static WorkQueue mapGenSector(Map map, Chunk c, int type)
+{
+	int stage  = TASK_STAGE(type) - 1;
+	int nb     = stageCount[stage] > 0 ? stageCount[stage] : 1;
+	int sector = (atan2((c->Z >> 4) - CPOS(map->cz), (c->X >> 4) - CPOS(map->cx)) + M_PI) * nb / (2 * M_PI);
+	return &threads[stageThreads[stage][sector % nb]].work;
+}
 
-	fprintf(stderr, "alloc chunk at %d, %d: %d/%d (%d+%d)\n", cd->chunk->X, cd->chunk->Z, bank->freeItem + bank->nbItem, bank->maxItems, bank->freeItem, bank->nbItem);
+/*
+ * following functions must be called with genLock held, <thread> is the one creating tasks (NULL: main thread),
+ * it keeps those it can run, others are pushed by sector to threads of the stage.
+ */
+static void mapGenQueue(Map map, struct Thread_t * thread, Chunk c, int type, int prio)
+{
+	WorkQueue queue = thread && (thread->stage == 0 || thread->stage == TASK_STAGE(type)) ? &thread->work : mapGenSector(map, c, type);
+	mapGenPushWork(map, queue, c, type, prio);
+}
 
-	if (bank->nbItem + bank->freeItem > bank->maxItems)
-		puts("no good");
+/* <c> is loaded at <X>, <Z> */
+static Bool mapGenIsLoaded(Chunk c, int X, int Z)
+{
+	return (c->state->cflags & CFLAG_GOTDATA) && c->X == X && c->Z == Z;
+}
 
-	int ret = checkMem(bank);
-	if (ret > 0)
-		fprintf(stderr, "error alloc code = %d for chunk %d\n", ret, cd->chunk->color);
+/* <mesh> (at <dir> from <load>) is still waiting for <load> to be loaded */
+static Bool mapGenWaitFor(Map map, Chunk mesh, Chunk load, int dir)
+{
+	ChunkState state = mesh->state;
+	return state->deps > 0 && mesh->X == load->X + DIR_DX(dir) && mesh->Z == load->Z + DIR_DZ(dir) &&
+		(state->cflags & CFLAG_HASMESH) == 0 && state->queued != TASK_MESH && ! state->claimed && ! state->redo &&
+		mapInRange(map, mesh, 0);
+}
 
-	return store->offset;
+/* queue loading of <c> (chunk at <X>, <Z>) unless already done or under way */
+static void mapGenNeedLoad(Map map, Chunk c, int X, int Z, struct Thread_t * thread)
+{
+	ChunkState state = c->state;
+
+	/* slot not recycled yet: mapGenSettle() will check again */
+	if (c->X != X || c->Z != Z || state->redo) return;
+	if ((state->cflags & CFLAG_GOTDATA) || state->processing || state->queued || state->claimed) return;
+	/* keep first time: load might be dropped and queued again */
+	if (c->stamp[STAMP_QUEUED] == 0) c->stamp[STAMP_QUEUED] = FrameGetTime();
+	mapGenQueue(map, thread, c, TASK_LOAD, mapLoadKey(map, c));
 }
 
-/* mark memory occupied by the array as free */
-static void renderFreeArray(ChunkData cd)
+/* <c> (within render area) needs a mesh: count its dependencies and queue their loading, or the mesh if none */
+static void mapGenNeedMesh(Map map, Chunk c, struct Thread_t * thread)
 {
-	GPUMem  free;
-	GPUBank bank  = cd->glBank;
-	GPUMem  mem   = bank->usedList + cd->glSlot;
-	GPUMem  eof   = bank->usedList + bank->nbItem - 1;
-	int     start = mem->offset;
-	int     size  = mem->size;
-	int     end   = start + size;
+	ChunkState state = c->state;
+	int        i;
 
-	cd->glBank = NULL;
-//	fprintf(stderr, "freeing chunk %d at %d\n", cd->chunk->color, cd->glSlot);
+	if ((state->cflags & CFLAG_HASMESH) || state->queued == TASK_MESH || state->claimed || state->redo) return;
+	if (c->stamp[STAMP_NEEDED] == 0) c->stamp[STAMP_NEEDED] = FrameGetTime();
 
-	if (mem < eof)
+	for (i = state->deps = 0; i < DIM(chunkAround); i ++)
 	{
-		/* keep block list contiguous, but not necessarily ordered */
-		mem[0] = eof[0];
-		eof->cd->glSlot = cd->glSlot;
+		int   dir  = chunkAround[i];
+		Chunk load = c + map->chunkOffsets[c->neighbor + dir];
+		int   X    = c->X + DIR_DX(dir);
+		int   Z    = c->Z + DIR_DZ(dir);
+		if (! mapGenIsLoaded(load, X, Z))
+			state->deps ++, mapGenNeedLoad(map, load, X, Z, thread);
 	}
-	bank->nbItem --;
+	if (state->deps == 0)
+		mapGenQueue(map, thread, c, TASK_MESH, mapTaskKey(map, c, TASK_MESH));
+}
 
-	/* add block <off> - <size> to free list */
-	mem = free = bank->usedList + bank->maxItems - 1;
-	eof = mem - bank->freeItem + 1;
+/* <load> has just been loaded: one dependency less for meshes around, returns one that became runnable (claimed) */
+static Chunk mapGenDepsDone(Map map, struct Thread_t * thread, Chunk load)
+{
+	Chunk next = NULL;
+	int   i;
 
-	/* keep free list ordered in increasing offset (from end of array toward beginning) */
-	while (mem >= eof)
+	for (i = 0; i < DIM(chunkAround); i ++)
 	{
-		if (end < mem->offset)
-		{
-			/* insert before mem */
-			memmove(eof - 1, eof, (DATA8) (mem + 1) - (DATA8) eof);
-			mem->offset = start;
-			mem->size   = size;
-			bank->freeItem ++;
-			goto check;
-		}
-		else if (end == mem->offset)
-		{
-			/* can be merged at beginning of <mem> */
-			mem->offset = start;
-			mem->size += size;
-			/* can we merge with previous item? */
-			if (mem < free && mem[1].offset + mem[1].size == start)
-			{
-				mem[1].size += mem->size;
-				memmove(eof + 1, eof, (DATA8) mem - (DATA8) free);
-				bank->freeItem --;
-				eof ++;
-				mem ++;
-			}
-			check_free:
-			if (mem->size + mem->offset == bank->memUsed)
-			{
-				/* discard last free block */
-				bank->memUsed -= mem->size;
-				bank->freeItem --;
-			}
-			goto check;
-		}
-		else if (start == mem->offset + mem->size)
+		int   dir  = chunkAround[i];
+		Chunk mesh = load + map->chunkOffsets[load->neighbor + dir];
+
+		/* mapGenRequeue() will count them again */
+		if (! mapGenWaitFor(map, mesh, load, dir) || -- mesh->state->deps > 0 || threadStop) continue;
+		if (next == NULL && thread->stage == 0)
 		{
-			/* can be merged at end of <mem> */
-			mem->size += size;
-			/* can we merge with next item? */
-			if (mem > eof && mem[-1].offset == end)
-			{
-				mem->size += mem[-1].size;
-				memmove(eof + 1, eof, (DATA8) (mem - 1) - (DATA8) eof);
-				bank->freeItem --;
-			}
-			goto check_free;
+			/* neighbors are in cache: do this one right away (instead of going through work queue) */
+			mesh->state->claimed = 1;
+			thread->current = next = mesh;
+			thread->gen = mesh->state->gen;
 		}
-		else mem --;
+		else mapGenQueue(map, thread, mesh, TASK_MESH, mapTaskKey(map, mesh, TASK_MESH));
 	}
+	return next;
+}
 
-	/* cannot merge with existing free list: add it at the beginning */
-	if (end < bank->memUsed)
+/* slot must hold chunk at <X>, <Z> (from main thread) */
+static void mapGenRetarget(Map map, Chunk c, int X, int Z)
+{
+	ChunkState state = c->state;
+	if (c->X == X && c->Z == Z)
 	{
-		/* we just removed an item, therefore it is safe to add one back */
-		eof[-1].offset = start;
-		eof[-1].size = size;
-		bank->freeItem ++;
+		/* player came back before slot was released */
+		state->redo = 0;
+		return;
 	}
-	else bank->memUsed -= size;
-	/* else last item being removed: simply discard everything */
-
-	check:
-
-	fprintf(stderr, "free chunk at %d, %d: %d/%d\n", cd->chunk->X, cd->chunk->Z, bank->freeItem + bank->nbItem, bank->maxItems);
-	end = checkMem(bank);
-	if (end > 0)
-		fprintf(stderr, "error free code = %d for chunk %d\n", end, cd->chunk->color);
+	/* slot reused for another chunk: queued item, processing and staged meshes are obsolete */
+	state->gen ++;
+	state->queued = 0;
+	state->deps = 0;
+	if (state->claimed || state->processing)
+	{
+		state->redo  = 1;
+		state->redoX = X;
+		state->redoZ = Z;
+		return;
+	}
+	chunkFree(map, c, True);
+	c->X = X;
+	c->Z = Z;
 }
 
-void renderFinishMesh(Map map, ChunkData cd)
+/* slot is not used by any thread anymore: do what mapGenRequeue() had to leave */
+static void mapGenSettle(Map map, Chunk c, struct Thread_t * thread)
 {
-	GPUBank bank;
-	int     total, offset;
-
-	total = cd->glSize;
-	bank = cd->glBank;
-
-	if (bank)
+	ChunkState state = c->state;
+	int        i;
+	if (state->redo)
 	{
-		GPUMem mem = bank->usedList + cd->glSlot;
-		if (total > mem->size)
+		if (c->X != state->redoX || c->Z != state->redoZ)
 		{
-			/* not enough space: need to "free" previous mesh before */
-			renderFreeArray(cd);
-			offset = renderStoreArrays(map, cd, total);
+			chunkFree(map, c, True);
+			c->X = state->redoX;
+			c->Z = state->redoZ;
 		}
-		else offset = mem->offset, cd->glSize = total; /* reuse mem segment */
+		state->redo = 0;
 	}
-	else offset = renderStoreArrays(map, cd, total);
+	if (threadStop) return;
 
-	(void) offset;
+	/* processing might have been cancelled while chunk was still (or is again) needed */
+	if (mapInRange(map, c, 0))
+	{
+		mapGenNeedMesh(map, c, thread);
+		return;
+	}
 
-//	fprintf(stderr, "allocating %d bytes at %d for chunk %d, %d / %d\n", total, offset, cd->chunk->X, cd->chunk->Z, cd->Y);
+	/* or meshes around are waiting for this slot to be recycled */
+	for (i = 0; i < DIM(chunkAround); i ++)
+	{
+		int dir = chunkAround[i];
+		if (mapGenWaitFor(map, c + map->chunkOffsets[c->neighbor + dir], c, dir))
+		{
+			mapGenNeedLoad(map, c, c->X, c->Z, thread);
+			break;
+		}
+	}
 }
 
-static void chunkFree(Chunk c, int thread)
+/* queue items are only hints: chunk might have been claimed since or recycled */
+static Bool mapGenClaim(Map map, struct Thread_t * thread, struct WorkItem_t * task)
 {
-	int i;
-	for (i = 0; i < DIM(c->layer); i ++)
+	Chunk chunk = task->chunk;
+	Bool  ok;
+	MutexEnter(map->genLock);
+	ok = chunk->state->queued == task->type && chunk->state->gen == task->gen;
+	/* player got there faster: it will be loaded in the map */
+	if (ok && task->type == TASK_PREFETCH && ! mapGenPrefetchWanted(map, chunk))
+		chunk->state->queued = ok = 0;
+	if (ok)
 	{
-		ChunkData cd = c->layer[i];
-		if (cd)
+		chunk->state->queued = 0;
+		if (task->type != TASK_MESH)
 		{
-			if (cd->glBank)
+			chunk->state->processing = 1;
+			if (task->type == TASK_LOAD)
 			{
-				if (thread)
-					fprintf(stderr, "must not free render data from thread.\n");
-				renderFreeArray(cd);
+				chunk->stamp[STAMP_CLAIMED] = FrameGetTime();
+				if (chunk->stamp[STAMP_QUEUED] > 0)
+					histoAdd(&thread->lat[LAT_QUEUE], chunk->stamp[STAMP_CLAIMED] - chunk->stamp[STAMP_QUEUED]);
 			}
-			free(cd);
+		}
+		else
+		{
+			chunk->state->claimed = 1;
+			thread->current = chunk;
+			thread->gen = task->gen;
 		}
 	}
-	memset(c->layer, 0, (c->maxy+1) * sizeof c->layer[0]);
-	c->cflags = 0;
-	c->maxy = 0;
+	MutexLeave(map->genLock);
+	return ok;
 }
 
-Bool chunkLoad(Chunk chunk, int x, int z, int id)
+/* done with current mesh (genLock held) */
+static void mapGenRelease(Map map, struct Thread_t * thread)
 {
-	static int color = 0;
-	if (chunk->X != x || chunk->Z != z)
+	Chunk chunk = thread->current;
+	if (chunk == NULL) return;
+	if (chunk->state->gen != thread->gen)
 	{
-		chunkFree(chunk, True);
+		/* meshes pushed so far have been discarded by mapGenUpload() */
+		chunk->state->cflags &= ~CFLAG_HASMESH;
+		thread->cancelled ++;
 	}
+	chunk->state->claimed  = 0;
+	thread->current = NULL;
+	mapGenSettle(map, chunk, thread);
+}
 
-	if ((chunk->cflags & CFLAG_GOTDATA) == 0)
+static Bool mapGenPopWork(Map map, struct Thread_t * thread, WorkQueue queue, Bool nearEnd, struct WorkItem_t * task)
+{
+	for (;;)
 	{
-		//fprintf(stderr, "thread %d: loaded chunk %d, %d: %d\n", id, x, z, chunk->processing);
-		chunk->X = x;
-		chunk->Z = z;
-		chunk->maxy = 1;
-		chunk->color = color ++;
+		MutexEnter(queue->lock);
+		if (queue->head == queue->tail)
+		{
+			MutexLeave(queue->lock);
+			return False;
+		}
+		*task = nearEnd ? queue->items[queue->head ++] : queue->items[-- queue->tail];
+		if (TASK_STAGE(task->type) == TASK_LOAD) queue->loads --;
+		QUEUE_FIRST(queue);
+		MutexLeave(queue->lock);
 
-		if (loadSpeed > 0)
-			ThreadPause(rand() % loadSpeed);
+		if (mapGenClaim(map, thread, task))
+			return True;
+	}
+}
 
-		if (chunk->layer[0])
-			fprintf(stderr, "memory leak likely on chunkLoad()\n");
+static Bool mapGenTakeWork(struct Thread_t * thread, struct WorkItem_t * task)
+{
+	Map       map  = thread->map;
+	WorkQueue own  = &thread->work;
+	WorkQueue best = NULL;
+	int *     ids  = stageThreads[thread->stage == TASK_LOAD ? 0 : 1];
+	int       nb   = stageCount[thread->stage == TASK_LOAD ? 0 : 1];
+	int       i;
+
+	/* queues of threads of same stage only: first read without lock, it is only a hint */
+	for (i = 0; i < nb; i ++)
+	{
+		WorkQueue queue = &threads[ids[(thread->id + i) % nb]].work;
+		if (queue != own && queue->first < own->first / 2 && (best == NULL || queue->first < best->first))
+			best = queue;
+	}
+	if (best && mapGenPopWork(map, thread, best, True, task))
+	{
+		thread->stolen ++;
+		return True;
+	}
 
-		ChunkData cd = calloc(sizeof *cd, 1);
-		chunk->layer[0] = cd;
-		cd->chunk = chunk;
-		/* should be filled in chunkUpdate(), but that function cannot be included in this test setup */
-		cd->glSize = (4 + rand() % 8) * 4096;
-		cd->Y = 0;
+	if (mapGenPopWork(map, thread, own, True, task))
 		return True;
+	for (i = 0; i < nb; i ++)
+	{
+		WorkQueue queue = &threads[ids[(thread->id + i) % nb]].work;
+		if (queue != own && mapGenPopWork(map, thread, queue, False, task))
+		{
+			thread->stolen ++;
+			return True;
+		}
 	}
 	return False;
 }
 
+/* TASK_LOAD: returns mesh that became runnable (already claimed), NULL if none */
+static Chunk mapGenLoadTask(Map map, struct Thread_t * thread, Chunk load)
+{
+	Chunk next = NULL;
+	Bool  done;
+
+	/* coords won't change while processing is set (slot will be redone instead) */
+	done = chunkLoad(map, load, load->X, load->Z, thread->id);
+	thread->loads ++;
+
+	/* dependencies are counted from CFLAG_GOTDATA: must be set along with processing */
+	MutexEnter(map->genLock);
+	if (done) load->state->cflags |= CFLAG_GOTDATA;
+	load->state->processing = 0;
+	load->stamp[STAMP_LOADED] = FrameGetTime();
+	histoAdd(&thread->lat[LAT_LOAD], load->stamp[STAMP_LOADED] - load->stamp[STAMP_CLAIMED]);
+	if (! load->state->redo)
+		next = mapGenDepsDone(map, thread, load);
+	mapGenSettle(map, load, thread);
+	MutexLeave(map->genLock);
+
+	return next;
+}
+
+/* TASK_PREFETCH: <probe> is outside map, its data goes straight to cache */
+static void mapGenPrefetchTask(Map map, struct Thread_t * thread, Chunk probe)
+{
+	int i;
+
+	chunkSource->load(chunkSource, probe, probe->X, probe->Z, thread->id);
+	thread->loads ++;
+
+	if (! chunkCacheAdd(&map->cache, probe, True))
+		for (i = 0; i < probe->maxy; free(probe->layer[i]), i ++);
+	memset(probe->layer, 0, sizeof probe->layer);
+	probe->maxy = 0;
+
+	MutexEnter(map->genLock);
+	probe->state->processing = 0;
+	MutexLeave(map->genLock);
+}
+
+/* wait for another thread, time spent is accounted in thread->waited */
+static void mapGenBlock(struct Thread_t * thread, Semaphore sem)
+{
+	double start = FrameGetTime();
+	SemWait(sem);
+	thread->waited += FrameGetTime() - start;
+}
+
+/* backpressure: loader thread waits while mesh threads have STAGE_DEPTH runnable meshes each */
+static void mapGenStall(struct Thread_t * thread)
+{
+	Map map = thread->map;
+	int max = STAGE_DEPTH * stageCount[1];
+
+	while (! threadStop && mapGenDepth(TASK_MESH) >= max)
+	{
+		thread->state = THREAD_WAIT_MESHERS;
+		__atomic_add_fetch(&map->loadStalled, 1, __ATOMIC_SEQ_CST);
+		/* a mesh might have been taken in the meantime (wake up left will be ignored) */
+		if (mapGenDepth(TASK_MESH) < max) break;
+		mapGenBlock(thread, map->meshTaken);
+	}
+	thread->state = THREAD_RUNNING;
+}
+
+/* a mesh task has been taken: wake up loader threads that were stalled */
+static void mapGenWakeLoaders(Map map)
+{
+	if (__atomic_load_n(&map->loadStalled, __ATOMIC_SEQ_CST) > 0)
+	{
+		int count = __atomic_exchange_n(&map->loadStalled, 0, __ATOMIC_SEQ_CST);
+		if (count > 0) SemAdd(map->meshTaken, count);
+	}
+}
+
+/* mesh being generated is not needed anymore (or threads have to stop) */
+static Bool mapGenCancelled(struct Thread_t * thread)
+{
+	return threadStop || __atomic_load_n(&thread->current->state->gen, __ATOMIC_RELAXED) != thread->gen;
+}
+
 /* ask thread to stop what they are doing and wait for them */
 void mapGenStopThread(Map map, int exit)
 {
-	threadStop = exit;
 	int i;
+	__atomic_store_n(&threadStop, exit, __ATOMIC_SEQ_CST);
 
 	/* list is about to be redone/freed */
 	while (SemWaitTimeout(map->genCount, 0));
-
-	/* need to wait, thread might hold pointer to object that are going to be freed */
-	for (i = 0; i < NUM_THREADS; i ++)
-	{
-		switch (threads[i].state) {
-		case THREAD_WAIT_GENLIST:
-			/* that's where we want the thread to be */
-			continue;
-		case THREAD_RUNNING:
-			/* meshing/reading stuff: not good, need to stop */
-			break;
-		case THREAD_WAIT_BUFFER:
-			/* waiting for mem block, will jump to sleep right after */
-			SemAdd(staging.capa, 1);
-		}
-		/* need to wait for thread to stop though */
-		double tick = FrameGetTime();
-		/* active loop for 1ms */
-		while (FrameGetTime() - tick < 1)
-		{
-			if (threads[i].state == THREAD_WAIT_GENLIST)
-			{
-				goto continue_loop;
-			}
-		}
-
-		/* thread still hasn't stop, need to wait then :-/ */
+	while (SemWaitTimeout(map->loadCount, 0));
+
+	/*
+	 * staging mem won't be flushed until we return: threads waiting for some (now or before they notice
+	 * threadStop) will give up. One wake up per thread is enough, those not consumed are discarded below.
+	 * Same for loader threads waiting on mesh threads.
+	 */
+	if (staging.capa)
+		SemAdd(staging.capa, threadCount);
+	SemAdd(map->meshTaken, threadCount);
+
+	/* thread holds its wait mutex while processing a chunk: keep them until threads can resume */
+	for (i = 0; i < threadCount; i ++)
 		MutexEnter(threads[i].wait);
-		MutexLeave(threads[i].wait);
 
-		continue_loop: ;
-	}
+	/* threads are idle: GPU banks can be compacted/released now */
+	for (i = 0; i < threadCount; i ++)
+		renderReleaseRegion(map, &threads[i].region);
+
+	/* chunks might be moved/freed: queues will be refilled by mapGenRequeue() */
+	for (i = 0; i < threadCount; i ++)
+		mapGenClearWork(&threads[i].work);
 
 	if (exit == THREAD_EXIT)
 	{
 		/* need to be sure threads have exited */
-		SemAdd(map->genCount, NUM_THREADS);
-		for (i = 0; i < NUM_THREADS; i ++)
+		SemAdd(map->genCount, threadCount);
+		SemAdd(map->loadCount, threadCount);
+		for (i = 0; i < threadCount; i ++)
+			MutexLeave(threads[i].wait);
+		for (i = 0; i < threadCount; i ++)
+			SemWait(threadDone);
+		/* not all wake ups have been consumed */
+		while (SemWaitTimeout(map->genCount, 0));
+		while (SemWaitTimeout(map->loadCount, 0));
+		for (i = 0; i < threadCount; i ++)
 		{
-			while (threads[i].state >= 0);
 			MutexDestroy(threads[i].wait);
+			MutexDestroy(threads[i].work.lock);
+			free(threads[i].work.items);
 		}
 		memset(threads, 0, sizeof threads);
+		threadCount = 0;
+	}
+
+	/* meshes not transfered yet are lost: they will have to be generated again */
+	if (staging.mem) mapGenGrabReady();
+	for (i = 0; i < staging.pendingCount; i ++)
+	{
+		DATA32 mem   = staging.mem + staging.pending[i].offset;
+		Chunk  chunk = map->chunks + STAGING_CHUNK(mem[0]);
+		if (STAGING_GEN(mem[0]) == (chunk->state->gen & 0xfff))
+			chunk->state->cflags &= ~CFLAG_HASMESH;
 	}
 
-	/* clear staging area */
-	memset(staging.usage, 0, sizeof staging.usage);
-	SemAdd(staging.capa, staging.total);
+	/* clear staging area (and wake ups not consumed) */
+	if (staging.capa)
+		while (SemWaitTimeout(staging.capa, 0));
+	while (SemWaitTimeout(map->meshTaken, 0));
+	map->loadStalled = 0;
+	if (staging.mode == STAGING_RING)
+	{
+		staging.head = staging.tail = staging.used = 0;
+		staging.waiting = 0;
+	}
+	else if (staging.mode == STAGING_ATOMIC)
+	{
+		/* threads are idle, no need for atomic ops here */
+		bitPoolClearAll(&staging.usage);
+		for (i = 0; i < threadCount; i ++)
+			threads[i].cached = 0;
+		staging.readyHead = -1;
+		staging.waiting = 0;
+	}
+	else
+	{
+		bitPoolClearAll(&staging.usage);
+		if (staging.capa) SemAdd(staging.capa, staging.usage.count);
+	}
 	staging.total = 0;
 	staging.chunkData = 0;
+	staging.readyCount = 0;
+	staging.pendingCount = 0;
 
-	threadStop = 0;
+	__atomic_store_n(&threadStop, 0, __ATOMIC_SEQ_CST);
+	for (i = 0; i < threadCount; i ++)
+		MutexLeave(threads[i].wait);
 }
 
-/* flush what the threads have been filling (called from main thread) */
-void mapGenFlush(Map map)
+/* STAGING_ATOMIC: blocks have been released, wake up threads waiting for some */
+static void mapGenWakeUp(void)
 {
-	MutexEnter(staging.alloc);
+	if (__atomic_load_n(&staging.waiting, __ATOMIC_SEQ_CST) > 0)
+	{
+		int count = __atomic_exchange_n(&staging.waiting, 0, __ATOMIC_SEQ_CST);
+		if (count > 0) SemAdd(staging.capa, count);
+	}
+}
 
-	DATA8 index, eof;
-	for (index = staging.start, eof = index + staging.chunkData; index < eof; )
+static void mapGenAddPending(int offset, double now)
+{
+	struct StagingMesh_t * mesh;
+	if (staging.pendingCount == staging.pendingMax)
 	{
-		/* is the chunk ready ? */
-		DATA32 mem = staging.mem + index[0] * 1024;
-		Chunk chunk = map->chunks + (mem[0] & 0xffff);
-		ChunkData cd = chunk->layer[mem[0] >> 16];
+		staging.pendingMax += 256;
+		staging.pending = realloc(staging.pending, staging.pendingMax * sizeof *staging.pending);
+	}
+	mesh = staging.pending + staging.pendingCount ++;
+	mesh->offset = offset;
+	mesh->staged = now;
+}
+
+/* move everything from completion queue to staging.pending, in completion order */
+static void mapGenGrabReady(void)
+{
+	double now = FrameGetTime();
+	int    slot, next, prev;
 
-		if (chunk->cflags & CFLAG_HASMESH)
+	if (staging.mode == STAGING_ATOMIC)
+	{
+		/* grab everything threads have pushed so far, list is LIFO: reverse it */
+		slot = __atomic_exchange_n(&staging.readyHead, -1, __ATOMIC_ACQUIRE);
+		for (prev = -1; slot >= 0; next = staging.readyLink[slot], staging.readyLink[slot] = prev, prev = slot, slot = next);
+		for (slot = prev; slot >= 0; slot = staging.readyLink[slot])
+			mapGenAddPending(slot << 10, now);
+	}
+	else
+	{
+		MutexEnter(staging.alloc);
+		for (slot = 0; slot < staging.readyCount; slot ++)
+			mapGenAddPending(staging.ready[slot], now);
+		staging.readyCount = 0;
+		MutexLeave(staging.alloc);
+	}
+}
+
+/* binary heap on StagingMesh_t.dist */
+static void mapGenSiftDown(struct StagingMesh_t * heap, int count, int i)
+{
+	struct StagingMesh_t item = heap[i];
+	int child;
+	while ((child = i * 2 + 1) < count)
+	{
+		if (child + 1 < count && heap[child+1].dist < heap[child].dist) child ++;
+		if (item.dist <= heap[child].dist) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = item;
+}
+
+/* player might have moved since last frame: distances need to be recomputed */
+static void mapGenSortPending(Map map)
+{
+	struct StagingMesh_t * mesh;
+	int X = CPOS(map->cx), Y = CPOS(map->cy), Z = CPOS(map->cz);
+	int i;
+
+	for (mesh = staging.pending, i = staging.pendingCount; i > 0; i --, mesh ++)
+	{
+		DATA32 mem   = staging.mem + mesh->offset;
+		Chunk  chunk = map->chunks + STAGING_CHUNK(mem[0]);
+		int    dx    = (chunk->X >> 4) - X;
+		int    dy    = STAGING_LAYER(mem[0]) - Y;
+		int    dz    = (chunk->Z >> 4) - Z;
+		mesh->dist = dx * dx + dy * dy + dz * dz;
+	}
+	for (i = staging.pendingCount / 2 - 1; i >= 0; i --)
+		mapGenSiftDown(staging.pending, staging.pendingCount, i);
+}
+
+/* mesh at <offset> is still wanted: returns its ChunkData (NULL if slot has been reused since) */
+static ChunkData mapGenMeshOf(Map map, int offset)
+{
+	DATA32 mem   = staging.mem + offset;
+	Chunk  chunk = map->chunks + STAGING_CHUNK(mem[0]);
+	return STAGING_GEN(mem[0]) == (chunk->state->gen & 0xfff) ? chunk->layer[STAGING_LAYER(mem[0])] : NULL;
+}
+
+/* <mesh> of layer <layer> has been uploaded: chunk is complete with its last layer */
+static void mapGenUploaded(Chunk chunk, int layer, struct StagingMesh_t * mesh)
+{
+	double now = FrameGetTime();
+
+	histoAdd(&latMain[LAT_FLUSH - LAT_WORKER], now - mesh->staged);
+	if (layer < chunk->maxy - 1) return;
+	if (chunk->stamp[STAMP_MESHED] > 0)
+		histoAdd(&latMain[LAT_STAGE - LAT_WORKER], mesh->staged - chunk->stamp[STAMP_MESHED]);
+	if (chunk->stamp[STAMP_NEEDED] > 0)
+		histoAdd(&latMain[LAT_TOTAL - LAT_WORKER], now - chunk->stamp[STAMP_NEEDED]);
+}
+
+/* transfer <mesh> to GPU and release its staging memory, return size of mesh */
+static int mapGenUpload(Map map, struct StagingMesh_t * mesh)
+{
+	DATA32    mem  = staging.mem + mesh->offset;
+	int       slot = mesh->offset >> 10;
+	int       size = 0;
+	ChunkData cd;
+
+	/* threads can recycle slots (mapGenSettle()) */
+	MutexEnter(map->genLock);
+	cd = mapGenMeshOf(map, mesh->offset);
+	if (cd)
+	{
+		renderFinishMesh(map, cd);
+		size = cd->glSize;
+		mapGenUploaded(cd->chunk, STAGING_LAYER(mem[0]), mesh);
+	}
+	MutexLeave(map->genLock);
+
+	if (staging.mode == STAGING_RING)
+	{
+		/* should copy mem to GPU here */
+		// from mem + 2 to mem + size/4, in one go
+
+		/* space is reclaimed by mapGenFlush() */
+		mem[1] |= RING_DONE;
+		staging.total --;
+		staging.chunkData --;
+		return size;
+	}
+
+	for (;;)
+	{
+		/* block can be reused as soon as it is released */
+		uint32_t next = mem[1];
+		if (staging.mode == STAGING_ATOMIC)
 		{
-			/* yes, move all chunks into GPU and free staging area */
-			int slot = index[0];
-			int count = 0;
-			renderFinishMesh(map, cd);
-			for (;;)
-			{
-				staging.usage[slot >> 5] ^= 1 << (slot & 31);
-				staging.total --;
-				SemAdd(staging.capa, 1);
+			/* threads might be claiming other bits of this word */
+			__atomic_and_fetch(staging.usage.level[0] + (slot >> 6), ~(1ULL << (slot & 63)), __ATOMIC_RELEASE);
+			__atomic_sub_fetch(&staging.total, 1, __ATOMIC_RELAXED);
+		}
+		else
+		{
+			bitPoolFree(&staging.usage, slot);
+			staging.total --;
+			SemAdd(staging.capa, 1);
+		}
 
-				/* should copy mem to GPU here */
-				// from mem + 2 to mem + 1024 (4088 bytes)
+		/* should copy mem to GPU here */
+		// from mem + 2 to mem + 1024 (4088 bytes)
 
-				if (mem[1] == END_OF_LIST) break;
-				slot = mem[1] >> 10;
-				mem = staging.mem + mem[1];
-				count ++;
+		if (next == END_OF_LIST) break;
+		slot = next >> 10;
+		mem = staging.mem + next;
+	}
+	if (staging.mode == STAGING_ATOMIC)
+		__atomic_sub_fetch(&staging.chunkData, 1, __ATOMIC_RELAXED);
+	else
+		staging.chunkData --;
+	return size;
+}
+
+/* stop timer started by mapGenViewChanged() if all chunks in view have a mesh */
+static void mapGenCheckView(Map map)
+{
+	int8_t * spiral;
+	int      XC   = CPOS(map->cx);
+	int      ZC   = CPOS(map->cz);
+	int      area = map->mapArea;
+	int      n;
+
+	if (map->viewStart == 0) return;
+	for (spiral = frustum.spiral, n = map->maxDist * map->maxDist; n > 0; n --, spiral += 2)
+	{
+		if (! mapInView(map, spiral[0], spiral[1])) continue;
+		Chunk c = &map->chunks[(map->mapX + spiral[0] + area) % area + (map->mapZ + spiral[1] + area) % area * area];
+		if ((c->state->cflags & CFLAG_HASMESH) == 0 || c->X != (XC + spiral[0]) << 4 || c->Z != (ZC + spiral[1]) << 4)
+			return;
+	}
+	map->viewTime  = FrameGetTime() - map->viewStart;
+	map->viewStart = 0;
+}
+
+/* player has moved or turned: measure how long it takes to get everything in view (if not already timing) */
+static void mapGenViewChanged(Map map)
+{
+	if (map->viewStart == 0)
+		map->viewStart = FrameGetTime();
+	mapGenCheckView(map);
+}
+
+/*
+ * flush meshes threads have completed (called from main thread): without budget, everything is uploaded
+ * in completion order, otherwise nearest meshes are uploaded first and what is left is kept for next frames.
+ */
+void mapGenFlush(Map map)
+{
+	StagingStats stats  = &staging.stats;
+	Bool         budget = staging.budgetBytes > 0 || staging.budgetTime > 0;
+	Bool         atomic = staging.mode == STAGING_ATOMIC;
+	double       start  = FrameGetTime();
+	int          count, bytes;
+
+	mapGenGrabReady();
+	if (budget)
+		mapGenSortPending(map);
+
+	if (! atomic) MutexEnter(staging.alloc);
+	if (! budget)
+	{
+		for (count = bytes = 0; count < staging.pendingCount; count ++)
+			bytes += mapGenUpload(map, staging.pending + count);
+		staging.pendingCount = 0;
+	}
+	else for (count = bytes = 0; staging.pendingCount > 0; )
+	{
+		struct StagingMesh_t * heap = staging.pending;
+
+		/* always upload at least one mesh, otherwise a big one could be stuck forever */
+		if (count > 0)
+		{
+			if (staging.budgetBytes > 0)
+			{
+				MutexEnter(map->genLock);
+				ChunkData next = mapGenMeshOf(map, heap[0].offset);
+				int       size = next ? next->glSize : 0;
+				MutexLeave(map->genLock);
+				if (bytes + size > staging.budgetBytes) break;
 			}
-			memmove(index, index + 1, eof - index - 1);
-			staging.chunkData --;
-			eof --;
-			//fprintf(stderr, "transfering chunk %d, %d to GPU: %d blocks (%d)\n", chunk->X, chunk->Z, count, staging.total);
+			if (staging.budgetTime > 0 && FrameGetTime() - start >= staging.budgetTime) break;
 		}
-		/* wait for next frame */
-		else index ++;
+		bytes += mapGenUpload(map, heap);
+		count ++;
+		/* remove nearest from heap */
+		staging.pendingCount --;
+		heap[0] = heap[staging.pendingCount];
+		mapGenSiftDown(heap, staging.pendingCount, 0);
 	}
 
-	MutexLeave(staging.alloc);
+	if (staging.mode == STAGING_RING)
+	{
+		/* can be reused up to first span not transfered yet */
+		while (staging.used > 0)
+		{
+			DATA32 mem  = staging.mem + (staging.tail >> 2);
+			int    size = mem[1] & RING_SIZE;
+			if ((mem[1] & RING_DONE) == 0) break;
+			staging.tail += size;
+			staging.used -= size;
+			if (staging.tail == staging.size) staging.tail = 0;
+		}
+		/* empty: restart at beginning, a span as big as the ring must fit without wrapping */
+		if (staging.used == 0)
+			staging.head = staging.tail = 0;
+		if (staging.waiting > 0)
+		{
+			SemAdd(staging.capa, staging.waiting);
+			staging.waiting = 0;
+		}
+	}
+	if (atomic) mapGenWakeUp();
+	else MutexLeave(staging.alloc);
+
+	stats->meshes  = count;
+	stats->uploaded += count;
+	stats->bytes   = bytes;
+	stats->time    = FrameGetTime() - start;
+	stats->pending = staging.pendingCount;
+	mapGenCheckView(map);
+	if (stats->maxBytes < bytes)       stats->maxBytes = bytes;
+	if (stats->maxTime  < stats->time) stats->maxTime  = stats->time;
 }
 
-static int mapRedoGenList(Map map)
+/*
+ * fill work queues for current player position while threads keep running: queued tasks outside render
+ * area are dropped, others are re-keyed on their new distance, meshes in flight that are not needed anymore
+ * are cancelled (ChunkState_t.gen), slots still used by a thread are recycled when released (mapGenSettle()).
+ */
+static void mapGenRequeue(Map map)
 {
 	int8_t * spiral;
-	int      XC   = CPOS(map->cx) << 4;
-	int      ZC   = CPOS(map->cz) << 4;
+	int      XC   = CPOS(map->cx);
+	int      ZC   = CPOS(map->cz);
+	int      half = (map->maxDist >> 1) + 1;
 	int      n    = map->maxDist * map->maxDist;
 	int      area = map->mapArea;
-	int      ret  = 0;
+	int      i, dx, dz, count, loads;
 
-	mapGenStopThread(map, THREAD_EXIT_LOOP);
-	ListNew(&map->genList);
+	MutexEnter(map->genLock);
+	for (i = 0; i < threadCount; i ++)
+	{
+		Chunk c = threads[i].current;
+		if (c && ! mapInRange(map, c, 0)) c->state->gen ++;
+	}
 
-	for (spiral = frustum.spiral; n > 0; n --, spiral += 2)
+	/* render area and lazy chunks around: all slots first, dependencies are counted from their content */
+	for (dz = -half; dz <= half; dz ++)
 	{
-		Chunk c = &map->chunks[(map->mapX + spiral[0] + area) % area + (map->mapZ + spiral[1] + area) % area * area];
-		int X = XC + (spiral[0] << 4);
-		int Z = ZC + (spiral[1] << 4);
-		if (c->X != X || c->Z != Z)
+		for (dx = -half; dx <= half; dx ++)
 		{
-			chunkFree(c, False);
+			Chunk c = &map->chunks[(map->mapX + dx + area) % area + (map->mapZ + dz + area) % area * area];
+			mapGenRetarget(map, c, (XC + dx) << 4, (ZC + dz) << 4);
 		}
-		if ((c->cflags & CFLAG_HASMESH) == 0)
+	}
+
+	for (spiral = frustum.spiral; n > 0; n --, spiral += 2)
+		mapGenNeedMesh(map, &map->chunks[(map->mapX + spiral[0] + area) % area + (map->mapZ + spiral[1] + area) % area * area], NULL);
+
+	/*
+	 * one wake up per item: those of dropped items are discarded. Given back once all queues are re-keyed:
+	 * a thread woken for one queue could steal from another before it is counted (its item would get none).
+	 */
+	while (SemWaitTimeout(map->genCount, 0));
+	while (SemWaitTimeout(map->loadCount, 0));
+	for (i = count = loads = 0; i < threadCount; i ++)
+	{
+		if (threads[i].stage == TASK_LOAD)
+			loads += mapGenRekeyWork(map, &threads[i].work);
+		else
+			count += mapGenRekeyWork(map, &threads[i].work);
+	}
+	if (loads > 0) SemAdd(mapGenStageSem(map, TASK_LOAD), loads);
+	if (count > 0) SemAdd(mapGenStageSem(map, TASK_MESH), count);
+	MutexLeave(map->genLock);
+	/* meshes dropped: loaders can go on */
+	mapGenWakeLoaders(map);
+}
+
+/* chunk at <X>, <Z> is being prefetched (genLock held) */
+static Bool mapGenPrefetching(Map map, int X, int Z)
+{
+	Chunk probe;
+	int   i;
+	for (i = 0, probe = map->prefetch; i < PREFETCH_MAX; i ++, probe ++)
+		if ((probe->state->queued || probe->state->processing) && probe->X == X && probe->Z == Z) return True;
+	return False;
+}
+
+/* queue loading of rings beyond lazy chunks, within 45 degrees of the direction the player is moving (main thread) */
+static void mapGenPrefetch(Map map)
+{
+	float len  = sqrtf(map->velX * map->velX + map->velZ * map->velZ);
+	int   XC   = CPOS(map->cx);
+	int   ZC   = CPOS(map->cz);
+	int   base = (map->maxDist >> 1) + 1;
+	int   slot = 0;
+	int   ring, i;
+
+	/* not moving or nowhere to keep them */
+	if (len < 1 || map->prefetchRings == 0 || map->cache.budget == 0)
+		return;
+
+	MutexEnter(map->genLock);
+	for (ring = base + 1; ring <= base + map->prefetchRings; ring ++)
+	{
+		for (i = 0; i < ring * 8; i ++)
 		{
-			c->X = X;
-			c->Z = Z;
-			ListAddTail(&map->genList, &c->next);
-			ret ++;
+			/* square ring, one side at a time */
+			int off = i % (ring * 2) - ring;
+			int dx, dz;
+			switch (i / (ring * 2)) {
+			case 0:  dx =  off;  dz = -ring; break;
+			case 1:  dx =  ring; dz =  off;  break;
+			case 2:  dx = -off;  dz =  ring; break;
+			default: dx = -ring; dz = -off;
+			}
+			if (dx * map->velX + dz * map->velZ < PREFETCH_COS * len * sqrtf(dx * dx + dz * dz))
+				continue;
+
+			int X = (XC + dx) << 4;
+			int Z = (ZC + dz) << 4;
+			if (mapGenPrefetching(map, X, Z) || chunkCacheHas(&map->cache, X, Z))
+				continue;
+
+			Chunk probe;
+			for (probe = map->prefetch + slot; slot < PREFETCH_MAX && (probe->state->queued || probe->state->processing);
+			     slot ++, probe ++);
+			if (slot == PREFETCH_MAX) goto done;
+			probe->X = X;
+			probe->Z = Z;
+			probe->state->gen ++;
+			mapGenQueue(map, NULL, probe, TASK_PREFETCH, PREFETCH_KEY + mapTaskKey(map, probe, TASK_LOAD));
 		}
 	}
-	return ret;
+	done:
+	MutexLeave(map->genLock);
+}
+
+/* rebuild work queues from scratch (chunks being processed are put back) */
+static void mapRedoGenList(Map map)
+{
+	mapGenStopThread(map, THREAD_EXIT_LOOP);
+	mapGenRequeue(map);
 }
 
 Bool mapMoveCenter(Map map, vec4 old, vec4 pos)
@@ -498,6 +1242,14 @@ Bool mapMoveCenter(Map map, vec4 old, vec4 pos)
 	/* current pos: needed to track center chunk coord */
 	memcpy(&map->cx, pos, sizeof (float) * 3);
 
+	/* travel direction for mapGenPrefetch(): teleports are ignored */
+	if (abs(dx) < area && abs(dz) < area)
+	{
+		map->velX = map->velX * 0.75f + (pos[VX] - old[VX]) * 0.25f;
+		map->velZ = map->velZ * 0.75f + (pos[VZ] - old[VZ]) * 0.25f;
+	}
+	else map->velX = map->velZ = 0;
+
 	if (dx || dz)
 	{
 		if (dx >= area || dz >= area)
@@ -510,39 +1262,42 @@ Bool mapMoveCenter(Map map, vec4 old, vec4 pos)
 			map->mapX = (map->mapX + dx + area) % area;
 			map->mapZ = (map->mapZ + dz + area) % area;
 		}
-		int count = mapRedoGenList(map);
 		map->center = map->chunks + (map->mapX + map->mapZ * area);
-
-		/* free lazy chunks that are not at their place */
-		int8_t * ptr, * end;
-		for (ptr = frustum.lazy, end = ptr + frustum.lazyCount; ptr < end; ptr += 3)
-		{
-			uint8_t dir = ptr[2];
-			uint8_t XC  = (map->mapX + ptr[0] + area) % area;
-			uint8_t YC  = (map->mapZ + ptr[1] + area) % area;
-			Chunk chunk = &map->chunks[XC + YC * area];
-			if (chunk->maxy == 0) continue;
-
-			Chunk neighbor = chunk + map->chunkOffsets[chunk->neighbor + dir];
-
-			int X = chunk->X;
-			int Z = chunk->Z;
-			if (dir & 1) Z += 16;
-			if (dir & 2) X += 16;
-			if (dir & 4) Z -= 16;
-			if (dir & 8) X -= 16;
-
-			if (X != neighbor->X || Z != neighbor->Z)
-				chunkFree(chunk, False);
-		}
-
-		/* needs to be done after lazy chunks have been cleared */
-		SemAdd(map->genCount, count);
+		mapGenRequeue(map);
+		mapGenPrefetch(map);
+		mapGenViewChanged(map);
 		return True;
 	}
 	return False;
 }
 
+/*
+ * camera has turned: <dir> is the look vector (only X and Z are used), <fov> the horizontal field of view in
+ * degrees, <priority>: generate chunks in view first (otherwise: distance only). Pending work is re-keyed.
+ */
+void mapSetViewDir(Map map, vec4 dir, float fov, Bool priority)
+{
+	float len     = sqrtf(dir[VX] * dir[VX] + dir[VZ] * dir[VZ]);
+	float viewCos = cosf(fov * (M_PI / 360));
+	int   i;
+
+	if (len == 0) return;
+
+	/* small turns won't change order much: don't sort queues every frame */
+	if ((dir[VX] * map->viewX + dir[VZ] * map->viewZ) / len > VIEW_TURN && viewCos == map->viewCos && priority == map->viewPrio)
+		return;
+
+	MutexEnter(map->genLock);
+	map->viewX    = dir[VX] / len;
+	map->viewZ    = dir[VZ] / len;
+	map->viewCos  = viewCos;
+	map->viewPrio = priority;
+	for (i = 0; i < threadCount; i ++)
+		mapGenRekeyWork(map, &threads[i].work);
+	MutexLeave(map->genLock);
+	mapGenViewChanged(map);
+}
+
 static int sortByDist(const void * item1, const void * item2)
 {
 	int8_t * c1 = (int8_t *) item1;
@@ -551,132 +1306,192 @@ static int sortByDist(const void * item1, const void * item2)
 	return c1[0] * c1[0] + c1[1] * c1[1] - (c2[0] * c2[0] + c2[1] * c2[1]);
 }
 
-Chunk mapAllocArea(int area)
+/* spiral order for render distance <dist> (diameter, in chunks) and lazy chunks around: main thread only */
+static Bool mapInitSpiral(int dist)
 {
-	Chunk chunks = calloc(sizeof *chunks, area * area);
-	Chunk c;
-	int   i, j, n, dist = area - 3;
+	int8_t * ptr = realloc(frustum.spiral, dist * dist * 2 + (dist * 4 + 4) * 3);
+	int      i, j;
 
-	if (chunks)
-	{
-		/* should be property of a map... */
-		int8_t * ptr = realloc(frustum.spiral, dist * dist * 2 + (dist * 4 + 4) * 3);
+	if (ptr == NULL) return False;
 
-		if (ptr)
+	/* to priority load chunks closest to the player */
+	for (j = 0, frustum.spiral = ptr; j < dist; j ++)
+	{
+		for (i = 0; i < dist; i ++, ptr += 2)
 		{
-			/* vertical wrap (mask value from chunkInitStatic) */
-			for (c = chunks, i = area-1, n = area * (area-1), c->neighbor = 1 * 16, c[n].neighbor = 6 * 16, c ++;
-				 i > 1; i --, c->neighbor = 2 * 16, c[n].neighbor = 7 * 16, c ++);
-			c[0].neighbor = 3 * 16;
-			c[n].neighbor = 8 * 16;
-			/* horizontal wrap */
-			for (n = area, c = chunks + n, i = n-2; i > 0; i --, c[0].neighbor = 4 * 16, c[n-1].neighbor = 5 * 16, c += n);
+			ptr[0] = i - (dist >> 1);
+			ptr[1] = j - (dist >> 1);
+		}
+	}
+	i = dist * dist;
+	qsort(frustum.spiral, i, 2, sortByDist);
+	frustum.lazy = frustum.spiral + i * 2;
 
-			/* to priority load chunks closest to the player */
-			for (j = 0, frustum.spiral = ptr; j < dist; j ++)
-			{
-				for (i = 0; i < dist; i ++, ptr += 2)
-				{
-					ptr[0] = i - (dist >> 1);
-					ptr[1] = j - (dist >> 1);
-				}
-			}
-			i = dist * dist;
-			qsort(frustum.spiral, i, 2, sortByDist);
-			frustum.lazy = frustum.spiral + i * 2;
+	/* to quickly enumerate all lazy chunks (need when map center has changed) */
+	for (ptr = frustum.lazy, j = 0, dist += 2, i = dist >> 1; j < dist; j ++, ptr += 6)
+	{
+		/* note: 3rd value is direction of the nearest chunk within render distance (from lazy chunk POV) */
+		ptr[0] = ptr[3] = j - i;
+		ptr[2] = 1 << SIDE_SOUTH;
+		ptr[1] = - i;
+		ptr[4] =   i;
+		ptr[5] = 1 << SIDE_NORTH;
+	}
 
-			/* to quickly enumerate all lazy chunks (need when map center has changed) */
-			for (ptr = frustum.lazy, j = 0, dist += 2, i = dist >> 1; j < dist; j ++, ptr += 6)
-			{
-				/* note: 3rd value is direction of the nearest chunk within render distance (from lazy chunk POV) */
-				ptr[0] = ptr[3] = j - i;
-				ptr[2] = 1 << SIDE_SOUTH;
-				ptr[1] = - i;
-				ptr[4] =   i;
-				ptr[5] = 1 << SIDE_NORTH;
-			}
+	/* corner */
+	ptr[-1] |= 1 << SIDE_WEST;
+	ptr[-4] |= 1 << SIDE_WEST;
+
+	for (j = 0, dist -= 2; j < dist; j ++, ptr += 6)
+	{
+		ptr[1] = ptr[4] = j - (dist >> 1);
+		ptr[0] = - i;
+		ptr[3] =   i;
+		ptr[2] = 1 << SIDE_EAST;
+		ptr[5] = 1 << SIDE_WEST;
+	}
 
-			/* corner */
-			ptr[-1] |= 1 << SIDE_WEST;
-			ptr[-4] |= 1 << SIDE_WEST;
+	/* corner */
+	frustum.lazy[2] |= 1 << SIDE_EAST;
+	frustum.lazy[5] |= 1 << SIDE_EAST;
 
-			for (j = 0, dist -= 2; j < dist; j ++, ptr += 6)
-			{
-				ptr[1] = ptr[4] = j - (dist >> 1);
-				ptr[0] = - i;
-				ptr[3] =   i;
-				ptr[2] = 1 << SIDE_EAST;
-				ptr[5] = 1 << SIDE_WEST;
-			}
+	frustum.lazyCount = ptr - frustum.lazy;
+	return True;
+}
 
-			/* corner */
-			frustum.lazy[2] |= 1 << SIDE_EAST;
-			frustum.lazy[5] |= 1 << SIDE_EAST;
+/*
+ * <count> chunks and their scheduler state, in one block (can be released with free()): threads write states of
+ * chunks next to each other, each one has its own cache line unless chunkStateStride says otherwise.
+ */
+static Chunk chunkAlloc(int count)
+{
+	int   stride = chunkStateStride < (int) sizeof (struct ChunkState_t) ? (int) sizeof (struct ChunkState_t) : chunkStateStride;
+	Chunk chunks = calloc(count * (sizeof *chunks + stride) + CACHE_LINE, 1);
 
-			frustum.lazyCount = ptr - frustum.lazy;
+	if (chunks)
+	{
+		uint8_t * state = (uint8_t *) (((intptr_t) (chunks + count) + CACHE_LINE - 1) & ~(intptr_t) (CACHE_LINE - 1));
+		int       i;
+		for (i = 0; i < count; chunks[i].state = (ChunkState) state, state += stride, i ++);
+	}
+	return chunks;
+}
 
-			/* reset chunkNeighbor table: it depends on map size */
-			static uint8_t wrap[] = {0, 12, 4, 6, 8, 2, 9, 1, 3}; /* bitfield: &1:+Z, &2:+X, &4:-Z, &8:-X, ie: SENW */
+/* chunk grid of <area> x <area> slots (wraps around), can hold render distance up to area - 3 */
+Chunk mapAllocArea(int area)
+{
+	Chunk chunks = chunkAlloc(area * area);
+	Chunk c;
+	int   i, j, n, dist;
 
-			for (j = 0, dist = area, n = area*area; j < DIM(wrap); j ++)
+	if (chunks)
+	{
+		/* vertical wrap (mask value from chunkInitStatic) */
+		for (c = chunks, i = area-1, n = area * (area-1), c->neighbor = 1 * 16, c[n].neighbor = 6 * 16, c ++;
+			 i > 1; i --, c->neighbor = 2 * 16, c[n].neighbor = 7 * 16, c ++);
+		c[0].neighbor = 3 * 16;
+		c[n].neighbor = 8 * 16;
+		/* horizontal wrap */
+		for (n = area, c = chunks + n, i = n-2; i > 0; i --, c[0].neighbor = 4 * 16, c[n-1].neighbor = 5 * 16, c += n);
+
+		/* reset chunkNeighbor table: it depends on map size */
+		static uint8_t wrap[] = {0, 12, 4, 6, 8, 2, 9, 1, 3}; /* bitfield: &1:+Z, &2:+X, &4:-Z, &8:-X, ie: SENW */
+
+		for (j = 0, dist = area, n = area*area; j < DIM(wrap); j ++)
+		{
+			int16_t * p;
+			uint8_t   w = wrap[j];
+			for (i = 0, p = chunkNeighbor + j * 16; i < 16; i ++, p ++)
 			{
-				int16_t * p;
-				uint8_t   w = wrap[j];
-				for (i = 0, p = chunkNeighbor + j * 16; i < 16; i ++, p ++)
-				{
-					int pos = 0;
-					if (i & 1) pos += w & 1 ? dist-n : dist;
-					if (i & 2) pos += w & 2 ? 1-dist : 1;
-					if (i & 4) pos -= w & 4 ? dist-n : dist;
-					if (i & 8) pos -= w & 8 ? 1-dist : 1;
-					p[0] = pos;
-				}
+				int pos = 0;
+				if (i & 1) pos += w & 1 ? dist-n : dist;
+				if (i & 2) pos += w & 2 ? 1-dist : 1;
+				if (i & 4) pos -= w & 4 ? dist-n : dist;
+				if (i & 8) pos -= w & 8 ? 1-dist : 1;
+				p[0] = pos;
 			}
-
-			return chunks;
 		}
-		else free(chunks);
 	}
-	return NULL;
+	return chunks;
 }
 
+/* STAGING_ATOMIC: claim up to <max> free slots of usage level 0, one CAS per word (summary is not maintained) */
+static int mapClaimFree(BitPool usage, int * slots, int max)
+{
+	uint64_t * word;
+	int        base, count, nb;
+	for (word = usage->level[0], count = usage->words[0], base = nb = 0; count > 0 && nb < max; count --, word ++, base += 64)
+	{
+		uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+		for (;;)
+		{
+			uint64_t bits = ~old, take = 0;
+			int      n;
+			for (n = nb; bits && n < max; take |= bits & -bits, bits &= bits - 1, n ++);
+			if (take == 0) break;
+			if (__atomic_compare_exchange_n(word, &old, old | take, False, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			{
+				for (; take; take &= take - 1, nb ++)
+					slots[nb] = base + __builtin_ctzll(take);
+				break;
+			}
+			/* another thread got there first: old has been reloaded */
+		}
+	}
+	return nb;
+}
 
-uint8_t multiplyDeBruijnBitPosition[] = {
-	0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
-	31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
-};
-#define ZEROBITS(bits)        multiplyDeBruijnBitPosition[((uint32_t)((bits & -(signed)bits) * 0x077CB531U)) >> 27]
+/* STAGING_ATOMIC: give back blocks a thread has not used */
+static void mapGenReleaseCache(struct Thread_t * thread)
+{
+	if (thread->cached == 0) return;
+	while (thread->cached > 0)
+	{
+		int slot = thread->cache[-- thread->cached];
+		__atomic_and_fetch(staging.usage.level[0] + (slot >> 6), ~(1ULL << (slot & 63)), __ATOMIC_RELEASE);
+	}
+	mapGenWakeUp();
+}
 
-int mapFirstFree(DATA32 usage, int count)
+static DATA32 mapGenAllocAtomic(struct Thread_t * thread)
 {
-	int base, i;
-	for (i = count, base = 0; i > 0; i --, usage ++, base += 32)
+	while (thread->cached == 0)
 	{
-		uint32_t bits = *usage ^ 0xffffffff;
-		if (bits == 0) continue;
-		/* count leading 0 */
-		bits = ZEROBITS(bits);
-		*usage |= 1 << bits;
-		return base + bits;
+		thread->cached = mapClaimFree(&staging.usage, thread->cache, STAGING_CACHE);
+		if (thread->cached > 0) break;
+
+		/* staging area full: register as waiter first, then check again, to not miss a flush */
+		thread->state = THREAD_WAIT_BUFFER;
+		__atomic_add_fetch(&staging.waiting, 1, __ATOMIC_SEQ_CST);
+		thread->cached = mapClaimFree(&staging.usage, thread->cache, STAGING_CACHE);
+		if (thread->cached == 0)
+			mapGenBlock(thread, staging.capa);
+		thread->state = THREAD_RUNNING;
+
+		if (threadStop) return NULL;
 	}
-	return -1;
+
+	__atomic_add_fetch(&staging.total, 1, __ATOMIC_RELAXED);
+	return staging.mem + thread->cache[-- thread->cached] * 1024;
 }
 
-static DATA32 mapGenAllocMem(struct Thread_t * thread, int first)
+/* get one 4Kb block from staging area, <first>: first block of a mesh */
+DATA32 mapGenAllocMem(struct Thread_t * thread)
 {
+	if (staging.mode == STAGING_ATOMIC)
+		return mapGenAllocAtomic(thread);
+
 	thread->state = THREAD_WAIT_BUFFER;
-	SemWait(staging.capa);
+	mapGenBlock(thread, staging.capa);
 
 	/* it might have passed a long time since */
 	if (threadStop) return NULL;
 
 	MutexEnter(staging.alloc);
 
-	int index = mapFirstFree(staging.usage, DIM(staging.usage));
+	int index = bitPoolAlloc(&staging.usage);
 	DATA32 mem = staging.mem + index * 1024;
 	staging.total ++;
-	if (first)
-		staging.start[staging.chunkData++] = index;
 
 	MutexLeave(staging.alloc);
 
@@ -685,6 +1500,96 @@ static DATA32 mapGenAllocMem(struct Thread_t * thread, int first)
 	return mem;
 }
 
+/* mesh starting at <first> has been entirely written: push it on completion queue */
+void mapGenReady(DATA32 first)
+{
+	int offset = first - staging.mem;
+	if (staging.mode == STAGING_ATOMIC)
+	{
+		/* multiple producers, single consumer (mapGenFlush) */
+		int index = offset >> 10;
+		int head  = __atomic_load_n(&staging.readyHead, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&staging.chunkData, 1, __ATOMIC_RELAXED);
+		do staging.readyLink[index] = head;
+		while (! __atomic_compare_exchange_n(&staging.readyHead, &head, index, True, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	else
+	{
+		MutexEnter(staging.alloc);
+		if (staging.readyCount == staging.readyMax)
+		{
+			staging.readyMax += 256;
+			staging.ready = realloc(staging.ready, staging.readyMax * sizeof *staging.ready);
+		}
+		staging.ready[staging.readyCount ++] = offset;
+		/* STAGING_RING: counted when span is allocated */
+		if (staging.mode == STAGING_BLOCKS) staging.chunkData ++;
+		MutexLeave(staging.alloc);
+	}
+}
+
+/* STAGING_RING: reserve space for a whole mesh, <id> is chunk index and layer */
+static DATA32 mapGenAllocRing(struct Thread_t * thread, int id, int size)
+{
+	/* 8 bytes header, keep everything 8 bytes aligned */
+	size = (size + 15) & ~7;
+	if (size > staging.size)
+		/* only the size of the span is simulated here */
+		size = staging.size;
+
+	thread->state = THREAD_WAIT_BUFFER;
+	for (;;)
+	{
+		MutexEnter(staging.alloc);
+
+		int head = staging.head;
+		int pad  = head + size > staging.size ? staging.size - head : 0;
+
+		if (staging.used + pad + size <= staging.size)
+		{
+			DATA32 mem;
+			if (pad > 0)
+			{
+				/* not enough space before end of ring: span must be contiguous */
+				mem = staging.mem + (head >> 2);
+				mem[0] = 0;
+				mem[1] = pad | RING_PAD | RING_DONE;
+				head = 0;
+			}
+			mem = staging.mem + (head >> 2);
+			mem[0] = id;
+			mem[1] = size;
+			head += size;
+			staging.head = head == staging.size ? 0 : head;
+			staging.used += pad + size;
+			staging.total ++;
+			staging.chunkData ++;
+
+			MutexLeave(staging.alloc);
+			thread->state = THREAD_RUNNING;
+			return mem;
+		}
+		/* ring is full: wait for main thread to flush some meshes */
+		staging.waiting ++;
+		MutexLeave(staging.alloc);
+		mapGenBlock(thread, staging.capa);
+
+		if (threadStop) return NULL;
+	}
+}
+
+/* last layer of <chunk> is about to be pushed to staging area */
+static void mapGenMeshed(struct Thread_t * thread, Chunk chunk)
+{
+	double now   = FrameGetTime();
+	double start = chunk->stamp[STAMP_LOADED];
+
+	/* chunk might have been loaded long before it entered render distance */
+	if (start < chunk->stamp[STAMP_NEEDED]) start = chunk->stamp[STAMP_NEEDED];
+	chunk->stamp[STAMP_MESHED] = now;
+	if (start > 0) histoAdd(&thread->lat[LAT_MESH], now - start);
+}
+
 /*
  * thread chunk loading/meshing
  */
@@ -692,7 +1597,9 @@ void mapGenChunkAsync(void * arg)
 {
 	struct Thread_t * thread = arg;
 	Map map = thread->map;
-	int id = thread == threads ? 0 : 1;
+	int id = thread->id;
+	/* loader threads have their own tasks */
+	Semaphore tasks = mapGenStageSem(map, thread->stage == TASK_LOAD ? TASK_LOAD : TASK_MESH);
 
 	while (threadStop != THREAD_EXIT)
 	{
@@ -700,111 +1607,217 @@ void mapGenChunkAsync(void * arg)
 		//fprintf(stderr, "thread %d: waiting\n", id);
 
 		thread->state = THREAD_WAIT_GENLIST;
-		SemWait(map->genCount);
-
-		if (threadStop == THREAD_EXIT_LOOP) continue;
-		if (threadStop == THREAD_EXIT) break;
+		if (thread->cached == 0 || ! SemWaitTimeout(tasks, 0))
+		{
+			/* going to sleep: don't keep blocks other threads might need (not while staging is being reset) */
+			if (thread->cached > 0)
+			{
+				MutexEnter(thread->wait);
+				mapGenReleaseCache(thread);
+				MutexLeave(thread->wait);
+			}
+			SemWait(tasks);
+		}
 
-		thread->state = THREAD_RUNNING;
+		/* held by mapGenStopThread() until threads can resume */
 		MutexEnter(thread->wait);
+		if (threadStop)
+		{
+			MutexLeave(thread->wait);
+			if (threadStop == THREAD_EXIT) break;
+			continue;
+		}
 
-		/* process chunks /!\ need to unlock the mutex before exiting this branch!! */
-		MutexEnter(map->genLock);
-		Chunk list = (Chunk) ListRemHead(&map->genList);
-		MutexLeave(map->genLock);
-		if (! list || (list->cflags & CFLAG_HASMESH))
-			goto bail;
+		thread->state = THREAD_RUNNING;
+		thread->started = FrameGetTime();
 
-		//fprintf(stderr, "thread %d: processing %d, %d\n", id, list->X, list->Z);
+		/* process one task /!\ need to unlock the mutex before exiting this branch!! */
+		struct WorkItem_t task;
+		Chunk list = NULL;
+		int   i;
 
-		/* simulate loading */
-		static uint8_t directions[] = {12, 4, 6, 8, 0, 2, 9, 1, 3};
-		Chunk checkLater[9];
-		int i, X, Z, check;
+		if (thread->stage == TASK_LOAD)
+			mapGenStall(thread);
 
-		/* load 8 surrounding chunks too (mesh generation will need this) */
-		for (i = check = 0, X = list->X, Z = list->Z; i < DIM(directions); i ++)
+		if (! threadStop && mapGenTakeWork(thread, &task))
 		{
-			int   dir  = directions[i];
-			Chunk load = list + map->chunkOffsets[list->neighbor + dir];
-
-			MutexEnter(map->genLock);
-			if (load->processing)
+			list = task.chunk;
+			if (task.type == TASK_LOAD)
 			{
-				/* being processed by another thread: process another one in the meantime */
-				checkLater[check++] = load;
-				MutexLeave(map->genLock);
-				continue;
+				/* if it was the last dependency of a mesh, generate it now */
+				list = mapGenLoadTask(map, thread, list);
+				if (list) thread->adjacent ++;
 			}
-			load->processing = 1;
-			MutexLeave(map->genLock);
-
-			if (chunkLoad(load, X + (dir & 8 ? -16 : dir & 2 ? 16 : 0),
-					Z + (dir & 4 ? -16 : dir & 1 ? 16 : 0),  id))
+			else if (task.type == TASK_PREFETCH)
 			{
-				load->cflags |= CFLAG_GOTDATA;
+				mapGenPrefetchTask(map, thread, list);
+				list = NULL;
 			}
-			load->processing = 0;
-
-			if (threadStop) goto bail;
+			else if (threadLoaders > 0) mapGenWakeLoaders(map);
 		}
 
-		/* need to be sure all chunks have been loaded */
-		for (i = 0; i < check; i ++)
-		{
-			Chunk load = checkLater[i];
-			while (load->processing)
-			{
-				/* not done yet: wait a bit */
-				double timeMS = FrameGetTime();
-				while (FrameGetTime() - timeMS < 0.5 && load->processing && ! threadStop);
-			}
-			if (threadStop) goto bail;
-		}
+		if (! list || (list->state->cflags & CFLAG_HASMESH))
+			goto bail;
+
+		/* empty chunk: nothing to upload */
+		if (list->maxy == 0)
+			list->state->cflags |= CFLAG_HASMESH;
+
+		//fprintf(stderr, "thread %d: processing %d, %d\n", id, list->X, list->Z);
 
 		/* process chunk */
 		for (i = 0; i < list->maxy; i ++)
 		{
 			ChunkData cd = list->layer[i];
+			int       tag = STAGING_ID(list - map->chunks, i, thread->gen);
+
+			if (mapGenCancelled(thread)) goto bail;
 
 			/* chunkUpdate(cd) should be called here */
 
+			/* final location on GPU is known as soon as mesh size is */
+			renderReserveArrays(map, &thread->region, cd, cd->glSize);
+
+			if (staging.mode == STAGING_RING)
+			{
+				/* whole mesh in one step */
+				DATA32 span = mapGenAllocRing(thread, tag, cd->glSize);
+				if (span == NULL)
+					goto bail;
+				if (mapNotify) mapNotify();
+				/* don't care about content */
+				list->state->cflags |= CFLAG_HASMESH;
+				if (i == list->maxy - 1) mapGenMeshed(thread, list);
+				mapGenReady(span);
+				continue;
+			}
+
 			// XXX this part must be done wihtin chunkUpdate()
-			DATA32 last = NULL;
-			int    size = cd->glSize;
+			DATA32 first = NULL, last = NULL;
+			int    size  = cd->glSize;
 			while (size > 0)
 			{
-				DATA32 mem = mapGenAllocMem(thread, last == NULL);
+				DATA32 mem = mapGenAllocMem(thread);
 				if (mem == NULL)
 					/* need to stop now */
 					goto bail;
 				/* avoid storing pointers in this stream */
-				mem[0] = (list - map->chunks) | (i << 16);
+				mem[0] = tag;
 				mem[1] = END_OF_LIST;
 
-				SIT_ForceRefresh();
+				if (mapNotify) mapNotify();
 
 				size -= 4096 - 8;
 				if (last) last[1] = mem - staging.mem;
+				else first = mem;
 				//fprintf(stderr, "thread %d: alloc mem block %d (%d)\n", id, mem - staging.mem, last ? last - staging.mem : -1);
 				last = mem;
 
 				/* don't care about content */
 			}
 			/* mark the chunk as ready */
-			list->cflags |= CFLAG_HASMESH;
+			list->state->cflags |= CFLAG_HASMESH;
+			if (i == list->maxy - 1) mapGenMeshed(thread, list);
+			mapGenReady(first);
 		}
+		thread->chunks ++;
 
 		bail:
+		MutexEnter(map->genLock);
+		mapGenRelease(map, thread);
+		MutexLeave(map->genLock);
 		/* this is to inform the main thread that this thread has finished its work */
+		thread->busy += FrameGetTime() - thread->started;
+		thread->started = 0;
 		MutexLeave(thread->wait);
 	}
 	thread->state = -1;
 	fprintf(stderr, "thread %d: exiting\n", id);
+	/* thread must not be accessed after this */
+	SemAdd(threadDone, 1);
+}
+
+static void mapGenStartThread(Map map, int count)
+{
+	int nb;
+	if (count <= 0) count = mapGetCoreCount();
+	if (count > MAX_THREADS) count = MAX_THREADS;
+	/* need at least one mesh thread */
+	if (threadLoaders >= count) threadLoaders = count - 1;
+	if (threadLoaders < 0)      threadLoaders = 0;
+	threadCount  = count;
+	threadSample = FrameGetTime();
+	stageCount[0] = stageCount[1] = 0;
+	if (threadDone == NULL)
+		threadDone = SemInit(0);
+	for (nb = 0; nb < count; nb ++)
+	{
+		struct Thread_t * thread = threads + nb;
+		thread->wait = MutexCreate();
+		thread->map  = map;
+		thread->id   = nb;
+		thread->stage = threadLoaders == 0 ? 0 : nb < threadLoaders ? TASK_LOAD : TASK_MESH;
+		thread->work.lock = MutexCreate();
+		thread->work.first = QUEUE_EMPTY;
+		if (thread->stage != TASK_MESH) stageThreads[0][stageCount[0] ++] = nb;
+		if (thread->stage != TASK_LOAD) stageThreads[1][stageCount[1] ++] = nb;
+	}
+	/* threads can steal from any queue as soon as they start */
+	for (nb = 0; nb < count; nb ++)
+		ThreadCreate(mapGenChunkAsync, threads + nb);
+}
+
+/* staging.mode and staging.size must be set before */
+void mapInitStaging(void)
+{
+	if (staging.size < STAGING_MIN) staging.size = STAGING_MIN;
+	if (staging.mode == STAGING_RING)
+	{
+		staging.size &= ~7;
+		staging.mem = malloc(staging.size);
+		staging.capa = SemInit(0);
+	}
+	else /* STAGING_BLOCKS, STAGING_ATOMIC */
+	{
+		int blocks = staging.size >> 12;
+		staging.size = blocks << 12;
+		staging.mem = malloc(staging.size);
+		bitPoolInit(&staging.usage, blocks);
+		if (staging.mode == STAGING_ATOMIC)
+		{
+			/* capa only counts threads waiting for a block */
+			staging.capa = SemInit(0);
+			staging.readyLink = malloc(blocks * sizeof *staging.readyLink);
+			staging.readyHead = -1;
+		}
+		else staging.capa = SemInit(blocks);
+	}
+	staging.alloc = MutexCreate();
+}
+
+void mapFreeStaging(void)
+{
+	int   mode = staging.mode;
+	int   size = staging.size;
+	int   budgetBytes = staging.budgetBytes;
+	float budgetTime  = staging.budgetTime;
+	free(staging.mem);
+	free(staging.ready);
+	free(staging.pending);
+	free(staging.readyLink);
+	bitPoolRelease(&staging.usage);
+	SemClose(staging.capa);
+	MutexDestroy(staging.alloc);
+	memset(&staging, 0, sizeof staging);
+	/* keep settings from ini */
+	staging.mode = mode;
+	staging.size = size;
+	staging.budgetBytes = budgetBytes;
+	staging.budgetTime  = budgetTime;
 }
 
 /* before world is loaded, check that the map has a few chunks in it */
-Map mapInitFromPath(int renderDist, int * XZ)
+Map mapInitFromPath(int renderDist, int * XZ, int allocMode)
 {
 	Map map = calloc(sizeof *map, 1);
 
@@ -816,61 +1829,328 @@ Map mapInitFromPath(int renderDist, int * XZ)
 	map->mapZ    = map->mapX = renderDist + 1;
 	map->cx      = XZ[0];
 	map->cz      = XZ[1];
+	map->allocMode = allocMode;
+	/* looking north, see mapSetViewDir() */
+	map->viewZ   = -1;
+	map->viewCos = cosf(VIEW_FOV * (M_PI / 360));
+	map->viewPrio = 1;
+	map->viewStart = FrameGetTime();
 
 	map->genLock = MutexCreate();
+	map->gpuLock = MutexCreate();
 
 	map->chunks = mapAllocArea(map->mapArea);
+	mapInitSpiral(map->maxDist);
 	map->center = map->chunks + (map->mapX + map->mapZ * map->mapArea);
 	map->chunkOffsets = chunkNeighbor;
 
-	map->genCount = SemInit(mapRedoGenList(map));
-
+	/* work queues belong to threads */
+	map->genCount = SemInit(0);
+	map->loadCount = SemInit(0);
+	map->meshTaken = SemInit(0);
+	map->cache.lock = MutexCreate();
+	map->cache.budget = CACHE_SIZE;
+	map->prefetch = chunkAlloc(PREFETCH_MAX);
+	map->prefetchRings = PREFETCH_RINGS;
 	if (! staging.alloc)
 	{
-		int nb;
-		staging.mem = malloc(MAX_BUFFER);
-		staging.capa = SemInit(MAX_BUFFER/4096);
-		staging.alloc = MutexCreate();
-		for (nb = 0; nb < NUM_THREADS; nb ++)
+		mapInitStaging();
+		mapGenStartThread(map, threadCount);
+	}
+	mapRedoGenList(map);
+
+	return map;
+}
+
+/* change number of worker threads (0 == number of cores): all threads are restarted */
+int mapSetThreadCount(Map map, int count)
+{
+	if (count <= 0) count = mapGetCoreCount();
+	if (count > MAX_THREADS) count = MAX_THREADS;
+	if (count == threadCount) return count;
+
+	/* chunks being processed will be put back in the list */
+	mapGenStopThread(map, THREAD_EXIT);
+	mapGenStartThread(map, count);
+	mapGenRequeue(map);
+
+	return count;
+}
+
+/* dedicate <count> worker threads to loading chunks, others will only generate meshes (0 == all do both) */
+int mapSetLoaderCount(Map map, int count)
+{
+	int nb = threadCount;
+	if (count >= nb) count = nb - 1;
+	if (count < 0)   count = 0;
+	if (count == threadLoaders) return count;
+
+	/* threads sleep on the semaphore of their stage: restart them */
+	mapGenStopThread(map, THREAD_EXIT);
+	threadLoaders = count;
+	mapGenStartThread(map, nb);
+	mapGenRequeue(map);
+
+	return threadLoaders;
+}
+
+/* max bytes kept in chunk cache (0 == disabled), can be changed at any time */
+void mapSetCacheSize(Map map, int bytes)
+{
+	MutexEnter(map->cache.lock);
+	map->cache.budget = bytes;
+	chunkCacheTrim(&map->cache, bytes);
+	MutexLeave(map->cache.lock);
+}
+
+/* rings of chunks loaded ahead of player beyond the map (0 == disabled), can be changed at any time */
+void mapSetPrefetch(Map map, int rings)
+{
+	/* items queued for farther rings will be dropped on next move */
+	map->prefetchRings = rings;
+}
+
+/* utilization of each worker thread (0 - 1) since last call */
+int mapGenThreadLoad(float * load, int max)
+{
+	double now     = FrameGetTime();
+	double elapsed = now - threadSample;
+	int    i;
+
+	for (i = 0; i < threadCount && i < max; i ++)
+	{
+		struct Thread_t * thread = threads + i;
+		/* include time spent on current chunk so far */
+		double started = thread->started;
+		double busy    = thread->busy;
+		if (started > 0) busy += now - started;
+		load[i] = elapsed > 0 ? (busy - thread->sampled) / elapsed : 0;
+		if (load[i] > 1) load[i] = 1;
+		if (load[i] < 0) load[i] = 0;
+		thread->sampled = busy;
+	}
+	threadSample = now;
+	return i;
+}
+
+/* <stats> must have room for STAGE_COUNT items (depths are sampled without lock) */
+void mapGenStageStats(StageStats stats)
+{
+	int i;
+
+	memset(stats, 0, STAGE_COUNT * sizeof *stats);
+	stats[STAGE_LOAD].threads = stageCount[0];
+	stats[STAGE_LOAD].depth   = mapGenDepth(TASK_LOAD);
+	stats[STAGE_MESH].threads = stageCount[1];
+	stats[STAGE_MESH].depth   = mapGenDepth(TASK_MESH);
+	for (i = 0; i < threadCount; i ++)
+	{
+		struct Thread_t * thread = threads + i;
+		stats[STAGE_LOAD].done += thread->loads;
+		stats[STAGE_MESH].done += thread->chunks;
+		/* loaders stall on mesh threads, others on staging area */
+		stats[thread->stage == TASK_LOAD ? STAGE_LOAD : STAGE_MESH].stalled += thread->waited;
+	}
+	stats[STAGE_UPLOAD].threads = 1;
+	stats[STAGE_UPLOAD].depth   = staging.chunkData;
+	stats[STAGE_UPLOAD].done    = staging.stats.uploaded;
+}
+
+/* middle of <bucket> (in us) */
+static double histoValue(int bucket)
+{
+	int shift;
+	if (bucket < HISTO_SUB) return bucket;
+	shift = bucket / HISTO_SUB - 1;
+	return ldexp(HISTO_SUB + bucket % HISTO_SUB, shift) + (ldexp(1, shift) - 1) / 2;
+}
+
+static float histoPercentile(Histogram histo, double ratio)
+{
+	uint32_t rank = ceil(histo->samples * ratio);
+	uint32_t total;
+	double   value;
+	int      i;
+
+	if (histo->samples == 0) return 0;
+	if (rank == 0) rank = 1;
+	for (i = total = 0; i < HISTO_BUCKETS && (total += histo->count[i]) < rank; i ++);
+	/* max is exact */
+	value = i < HISTO_BUCKETS ? histoValue(i) : histo->max;
+	if (value > histo->max) value = histo->max;
+	return value / 1000;
+}
+
+static void histoStats(Histogram histo, LatencyStats stats)
+{
+	stats->samples = histo->samples;
+	stats->avg = histo->samples > 0 ? histo->sum / histo->samples / 1000 : 0;
+	stats->p50 = histoPercentile(histo, 0.5);
+	stats->p99 = histoPercentile(histo, 0.99);
+	stats->max = histo->max / 1000.0f;
+}
+
+/*
+ * <stats> must have room for LAT_COUNT items: latency of stages of <worker> thread (only the LAT_WORKER first ones),
+ * or of all threads and main thread if <worker> is -1. Worker histograms are read without lock and are reset
+ * along with threads. Return number of stages filled.
+ */
+int mapGenLatency(LatencyStats stats, int worker)
+{
+	struct Histogram_t histo;
+	int i, j;
+
+	memset(stats, 0, LAT_COUNT * sizeof *stats);
+	if (worker >= threadCount) return 0;
+	if (worker >= 0)
+	{
+		for (i = 0; i < LAT_WORKER; i ++)
+			histoStats(&threads[worker].lat[i], stats + i);
+		return LAT_WORKER;
+	}
+	for (i = 0; i < LAT_COUNT; i ++)
+	{
+		if (i >= LAT_WORKER)
+		{
+			histoStats(&latMain[i - LAT_WORKER], stats + i);
+			continue;
+		}
+		memset(&histo, 0, sizeof histo);
+		for (j = 0; j < threadCount; j ++)
 		{
-			threads[nb].wait = MutexCreate();
-			threads[nb].map  = map;
-			ThreadCreate(mapGenChunkAsync, threads + nb);
+			Histogram from = &threads[j].lat[i];
+			int       k;
+			for (k = 0; k < HISTO_BUCKETS; histo.count[k] += from->count[k], k ++);
+			histo.samples += from->samples;
+			histo.sum     += from->sum;
+			if (histo.max < from->max) histo.max = from->max;
 		}
+		histoStats(&histo, stats + i);
 	}
+	return LAT_COUNT;
+}
 
-	return map;
+/* samples being recorded by threads at the same time might be lost */
+void mapGenLatencyReset(void)
+{
+	int i;
+	for (i = 0; i < threadCount; i ++)
+		memset(threads[i].lat, 0, sizeof threads[i].lat);
+	memset(latMain, 0, sizeof latMain);
+}
+
+/* write latency of stages (all threads, then each worker thread) as CSV or JSON, return False if <path> can't be created */
+Bool mapGenLatencyDump(STRPTR path, Bool json)
+{
+	static STRPTR names[] = {"queue", "load", "mesh", "stage", "flush", "total"};
+	struct LatencyStats_t stats[LAT_COUNT];
+	FILE * out = fopen(path, "wb");
+	int    worker, rows;
+
+	if (out == NULL) return False;
+	if (json) fprintf(out, "{\n\t\"unit\": \"ms\",\n\t\"latency\": [");
+	else fprintf(out, "stage,worker,samples,avg ms,p50 ms,p99 ms,max ms\n");
+
+	for (worker = -1, rows = 0; worker < threadCount; worker ++)
+	{
+		int count = mapGenLatency(stats, worker);
+		int i;
+		for (i = 0; i < count; i ++)
+		{
+			LatencyStats lat = stats + i;
+			/* loader threads don't mesh, and the other way around */
+			if (worker >= 0 && lat->samples == 0) continue;
+			if (json)
+				fprintf(out, "%s\n\t\t{\"stage\": \"%s\", \"worker\": %d, \"samples\": %d, \"avg\": %.3f, \"p50\": %.3f, "
+					"\"p99\": %.3f, \"max\": %.3f}", rows > 0 ? "," : "", names[i], worker, lat->samples,
+					lat->avg, lat->p50, lat->p99, lat->max);
+			else if (worker < 0)
+				fprintf(out, "%s,all,%d,%.3f,%.3f,%.3f,%.3f\n", names[i], lat->samples, lat->avg, lat->p50, lat->p99, lat->max);
+			else
+				fprintf(out, "%s,%d,%d,%.3f,%.3f,%.3f,%.3f\n", names[i], worker, lat->samples, lat->avg, lat->p50, lat->p99, lat->max);
+			rows ++;
+		}
+	}
+	if (json) fprintf(out, "\n\t]\n}\n");
+	fclose(out);
+	return True;
+}
+
+/*
+ * free data and meshes of up to <max> chunks left beyond lazy chunks (render distance reduced, or grid bigger
+ * than needed), scanning one row of the grid per call: can be called once per frame. Return chunks freed.
+ */
+int mapTrimChunks(Map map, int max)
+{
+	int area = map->mapArea;
+	int i, freed;
+
+	MutexEnter(map->genLock);
+	for (i = freed = 0; i < area && freed < max; i ++)
+	{
+		Chunk c = map->chunks + map->trimSlot;
+		if (++ map->trimSlot == area * area) map->trimSlot = 0;
+
+		if ((c->state->cflags & (CFLAG_GOTDATA|CFLAG_HASMESH)) == 0 || mapInRange(map, c, 1)) continue;
+		/* threads will settle it */
+		if (c->state->processing || c->state->claimed || c->state->queued || c->state->redo) continue;
+		/* meshes still in staging are obsolete */
+		c->state->gen ++;
+		chunkFree(map, c, True);
+		freed ++;
+	}
+	MutexLeave(map->genLock);
+	return freed;
 }
 
-/* change render distance dynamicly */
+/*
+ * change render distance dynamicly: the chunk grid is only a capacity, it is never shrunk. Within it, threads
+ * keep running: tasks still in range are re-keyed, others dropped (mapGenRequeue()) and chunks left outside are
+ * freed a few at a time by mapTrimChunks(). Only growing beyond the grid has to stop threads, it is then
+ * allocated for twice the distance (up to 31) to not have to do it again soon.
+ */
 Bool mapSetRenderDist(Map map, int maxDist)
 {
 	int area = (maxDist * 2) + 4;
+	int grid = map->mapArea - 4;
 
-	if (area == map->mapArea) return True;
+	if (maxDist * 2 + 1 == map->maxDist) return True;
 	if (maxDist < 2 || maxDist > 31) return False;
+	if (! mapInitSpiral(maxDist * 2 + 1)) return False;
 
-	Chunk chunks = mapAllocArea(area);
+	if (area <= map->mapArea)
+	{
+		MutexEnter(map->genLock);
+		map->maxDist = maxDist * 2 + 1;
+		MutexLeave(map->genLock);
+		mapGenRequeue(map);
+		mapGenViewChanged(map);
+		return True;
+	}
+
+	/* grid twice as big as before (distance from center) */
+	if (grid < maxDist) grid = maxDist;
+	if (grid > 31) grid = 31;
+	area = (grid * 2) + 4;
 
 	fprintf(stderr, "setting map size to %d (from %d)\n", area, map->mapArea);
 
+	/* chunkNeighbor[] is about to change: threads must not use it meanwhile */
+	mapGenStopThread(map, THREAD_EXIT_LOOP);
+
+	Chunk chunks = mapAllocArea(area);
+
 	if (chunks)
 	{
 		/* we have all the memory we need: can't fail from this point */
 		int oldArea  = map->mapArea;
-		int size     = ((oldArea < area ? oldArea : area) - 2) >> 1;
+		int size     = (oldArea - 2) >> 1;
 		int XZmid    = (area >> 1) - 1;
-		int freeMesh = 0;
 		int i, j, k;
 
-		mapGenStopThread(map, THREAD_EXIT_LOOP);
-		maxDist ++;
-
-		/* copy chunk information (including lazy chunks) */
+		/* copy chunk information (including lazy chunks), grid is bigger: meshes are still in range */
 		for (j = -size; j <= size; j ++)
 		{
-			if (abs(j) == maxDist) freeMesh |= 1;
-			else freeMesh &= ~1;
 			for (i = -size; i <= size; i ++)
 			{
 				int XC = map->mapX + i;
@@ -881,56 +2161,48 @@ Bool mapSetRenderDist(Map map, int maxDist)
 				if (ZC < 0)        ZC += oldArea; else
 				if (ZC >= oldArea) ZC -= oldArea;
 
-				Chunk source = map->chunks + XC + ZC * oldArea;
-				Chunk dest   = chunks + (XZmid+i) + (XZmid+j) * area;
-				char  nbor   = dest->neighbor;
-				//memcpy(&dest->save, &source->save, sizeof *dest - offsetp(Chunk, save));
+				Chunk      source = map->chunks + XC + ZC * oldArea;
+				Chunk      dest   = chunks + (XZmid+i) + (XZmid+j) * area;
+				ChunkState state  = dest->state;
+				char       nbor   = dest->neighbor;
 				dest[0] = source[0];
-				source->cflags = 0;
+				state[0] = source->state[0];
+				source->state->cflags = 0;
 				dest->neighbor = nbor;
-				if (abs(i) == maxDist) freeMesh |= 2;
-				else freeMesh &= ~2;
+				dest->state = state;
 
 				/* ChunkData ref needs to be readjusted */
 				for (k = dest->maxy-1; k >= 0; k --)
 				{
 					ChunkData cd = dest->layer[k];
-					if (cd)
-					{
-						cd->chunk = dest;
-						if (freeMesh && cd->glSlot)
-						{
-							dest->cflags &= ~CFLAG_HASMESH;
-							renderFreeArray(cd);
-						}
-					}
+					if (cd) cd->chunk = dest;
 					else fprintf(stderr, "chunk %d, %d missing layer %d?\n", dest->X, dest->Z, k);
 				}
 			}
 		}
 
-		if (oldArea > area)
+		/* outer ring of old grid is not copied */
+		Chunk old;
+		for (i = oldArea * oldArea, old = map->chunks; i > 0; old ++, i --)
 		{
-			Chunk old;
-			/* need to free chunk outside new render dist */
-			for (i = oldArea * oldArea, old = map->chunks; i > 0; old ++, i --)
-			{
-				if (old->cflags & (CFLAG_HASMESH|CFLAG_GOTDATA))
-					chunkFree(old, True);
-			}
+			if (old->state->cflags & (CFLAG_HASMESH|CFLAG_GOTDATA))
+				chunkFree(map, old, True);
 		}
 		/* need to point to the new chunk array, otherwise it will point to some free()'ed memory */
 		free(map->chunks);
-		map->maxDist  = area - 3;
+		map->maxDist  = maxDist * 2 + 1;
 		map->mapArea  = area;
 		map->mapZ     = map->mapX = XZmid;
 		map->chunks   = chunks;
 		map->center   = map->chunks + map->mapX + map->mapZ * area;
-		SemAdd(map->genCount, mapRedoGenList(map));
-		return True;
+		map->trimSlot = 0;
 	}
+	/* not enough memory for a bigger grid: keep the old one and its render distance */
+	else mapInitSpiral(map->maxDist);
 
-	return False;
+	mapGenRequeue(map);
+	mapGenViewChanged(map);
+	return chunks != NULL;
 }
 
 /* make happy memory leak debugging tool */
@@ -938,29 +2210,24 @@ void mapFreeAll(Map map)
 {
 	mapGenStopThread(map, THREAD_EXIT);
 
-	GPUBank bank, next;
-	Chunk   chunk;
-	int     i;
+	Chunk chunk;
+	int   i;
 
-	for (chunk = map->chunks, i = map->mapArea * map->mapArea; i > 0; chunkFree(chunk, False), chunk ++, i --);
+	for (chunk = map->chunks, i = map->mapArea * map->mapArea; i > 0; chunkFree(map, chunk, False), chunk ++, i --);
 	free(map->chunks);
 	MutexDestroy(map->genLock);
 	SemClose(map->genCount);
-
-	for (bank = next = HEAD(map->gpuBanks); bank; bank = next)
-	{
-		NEXT(next);
-		free(bank->usedList);
-		free(bank);
-	}
-
+	SemClose(map->loadCount);
+	SemClose(map->meshTaken);
+	chunkCacheTrim(&map->cache, 0);
+	MutexDestroy(map->cache.lock);
+	free(map->prefetch);
+
+	renderFreeBanks(map);
+	MutexDestroy(map->gpuLock);
 	free(map);
 
-
-	free(staging.mem);
-	SemClose(staging.capa);
-	MutexDestroy(staging.alloc);
-	memset(&staging, 0, sizeof staging);
+	mapFreeStaging();
 }
 
 /*
@@ -979,7 +2246,7 @@ void mapGenerateMesh(Map map)
 		Chunk list = (Chunk) ListRemHead(&map->genList);
 		memset(&list->next, 0, sizeof list->next);
 
-		if (list->cflags & CFLAG_HASMESH)
+		if (list->state->cflags & CFLAG_HASMESH)
 			continue;
 
 		/* load 8 surrounding chunks too (mesh generation will need this) */
@@ -991,9 +2258,9 @@ void mapGenerateMesh(Map map)
 			/* already loaded ? */
 			if (chunkLoad(load, X + (dir & 8 ? -16 : dir & 2 ? 16 : 0),
 					Z + (dir & 4 ? -16 : dir & 1 ? 16 : 0)))
-				load->cflags |= CFLAG_GOTDATA;
+				load->state->cflags |= CFLAG_GOTDATA;
 		}
-		if ((list->cflags & CFLAG_GOTDATA) == 0)
+		if ((list->state->cflags & CFLAG_GOTDATA) == 0)
 		{
 			if (TimeMS() - start > 15)
 				break;
@@ -1012,7 +2279,7 @@ void mapGenerateMesh(Map map)
 				renderFinishMesh(map, cd);
 			}
 		}
-		list->cflags |= CFLAG_HASMESH;
+		list->state->cflags |= CFLAG_HASMESH;
 
 		/* we are in the main rendering loop: don't hog the CPU for too long */
 		if (TimeMS() - start > 15)
@@ -1020,3 +2287,21 @@ void mapGenerateMesh(Map map)
 	}
 }
 #endif
+
+/* number of logical cores, default number of worker threads */
+#ifdef WIN32
+#include <windows.h>
+int mapGetCoreCount(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+}
+#else
+#include <unistd.h>
+int mapGetCoreCount(void)
+{
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? count : 1;
+}
+#endif
@@ -5,19 +5,41 @@
 #ifndef CHUNKLOAD_H
 #define CHUNKLOAD_H
 
-#define NUM_THREADS       2
-#define MEMPOOL           4 * 1024 * 1024    /* allocated on the GPU (in bytes) */
+#include "BitPool.h"
+
+#define MAX_THREADS       64       /* upper limit of threadCount */
+#define MEMPOOL           4 * 1024 * 1024    /* allocated on the GPU (in bytes), initial size of banks */
 #define MEMITEM           32
 #define BUILD_HEIGHT      256
 #define CHUNK_LIMIT       (BUILD_HEIGHT/16)
 #define CPOS(pos)         ((int) floor(pos) >> 4)
+#define VIEW_FOV          90       /* default horizontal field of view (degrees) */
+#define VIEW_TURN         0.995f   /* cos of smallest turn that re-keys work queues (about 6 degrees) */
+#define STAGE_DEPTH       8        /* runnable meshes per mesh thread before loader threads stall */
+#define CACHE_SIZE        (256*1024) /* default budget of chunk cache (bytes), see mapSetCacheSize() */
+#define CACHE_HASH        1024     /* buckets in chunk cache hash table (power of 2) */
+#define PREFETCH_RINGS    2        /* default rings loaded ahead of player beyond the map, see mapSetPrefetch() */
+#define PREFETCH_MAX      256      /* chunks being prefetched at once */
+#define TRIM_CHUNKS       16       /* chunks outside render distance freed per frame, see mapTrimChunks() */
+#define CACHE_LINE        64       /* in bytes, default chunkStateStride */
 
 /* private definition */
 typedef struct ChunkData_t *       ChunkData;
 typedef struct GPUBank_t *         GPUBank;
 typedef struct GPUMem_t *          GPUMem;
+typedef struct GPUFree_t *         GPUFree;
+typedef struct GPUStats_t *        GPUStats;
+typedef struct GPUTrace_t *        GPUTrace;
+typedef struct GPURetire_t *       GPURetire;
+typedef struct GPURegion_t *       GPURegion;
+typedef struct WorkQueue_t *       WorkQueue;
+typedef struct CacheEntry_t *      CacheEntry;
 typedef struct Map_t *             Map;
+typedef struct StageStats_t *      StageStats;
+typedef struct Histogram_t *       Histogram;
+typedef struct LatencyStats_t *    LatencyStats;
 typedef struct Chunk_t *           Chunk;
+typedef struct ChunkState_t *      ChunkState;
 typedef struct Chunk_t             Chunk_t;
 typedef struct ChunkData_t         ChunkData_t;
 typedef struct ChunkData_t *       ChunkData;
@@ -27,44 +49,106 @@ typedef uint32_t *                 DATA32;
 typedef uint16_t *                 DATA16;
 typedef int16_t *                  DATAS16;
 
-Map  mapInitFromPath(int renderDist, int * XZ);
+Map  mapInitFromPath(int renderDist, int * XZ, int allocMode);
+Chunk mapAllocArea(int area);
 Bool mapMoveCenter(Map, vec4 old, vec4 pos);
 int  checkMem(GPUBank bank);
 void mapGenFlush(Map map);
 void mapFreeAll(Map map);
 Bool mapSetRenderDist(Map, int maxDist);
+int  mapTrimChunks(Map, int max);
+int  mapSetThreadCount(Map, int count);
+int  mapSetLoaderCount(Map, int count);
+void mapSetViewDir(Map, vec4 dir, float fov, Bool priority);
+void mapSetCacheSize(Map, int bytes);
+void mapSetPrefetch(Map, int rings);
+int  mapGenThreadLoad(float * load, int max);
+void mapGenStageStats(StageStats stats);
+int  mapGenLatency(LatencyStats stats, int worker);
+void mapGenLatencyReset(void);
+Bool mapGenLatencyDump(STRPTR path, Bool json);
+int  mapGetCoreCount(void);
+
+/* ChunkLoadGPU.c */
+int  renderStoreArrays(Map, ChunkData, int size);
+void renderFreeArray(Map, ChunkData);
+void renderFinishMesh(Map, ChunkData);
+void renderNextFrame(Map);
+int  renderReserveArrays(Map, GPURegion, ChunkData, int size);
+void renderCancelReserve(Map, ChunkData);
+void renderReleaseRegion(Map, GPURegion);
+void renderFreeBanks(Map);
+int  renderCompactBanks(Map, int budget);
+void renderGetStats(Map, GPUStats);
+Bool renderTraceStart(STRPTR path);
+int  renderTraceStop(void);
 
 
-struct ChunkData_t
+struct ChunkData_t                 /* fields grouped by who accesses them */
 {
+	/* set by chunkSource, read only afterwards */
 	Chunk     chunk;
 	int       Y;
 	int       cdFlags;
+	int       glSize;              /* size in bytes */
 
-	/* VERTEX_ARRAY_BUFFER location */
-	void *    glBank;              /* note: this field must be first after tables (needed in chunkFill()) */
+	/* VERTEX_ARRAY_BUFFER location: main thread (render, upload, compaction) */
+	void *    glBank;
 	int       glSlot;
-	int       glSize;              /* size in bytes */
+
+	/* range reserved by the worker thread meshing it, published by renderFinishMesh() (gpuLock) */
+	int       glResOffset;
+	int       glResSize;
+	void *    glResBank;
 };
 
-struct Chunk_t
+enum /* index in Chunk_t.stamp */
+{
+	STAMP_QUEUED,                  /* TASK_LOAD queued */
+	STAMP_NEEDED,                  /* mesh needed (chunk entered render distance) */
+	STAMP_CLAIMED,                 /* TASK_LOAD claimed by a thread */
+	STAMP_LOADED,
+	STAMP_MESHED,                  /* last layer pushed to staging area */
+	STAMP_COUNT
+};
+
+struct ChunkState_t                /* written by any thread on any chunk: one cache line each, see chunkAlloc() */
 {
-	ListNode  next;                /* processing */
-	ChunkData layer[CHUNK_LIMIT];  /* sub-chunk array */
-	int       X, Z;                /* map coord (not chunk) */
 	uint8_t   cflags;              /* CLFAG_* */
+	uint8_t   processing;          /* being loaded by a worker thread (TASK_LOAD) */
+	uint8_t   queued;              /* TASK_* in a WorkQueue_t, not claimed by a thread yet */
+	uint8_t   claimed;             /* mesh being generated by a worker thread (TASK_MESH) */
+	uint8_t   redo;                /* slot must be reused for redoX, redoZ once released by threads */
+	uint8_t   deps;                /* chunks around (3x3) not loaded yet: mesh is queued when it drops to 0 */
+	uint16_t  gen;                 /* incremented when queued item, current processing and staged meshes are obsolete */
+	int       redoX, redoZ;
+};
+
+struct Chunk_t                     /* read mostly: scheduler state is in Chunk_t.state */
+{
+	/* read on neighbors by scheduler */
+	ChunkState state;
+	int       X, Z;                /* map coord (not chunk) */
 	uint8_t   neighbor;
 	uint8_t   maxy;
-	uint8_t   processing;
+
+	/* thread meshing it */
+	ChunkData layer[CHUNK_LIMIT];  /* sub-chunk array */
+
+	/* rarely accessed */
 	int       color;
+	ListNode  next;                /* processing */
+	double    stamp[STAMP_COUNT];  /* FrameGetTime() of pipeline steps (0 == not yet), see mapGenLatency() */
 };
 
+extern int chunkStateStride;       /* bytes between ChunkState_t of 2 chunks (CACHE_LINE), set before mapInitFromPath() */
+
 enum
 {
 	VX, VY, VZ, VW
 };
 
-enum /* flags for Chunk_t.cflags */
+enum /* flags for ChunkState_t.cflags */
 {
 	CFLAG_GOTDATA    = 0x01,       /* data has been retrieved */
 	CFLAG_HASMESH    = 0x02,       /* mesh generated and pushed to GPU */
@@ -80,61 +164,398 @@ struct GPUMem_t                    /* one allocation */
 	int       id;                  /* easier to debug */
 };
 
+struct GPUFree_t                   /* one free range (ALLOC_SIZECLASS only) */
+{
+	int       offset;              /* key of treap */
+	int       size;                /* in bytes, 0 == unused item */
+	int       left, right;         /* treap ordered by offset (index in freeRanges) */
+	int       prev, next;          /* size class list (or list of unused items) */
+	int       maxSize;             /* max size of ranges in sub-tree */
+	uint32_t  prio;                /* treap priority */
+};
+
+#define SL_LOG2           3        /* second level size classes: 8 subdivisions of each power of 2 */
+#define SL_COUNT          (1 << SL_LOG2)
+#define FL_COUNT          (32 - SL_LOG2)
+
 struct GPUBank_t                   /* one chunk of memory */
 {
 	ListNode  node;
 	int       memAvail;            /* in bytes */
 	int       memUsed;             /* in bytes */
+	int       memLive;             /* sum of ranges in usedList (in bytes) */
 	GPUMem    usedList;            /* Array of memory range in use */
 	int       maxItems;            /* max items available in usedList */
 	int       nbItem;              /* number of items in usedList */
-	int       freeItem;
+	int       freeItem;            /* number of free ranges */
+	int       allocMode;           /* ALLOC_* */
+	int       id;                  /* for traces */
+	int       retired;             /* number of ranges in Map_t.retire for this bank */
+	int       memRetired;          /* in bytes */
+	int       memRegions;          /* carved for GPURegion, not published yet (in bytes) */
+	int       emptySince;          /* Map_t.frame when bank became empty (0 == not empty) */
+
+	/* ALLOC_SIZECLASS */
+	GPUFree   freeRanges;          /* pool of free ranges (index 0 is not used) */
+	int       maxRanges;           /* max items in freeRanges */
+	int       freeRoot;            /* root of treap */
+	int       freeSlot;            /* list of unused items in freeRanges */
+	uint32_t  flBitmap;            /* first level classes that are not empty */
+	uint8_t   slBitmap[FL_COUNT];  /* second level classes that are not empty */
+	int       classes[FL_COUNT][SL_COUNT];
+};
+
+enum /* possible values for Map_t.allocMode */
+{
+	ALLOC_FIRSTFIT,                /* free list at end of usedList: O(n) (this is what MCEdit uses) */
+	ALLOC_SIZECLASS                /* segregated size classes + free ranges ordered by offset: O(log n) */
+};
+
+#define GPU_FRAME_LATENCY 3        /* frames the GPU can lag behind: freed ranges are not reused before */
+
+struct GPURetire_t                 /* range freed, but GPU might still be reading from it */
+{
+	GPUBank   bank;
+	int       offset;
+	int       size;
+	int       frame;               /* Map_t.frame when freed */
+};
+
+#define GPU_REGION        (256*1024) /* bytes carved at once by renderReserveArrays() */
+
+/* bank policy: size of new banks depends on the sizes of meshes seen so far */
+#define GPU_BANK_MIN      (1024*1024)
+#define GPU_BANK_MAX      (32*1024*1024)
+#define GPU_BANK_MESHES   128        /* new banks can hold that many average meshes */
+#define GPU_BANK_GRACE    300        /* frames a bank has to stay empty before being released */
+#define GPU_BANK_SPARSE   4          /* banks less than 1/4 full are evacuated by renderCompactBanks() */
+
+struct GPURegion_t                 /* bump allocator owned by one thread */
+{
+	GPUBank   bank;
+	int       offset;
+	int       end;
+};
+
+struct GPUTrace_t                  /* one record of allocation trace */
+{
+	uint16_t  type;                /* GPU_TRACE_* */
+	uint16_t  bank;                /* GPUBank.id */
+	uint32_t  chunk;               /* GPU_TRACE_ID() */
+	int32_t   size;                /* in bytes */
+	int32_t   offset;              /* within bank */
+	uint32_t  time;                /* micro-seconds since renderTraceStart() */
+};
+
+#define GPU_TRACE_MAGIC   "GPUTRC01"
+#define GPU_TRACE_ID(cd)  (((cd)->chunk->color << 4) | (((cd)->Y >> 4) & 15))
+
+enum /* possible values for GPUTrace_t.type */
+{
+	GPU_TRACE_ALLOC,
+	GPU_TRACE_FREE,
+	GPU_TRACE_RESIZE,              /* mesh updated within its current range */
+	GPU_TRACE_MOVE                 /* relocated by renderCompactBanks() */
+};
+
+struct GPUStats_t                  /* see renderGetStats() */
+{
+	int       banks;
+	int       memUsed;             /* in bytes, sum of GPUBank.memUsed */
+	int       memFree;             /* free bytes inside memUsed (that can be reused) */
+	int       memRetired;          /* freed bytes waiting for GPU_FRAME_LATENCY frames */
+	int       memRegions;          /* carved by worker threads, not published yet */
+	int       memReserved;         /* allocated on GPU: sum of GPUBank.memAvail */
+	int       memLive;             /* used by meshes */
+	int       bytesMoved;          /* by renderCompactBanks() */
+	float     fragmentation;       /* memFree / memUsed */
+};
+
+struct CacheEntry_t                /* data of a chunk that has left the map, see chunkCacheAdd() */
+{
+	ListNode   node;               /* LRU: most recent at tail */
+	CacheEntry next;               /* hash chain */
+	int        X, Z;               /* map coord */
+	int        bytes;
+	int        maxy;
+	int        prefetched;         /* loaded by TASK_PREFETCH (not evicted from map) */
+	ChunkData  layer[CHUNK_LIMIT]; /* not on GPU */
+};
+
+struct ChunkCache_t
+{
+	Mutex      lock;
+	ListHead   lru;
+	CacheEntry hash[CACHE_HASH];
+	int        bytes;              /* ChunkData and entries */
+	int        budget;             /* max bytes (0 == disabled) */
+	int        count;              /* entries */
+	int        hits, misses;       /* chunkLoad() served from cache or not */
+	int        dropped;            /* entries removed to stay within budget */
+	int        prefetched;         /* entries added by TASK_PREFETCH */
+	int        prefetchHits;       /* hits on these: chunk was already resident when it entered the map */
 };
 
 struct Map_t
 {
 	ListHead  gpuBanks;
-	ListHead  genList;
-	Semaphore genCount;
-	Mutex     genLock;
+	Semaphore genCount;            /* tasks in work queues (threads sleep on this), only meshes if threadLoaders > 0 */
+	Semaphore loadCount;           /* load tasks for loader threads (threadLoaders > 0) */
+	Semaphore meshTaken;           /* loader threads stalled on STAGE_DEPTH (one SemAdd() per thread) */
+	int       loadStalled;
+	Mutex     genLock;             /* ChunkState_t.processing, queued, claimed, redo, deps, gen */
 	DATAS16   chunkOffsets;
-	int       mapArea;
-	int       maxDist;
+	int       mapArea;             /* chunk grid: area x area slots, never shrunk (see mapSetRenderDist()) */
+	int       maxDist;             /* render distance (diameter in chunks): up to mapArea - 3 */
+	int       trimSlot;            /* next slot checked by mapTrimChunks() */
 	float     cx, cy, cz;          /* player pos (init) */
 	int       mapX, mapZ;          /* map center */
 	Chunk     center;              /* chunks + mapX + mapZ * MAP_AREA */
 	ChunkData firstVisible;        /* frustum chain to render */
+	float     viewX, viewZ;        /* horizontal look vector (normalized), see mapSetViewDir() */
+	float     viewCos;             /* cos of half horizontal field of view */
+	int       viewPrio;            /* chunks in view are generated first (otherwise: spiral order) */
+	double    viewStart;           /* FrameGetTime() when view changed, 0 once all chunks in view have a mesh */
+	float     viewTime;            /* ms it took for all chunks in view to get a mesh after last change */
 	Chunk     chunks;
 	int       GPUchunk;
+	int       allocMode;           /* ALLOC_* */
+	int       bytesMoved;          /* total moved by renderCompactBanks() */
+	int       bankId;              /* next GPUBank.id */
+	Mutex     gpuLock;             /* gpuBanks and retire queue */
+	int       frame;               /* incremented by renderNextFrame() */
+	GPURetire retire;              /* ranges freed, ordered by frame */
+	int       retireCount, retireMax;
+	GPUBank   evacuate;            /* sparse bank being emptied by renderCompactBanks() */
+	uint32_t  meshSizes[32];       /* histogram of mesh sizes (power of 2), for new banks */
+	int       meshCount;
+	int64_t   meshBytes;
+	struct ChunkCache_t cache;     /* chunks evicted from map, can be loaded again without chunkSource */
+	Chunk     prefetch;            /* PREFETCH_MAX chunks outside map, loaded into cache by TASK_PREFETCH */
+	int       prefetchRings;       /* rings ahead of lazy chunks to prefetch (0 == disabled) */
+	float     velX, velZ;          /* recent moves (blocks per mapMoveCenter()), smoothed */
+};
+
+#define STAGING_CACHE     8        /* blocks claimed at once by a thread (STAGING_ATOMIC) */
+
+enum /* WorkItem_t.type */
+{
+	TASK_LOAD = 1,                 /* load chunk data (needed by the 9 meshes around) */
+	TASK_MESH,                     /* generate mesh: runnable once the 3x3 chunks around are loaded */
+	TASK_PREFETCH                  /* load chunk outside map into map->cache (lowest priority, taken by loaders) */
+};
+
+struct WorkItem_t
+{
+	Chunk        chunk;
+	int          gen;              /* ChunkState_t.gen when queued: item is dropped if it differs */
+	int          prio;             /* lowest first, see mapChunkPriority() */
+	int          type;             /* TASK_* */
+};
+
+struct WorkQueue_t                 /* tasks to process: owner pops near end (head), thieves far end */
+{
+	Mutex        lock;
+	struct WorkItem_t * items;     /* [head, tail[, sorted by prio */
+	int          head, tail, max;
+	volatile int first;            /* prio of head item (can be read without lock) */
+	int          loads;            /* TASK_LOAD and TASK_PREFETCH items in [head, tail[ */
+};
+
+enum /* index in mapGenLatency(): time spent by chunks between two steps of the pipeline */
+{
+	LAT_QUEUE,                     /* load queued -> claimed by a thread */
+	LAT_LOAD,                      /* claimed -> data loaded */
+	LAT_MESH,                      /* loaded (or mesh needed if later) -> last layer meshed: includes waiting for neighbors */
+	LAT_STAGE,                     /* meshed -> grabbed from staging area by main thread */
+	LAT_FLUSH,                     /* grabbed -> uploaded (upload budget) */
+	LAT_TOTAL,                     /* mesh needed -> last layer uploaded */
+	LAT_COUNT
+};
+
+#define LAT_WORKER        3        /* stages before this one are measured per worker thread, others by main thread */
+#define HISTO_LOG2        4
+#define HISTO_SUB         (1 << HISTO_LOG2)  /* linear buckets per power of 2 */
+#define HISTO_BUCKETS     ((33 - HISTO_LOG2) * HISTO_SUB) /* enough for any uint32_t */
+
+struct Histogram_t                 /* HDR-style: log-linear buckets of micro-seconds, single writer */
+{
+	uint32_t     count[HISTO_BUCKETS];
+	uint32_t     samples;
+	uint32_t     max;              /* in us */
+	double       sum;              /* in us */
+};
+
+struct LatencyStats_t              /* see mapGenLatency() */
+{
+	int          samples;
+	float        avg, p50, p99, max; /* in ms */
 };
 
 struct Thread_t
 {
-	Mutex wait;
-	Map   map;
-	int   state;
+	Mutex        wait;             /* held while processing a chunk, and by mapGenStopThread() */
+	Map          map;
+	volatile int state;            /* THREAD_*, for display only */
+	struct GPURegion_t region;     /* where meshes of this thread are reserved */
+	int          cache[STAGING_CACHE]; /* STAGING_ATOMIC: blocks claimed, but not used yet */
+	int          cached;
+	int          id;
+	int          stage;            /* TASK_LOAD or TASK_MESH: only takes these tasks (0: both) */
+	int          chunks;           /* meshes generated since thread creation */
+	int          loads;            /* chunks loaded since thread creation */
+	double       busy;             /* ms spent processing chunks (not counting current one) */
+	double       started;          /* FrameGetTime() when current chunk was picked, 0 if idle */
+	double       sampled;          /* busy time at last mapGenThreadLoad() */
+	struct WorkQueue_t work;
+	int          stolen;           /* tasks taken from other queues */
+	int          adjacent;         /* meshes run right after loading their last dependency */
+	double       waited;           /* ms blocked on next stage (staging mem, mesh threads for loaders) */
+	Chunk        current;          /* mesh claimed (genLock) */
+	int          gen;              /* current->gen when claimed */
+	int          cancelled;        /* chunks dropped while being processed */
+	struct Histogram_t lat[LAT_WORKER]; /* latency of stages processed by this thread */
 };
 
+extern struct Thread_t threads[];
+extern int threadCount;            /* worker threads, 0 == number of cores (set before mapInitFromPath()) */
+extern int threadLoaders;          /* worker threads only loading chunks, others only mesh them (0 == all do both) */
+
 enum {
 	THREAD_WAIT_GENLIST,
 	THREAD_WAIT_BUFFER,
-	THREAD_RUNNING
+	THREAD_RUNNING,
+	THREAD_WAIT_MESHERS            /* loader thread: STAGE_DEPTH meshes waiting already */
+};
+
+enum /* index in mapGenStageStats() */
+{
+	STAGE_LOAD,
+	STAGE_MESH,
+	STAGE_UPLOAD,
+	STAGE_COUNT
+};
+
+struct StageStats_t                /* pipeline: loader threads -> mesh threads -> upload (main thread) */
+{
+	int          threads;          /* worker threads taking tasks of this stage (upload: main thread) */
+	int          depth;            /* tasks queued (upload: meshes in staging area) */
+	int          done;             /* tasks completed since threads were started (upload: since start) */
+	float        stalled;          /* ms threads were blocked by next stage (upload: never blocks) */
+};
+
+#define STAGING_MIN       (1024*1024) /* minimum size of staging area */
+
+typedef struct StagingStats_t *    StagingStats;
+
+struct StagingMesh_t               /* mesh waiting to be uploaded */
+{
+	int       offset;              /* in Staging_t.mem */
+	int       dist;                /* squared distance to player in chunks */
+	double    staged;              /* FrameGetTime() when grabbed by main thread */
 };
 
-/* cannot be more than 1Mb becase of start[], need to change to uint16_t if more than that */
-#define MAX_BUFFER     (1024*1024)
+struct StagingStats_t              /* set by mapGenFlush() */
+{
+	int       meshes;              /* uploaded in last frame */
+	int       bytes;
+	float     time;                /* in ms */
+	int       pending;             /* completed meshes left for next frames */
+	int       maxBytes;            /* peak per frame since start */
+	float     maxTime;
+	int       uploaded;            /* meshes since start */
+};
 
 struct Staging_t
 {
 	Semaphore capa;
 	Mutex     alloc;
 	DATA32    mem;
+	int       size;                /* in bytes, must be set before mapInitFromPath() */
 	int       total;
-	int       chunkData;
-	uint32_t  usage[MAX_BUFFER/4096/32];
-	uint8_t   start[MAX_BUFFER/4096];
+	int       chunkData;           /* meshes in staging area */
+	int       mode;                /* STAGING_*, must be set before mapInitFromPath() */
+
+	/* completion queue (STAGING_BLOCKS, STAGING_RING): offset in mem of meshes entirely written */
+	int *     ready;
+	int       readyCount, readyMax;
+
+	/* STAGING_BLOCKS, STAGING_ATOMIC */
+	struct BitPool_t usage;        /* one slot per 4Kb block */
+
+	/* STAGING_ATOMIC: lock-free completion queue */
+	int       readyHead;           /* first block of last mesh pushed (-1 == empty) */
+	int *     readyLink;
+
+	/* upload budget per frame (0 == no limit), can be changed at any time */
+	int       budgetBytes;
+	float     budgetTime;          /* in ms */
+	struct StagingMesh_t * pending; /* completed meshes not uploaded yet (main thread only) */
+	int       pendingCount, pendingMax;
+	struct StagingStats_t stats;
+
+	/* STAGING_RING */
+	int       head, tail;          /* offset in bytes: [tail - head[ is in use */
+	int       used;                /* bytes between tail and head (to distinguish empty and full) */
+	int       waiting;             /* threads waiting for space (also STAGING_ATOMIC) */
+};
+
+enum /* possible values for Staging_t.mode */
+{
+	STAGING_BLOCKS,                /* 4Kb blocks, chained through mem[1] */
+	STAGING_RING,                  /* one contiguous span per mesh in a ring buffer */
+	STAGING_ATOMIC                 /* same as STAGING_BLOCKS, but without staging.alloc (level 0 of usage only) */
 };
 
+#define END_OF_LIST       0xffffffff /* STAGING_BLOCKS: mem[1] of last block of a mesh */
+
+/* staging area (ChunkLoad.c) */
+void   mapInitStaging(void);
+void   mapFreeStaging(void);
+DATA32 mapGenAllocMem(struct Thread_t *);
+void   mapGenReady(DATA32 first);
+
+extern void (*mapNotify)(void);    /* staging area has been modified, can be NULL */
+
+/* first uint32_t of a mesh in staging area: chunk index, layer and ChunkState_t.gen (12 bits) */
+#define STAGING_ID(index, layer, gen)  ((index) | ((layer) << 16) | (((gen) & 0xfff) << 20))
+#define STAGING_CHUNK(id)              ((id) & 0xffff)
+#define STAGING_LAYER(id)              (((id) >> 16) & 15)
+#define STAGING_GEN(id)                ((id) >> 20)
+
+/* STAGING_RING: each span starts with 2 uint32_t: STAGING_ID(), size | flags */
+#define RING_DONE         0x80000000 /* mesh transfered to GPU */
+#define RING_PAD          0x40000000 /* unused space at end of ring */
+#define RING_SIZE         0x3fffffff
+
+/* ChunkLoadRegion.c: where chunkLoad() gets chunk data from */
+typedef struct ChunkSource_t *     ChunkSource;
+
+struct ChunkSource_t
+{
+	/* fill layer[] and maxy of <chunk> (at <X>, <Z>) from worker <thread>, False if there is no chunk there */
+	Bool    (*load)(ChunkSource, Chunk chunk, int X, int Z, int thread);
+	void    (*close)(ChunkSource);
+
+	/* updated by load() */
+	int     chunks;                /* loaded since source was opened */
+	int     empty;                 /* nothing at location (including errors) */
+	int     errors;                /* corrupted data */
+	int64_t bytesRead;             /* compressed data */
+	int64_t bytesInflated;
+};
+
+#define REGION_MAX        16       /* region files memory mapped at once */
+#define REGION_FACE       28       /* approximate mesh size of one block face, in bytes */
+
+extern ChunkSource chunkSource;    /* set before mapInitFromPath(), simulated (loadSpeed) by default */
+extern struct ChunkSource_t sourceSimulated;
+extern uint32_t sourceSeed;        /* simulated source: mesh sizes and delays only depend on it and chunk coord */
+
+ChunkSource sourceOpenRegions(STRPTR folder);
+void        sourceClose(ChunkSource);
+int         sourceGenRegions(STRPTR folder, int X, int Z, int radius, int seed);
+
 struct Frustum_t                   /* frustum culling static tables (see doc/internals.html for detail) */
 {
 	int8_t *  spiral;
@@ -0,0 +1,1319 @@
+/*
+ * ChunkLoadGPU.c : sub-allocator of GPU banks (vertex buffer memory) used by chunk meshes.
+ *
+ * Two allocation policies are available (Map_t.allocMode):
+ * - ALLOC_FIRSTFIT: what MCEdit uses, free list is kept at the end of usedList, ordered by offset.
+ *   Allocation, free and coalescing are O(n) (with n == number of free ranges).
+ * - ALLOC_SIZECLASS: free ranges are linked into segregated size classes (two level bitmap, like
+ *   TLSF) and indexed by offset in a treap. Allocation, free and coalescing are O(log n).
+ *
+ * Both keep the same contract: a ChunkData has a slot in usedList (cd->glSlot) for its mesh.
+ *
+ * renderCompactBanks() can be called once per frame to relocate meshes toward the beginning of
+ * banks (within a budget of bytes), to limit fragmentation over long sessions.
+ *
+ * All alloc/free can be recorded with renderTraceStart(), to be replayed with ChunkBench.
+ *
+ * Freed ranges are not reused immediately: the GPU might still be drawing from them. They are queued
+ * in Map_t.retire and given back to their bank GPU_FRAME_LATENCY frames later by renderNextFrame(),
+ * coalescing them in batch. Since everything is protected by Map_t.gpuLock, renderFreeArray() can be
+ * called from any thread.
+ *
+ * Worker threads can reserve the final location of a mesh with renderReserveArrays(): each thread
+ * owns a GPURegion (a few hundred Kb carved from a bank) and bumps into it. The range is handed to the
+ * ChunkData (glResBank, glResOffset, glResSize) under Map_t.gpuLock, the main thread then only has to
+ * publish it in renderFinishMesh(), which takes it back from the ChunkData under the same lock.
+ *
+ * Bank policy: new banks are sized according to the distribution of mesh sizes seen so far (between
+ * GPU_BANK_MIN and GPU_BANK_MAX), sparse banks are emptied by renderCompactBanks() and empty banks
+ * are released after GPU_BANK_GRACE frames by renderNextFrame().
+ *
+ * Written by T.Pierron, aug 2020.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include "UtilityLibLite.h"
+#include "ChunkLoad.h"
+
+#define MEMSLACK        (2*4096)  /* no need to keep track of free ranges smaller than this */
+#define SL_MASK         (SL_COUNT-1)
+
+static struct                     /* allocation trace, see renderTraceStart() */
+{
+	FILE *   fh;
+	double   start;
+	int      count;
+}	trace;
+
+static void gpuTrace(int type, ChunkData cd, GPUBank bank, int offset, int size)
+{
+	struct GPUTrace_t rec = {
+		.type   = type,
+		.bank   = bank->id,
+		.chunk  = GPU_TRACE_ID(cd),
+		.size   = size,
+		.offset = offset,
+		.time   = (FrameGetTime() - trace.start) * 1000
+	};
+	fwrite(&rec, sizeof rec, 1, trace.fh);
+	trace.count ++;
+}
+
+#define TRACE(type, cd, bank, offset, size) \
+	if (trace.fh) gpuTrace(type, cd, bank, offset, size)
+
+/* record all alloc/free/resize into <path> (binary file, see struct GPUTrace_t) */
+Bool renderTraceStart(STRPTR path)
+{
+	if (trace.fh) renderTraceStop();
+
+	trace.fh = fopen(path, "wb");
+	if (trace.fh)
+	{
+		static char header[] = GPU_TRACE_MAGIC;
+		setvbuf(trace.fh, NULL, _IOFBF, 64*1024);
+		fwrite(header, 1, sizeof header - 1, trace.fh);
+		trace.start = FrameGetTime();
+		trace.count = 0;
+		return True;
+	}
+	return False;
+}
+
+int renderTraceStop(void)
+{
+	int count = trace.count;
+	if (trace.fh)
+	{
+		fclose(trace.fh);
+		trace.fh = NULL;
+		trace.count = 0;
+	}
+	return count;
+}
+
+/* thoroughly checks that all data structure are coherent */
+static int checkRanges(GPUBank bank);
+int checkMem(GPUBank bank)
+{
+	if (bank->allocMode == ALLOC_SIZECLASS)
+		return checkRanges(bank);
+
+	if (bank->freeItem > 0)
+	{
+		GPUMem free = bank->usedList + bank->maxItems - 1;
+		GPUMem eof  = free - bank->freeItem + 1;
+
+		while (free > eof)
+		{
+			GPUMem next = free - 1;
+
+			if (next->offset <= free->offset + free->size)
+				/* must be ordered by increasing <offset>, without range overlapping */
+				return 1;
+
+			free --;
+		}
+
+		if (free->offset + free->size == bank->memUsed)
+			/* last block is freed: it should reduce the range of memory used */
+			return 2;
+	}
+	return 0;
+}
+
+/*
+ * ALLOC_SIZECLASS: free ranges are stored in bank->freeRanges, index 0 is used as NULL.
+ */
+static uint32_t treapSeed = 0x9E3779B9;
+
+/* size in bytes to first level/second level class */
+static void gpuSizeToClass(int size, int * fl, int * sl)
+{
+	int msb = 31 - __builtin_clz(size);
+	if (msb < SL_LOG2)
+		fl[0] = 0, sl[0] = size;
+	else
+		fl[0] = msb - SL_LOG2 + 1, sl[0] = (size >> (msb - SL_LOG2)) & SL_MASK;
+}
+
+static void gpuClassLink(GPUBank bank, int index)
+{
+	GPUFree range = bank->freeRanges + index;
+	int     fl, sl, head;
+
+	gpuSizeToClass(range->size, &fl, &sl);
+	head = bank->classes[fl][sl];
+	range->prev = 0;
+	range->next = head;
+	if (head) bank->freeRanges[head].prev = index;
+	bank->classes[fl][sl] = index;
+	bank->flBitmap |= 1 << fl;
+	bank->slBitmap[fl] |= 1 << sl;
+}
+
+static void gpuClassUnlink(GPUBank bank, int index)
+{
+	GPUFree range = bank->freeRanges + index;
+	int     fl, sl;
+
+	gpuSizeToClass(range->size, &fl, &sl);
+	if (range->prev) bank->freeRanges[range->prev].next = range->next;
+	else bank->classes[fl][sl] = range->next;
+	if (range->next) bank->freeRanges[range->next].prev = range->prev;
+
+	if (bank->classes[fl][sl] == 0)
+	{
+		bank->slBitmap[fl] &= ~(1 << sl);
+		if (bank->slBitmap[fl] == 0)
+			bank->flBitmap &= ~(1 << fl);
+	}
+}
+
+/* treap ordered by offset, priority is random: expected depth is O(log n) */
+static void treapFix(GPUFree pool, int node)
+{
+	/* maxSize: biggest range in subtree: used to find lowest range that can fit a given size */
+	GPUFree range = pool + node;
+	int     max   = range->size;
+	if (range->left  && pool[range->left].maxSize  > max) max = pool[range->left].maxSize;
+	if (range->right && pool[range->right].maxSize > max) max = pool[range->right].maxSize;
+	range->maxSize = max;
+}
+
+static int treapMerge(GPUFree pool, int left, int right)
+{
+	if (left == 0)  return right;
+	if (right == 0) return left;
+	if (pool[left].prio > pool[right].prio)
+	{
+		pool[left].right = treapMerge(pool, pool[left].right, right);
+		treapFix(pool, left);
+		return left;
+	}
+	pool[right].left = treapMerge(pool, left, pool[right].left);
+	treapFix(pool, right);
+	return right;
+}
+
+/* <left> will get all nodes with offset < <key>, <right> the rest */
+static void treapSplit(GPUFree pool, int root, int key, int * left, int * right)
+{
+	if (root == 0)
+	{
+		left[0] = right[0] = 0;
+		return;
+	}
+	else if (pool[root].offset < key)
+	{
+		treapSplit(pool, pool[root].right, key, &pool[root].right, right);
+		left[0] = root;
+	}
+	else
+	{
+		treapSplit(pool, pool[root].left, key, left, &pool[root].left);
+		right[0] = root;
+	}
+	treapFix(pool, root);
+}
+
+static void treapInsert(GPUBank bank, int index)
+{
+	GPUFree pool = bank->freeRanges;
+	int     left, right;
+
+	treapSplit(pool, bank->freeRoot, pool[index].offset, &left, &right);
+	bank->freeRoot = treapMerge(pool, treapMerge(pool, left, index), right);
+}
+
+/* size or offset of node with key <offset> has been modified in place: fix maxSize up to root */
+static void treapFixPath(GPUFree pool, int node, int offset)
+{
+	if (node == 0) return;
+	if (pool[node].offset != offset)
+		treapFixPath(pool, offset < pool[node].offset ? pool[node].left : pool[node].right, offset);
+	treapFix(pool, node);
+}
+
+static void treapRemove(GPUBank bank, int index)
+{
+	GPUFree pool = bank->freeRanges;
+	int *   link = &bank->freeRoot;
+	int     key  = pool[index].offset;
+	int     parent = 0;
+
+	while (*link != index)
+	{
+		parent = *link;
+		link = key < pool[parent].offset ? &pool[parent].left : &pool[parent].right;
+	}
+
+	*link = treapMerge(pool, pool[index].left, pool[index].right);
+	if (parent) treapFixPath(pool, bank->freeRoot, pool[parent].offset);
+}
+
+static int gpuNewRange(GPUBank bank, int offset, int size)
+{
+	GPUFree range;
+	int     index = bank->freeSlot;
+
+	if (index == 0)
+	{
+		/* no unused item: grow pool */
+		int max = bank->maxRanges + MEMITEM;
+		range = realloc(bank->freeRanges, max * sizeof *range);
+		if (range == NULL) return 0;
+		memset(range + bank->maxRanges, 0, MEMITEM * sizeof *range);
+		/* slot 0 is reserved as NULL */
+		for (index = bank->maxRanges == 0 ? 1 : bank->maxRanges; index < max-1; range[index].next = index + 1, index ++);
+		index = bank->maxRanges == 0 ? 1 : bank->maxRanges;
+		bank->freeRanges = range;
+		bank->maxRanges = max;
+	}
+	range = bank->freeRanges + index;
+	bank->freeSlot = range->next;
+	treapSeed ^= treapSeed << 13;
+	treapSeed ^= treapSeed >> 17;
+	treapSeed ^= treapSeed << 5;
+	range->offset = offset;
+	range->size   = size;
+	range->left   = range->right = 0;
+	range->prio   = treapSeed;
+	range->maxSize = size;
+	bank->freeItem ++;
+	return index;
+}
+
+static void gpuDelRange(GPUBank bank, int index)
+{
+	GPUFree range = bank->freeRanges + index;
+	range->size = 0;
+	range->next = bank->freeSlot;
+	bank->freeSlot = index;
+	bank->freeItem --;
+}
+
+/* allocate <size> bytes at the beginning of free range <index> */
+static int gpuTakeRange(GPUBank bank, int index, int * size)
+{
+	GPUFree range  = bank->freeRanges + index;
+	int     offset = range->offset;
+
+	gpuClassUnlink(bank, index);
+	if (size[0] + MEMSLACK >= range->size)
+	{
+		/* freed range entirely reused */
+		size[0] = range->size;
+		treapRemove(bank, index);
+		gpuDelRange(bank, index);
+	}
+	else /* still some capacity left: order in tree is not modified */
+	{
+		range->offset += size[0];
+		range->size   -= size[0];
+		treapFixPath(bank->freeRanges, bank->freeRoot, range->offset);
+		gpuClassLink(bank, index);
+	}
+	return offset;
+}
+
+/* find a free range for <size> bytes in <bank>: return offset or -1 */
+static int gpuAllocRange(GPUBank bank, int * size)
+{
+	int fl, sl, index, req = size[0];
+
+	/* round up to next class: all ranges in it will be big enough */
+	index = 31 - __builtin_clz(req);
+	if (index >= SL_LOG2) req += (1 << (index - SL_LOG2)) - 1;
+	gpuSizeToClass(req, &fl, &sl);
+
+	index = 0;
+	if (fl < FL_COUNT)
+	{
+		uint32_t slMap = bank->slBitmap[fl] & (~0u << sl);
+		if (slMap == 0)
+		{
+			uint32_t flMap = bank->flBitmap & (~0u << (fl + 1));
+			if (flMap)
+			{
+				fl = __builtin_ctz(flMap);
+				slMap = bank->slBitmap[fl];
+			}
+		}
+		if (slMap)
+			index = bank->classes[fl][__builtin_ctz(slMap)];
+	}
+
+	if (index == 0)
+	{
+		/* bigger classes are all empty: check the ranges in the class of <size> */
+		gpuSizeToClass(size[0], &fl, &sl);
+		for (index = bank->classes[fl][sl]; index && bank->freeRanges[index].size < size[0];
+		     index = bank->freeRanges[index].next);
+	}
+
+	if (index > 0)
+		return gpuTakeRange(bank, index, size);
+
+	/* nothing in free list: alloc at the end */
+	if (bank->memUsed + size[0] <= bank->memAvail)
+	{
+		int offset = bank->memUsed;
+		bank->memUsed += size[0];
+		return offset;
+	}
+	return -1;
+}
+
+/* lowest free range that can hold <size> bytes and that starts before <below> */
+static int gpuLowestRange(GPUBank bank, int * size, int below)
+{
+	GPUFree pool = bank->freeRanges;
+	int     node = bank->freeRoot;
+
+	if (node == 0 || pool[node].maxSize < size[0])
+		return -1;
+
+	for (;;)
+	{
+		GPUFree range = pool + node;
+		if (range->left && pool[range->left].maxSize >= size[0]) node = range->left; else
+		if (range->size >= size[0]) break; else
+		node = range->right;
+	}
+	return pool[node].offset < below ? gpuTakeRange(bank, node, size) : -1;
+}
+
+/* ALLOC_FIRSTFIT: first free block (ie: lowest offset) that can hold <size>, starting before <below> */
+static int gpuFirstFit(GPUBank bank, int * size, int below)
+{
+	GPUMem free = bank->usedList + bank->maxItems - 1;
+	GPUMem eof  = free - bank->freeItem + 1;
+
+	while (free >= eof && free->offset < below)
+	{
+		/* first place available */
+		if (size[0] <= free->size)
+		{
+			int off = free->offset;
+			/* no need to keep track of such a small quantity (typical chunk mesh is around 10Kb) */
+			if (size[0] + MEMSLACK >= free->size)
+				size[0] = free->size;
+			if (free->size == size[0])
+			{
+				/* freed slot entirely reused */
+				bank->freeItem --;
+				/* free list must be contiguous */
+				memmove(eof + 1, eof, (DATA8) free - (DATA8) eof);
+			}
+			else /* still some capacity left */
+			{
+				free->size -= size[0];
+				free->offset += size[0];
+			}
+			return off;
+		}
+		free --;
+	}
+	return -1;
+}
+
+/* get a free range located before <below> */
+static int gpuAllocBelow(GPUBank bank, int * size, int below)
+{
+	if (bank->allocMode == ALLOC_SIZECLASS)
+		return gpuLowestRange(bank, size, below);
+	else
+		return gpuFirstFit(bank, size, below);
+}
+
+/* mark range <start> - <start+size> as free, coalesce with neighbors */
+static void gpuFreeRange(GPUBank bank, int start, int size)
+{
+	GPUFree pool = bank->freeRanges;
+	int     end  = start + size;
+	int     prev, next, node;
+
+	/* get free ranges immediately before and after */
+	for (prev = next = 0, node = bank->freeRoot; node; )
+	{
+		if (pool[node].offset < start)
+			prev = node, node = pool[node].right;
+		else
+			next = node, node = pool[node].left;
+	}
+
+	if (prev && pool[prev].offset + pool[prev].size != start) prev = 0;
+	if (next && pool[next].offset != end) next = 0;
+
+	if (prev)
+	{
+		gpuClassUnlink(bank, prev);
+		start = pool[prev].offset;
+	}
+	if (next)
+	{
+		gpuClassUnlink(bank, next);
+		end += pool[next].size;
+	}
+
+	if (end == bank->memUsed)
+	{
+		/* last range being freed: reduce memory used instead */
+		bank->memUsed = start;
+		if (prev) treapRemove(bank, prev), gpuDelRange(bank, prev);
+		if (next) treapRemove(bank, next), gpuDelRange(bank, next);
+		return;
+	}
+
+	if (prev)
+	{
+		node = prev;
+		if (next) treapRemove(bank, next), gpuDelRange(bank, next);
+	}
+	else if (next)
+	{
+		/* offset decreases, but stays above previous range: order in tree is still valid */
+		node = next;
+	}
+	else
+	{
+		node = gpuNewRange(bank, start, size);
+		if (node == 0) { fprintf(stderr, "alloc failed: leaking %d bytes\n", size); return; }
+		treapInsert(bank, node);
+	}
+
+	pool = bank->freeRanges + node;
+	pool->offset = start;
+	pool->size   = end - start;
+	treapFixPath(bank->freeRanges, bank->freeRoot, start);
+	gpuClassLink(bank, node);
+}
+
+/* in-order traversal of the tree: ranges must be ordered, not overlapping and not adjacent */
+static int checkTree(GPUBank bank, int node, int * last, int * count)
+{
+	GPUFree pool = bank->freeRanges;
+	int     ret;
+	if (node == 0) return 0;
+	if ((ret = checkTree(bank, pool[node].left, last, count))) return ret;
+	if (pool[node].offset <= last[0]) return 1;
+	if (pool[node].size <= 0) return 3;
+	last[0] = pool[node].offset + pool[node].size;
+	count[0] ++;
+	return checkTree(bank, pool[node].right, last, count);
+}
+
+static int checkRanges(GPUBank bank)
+{
+	int last = -1, count = 0, fl, sl, ret;
+
+	ret = checkTree(bank, bank->freeRoot, &last, &count);
+	if (ret > 0) return ret;
+	if (last == bank->memUsed) return 2;
+	if (count != bank->freeItem) return 4;
+
+	/* all free ranges must be in the class list they belong to */
+	for (fl = count = 0; fl < FL_COUNT; fl ++)
+	{
+		for (sl = 0; sl < SL_COUNT; sl ++)
+		{
+			int index, fl2, sl2;
+			for (index = bank->classes[fl][sl]; index; index = bank->freeRanges[index].next, count ++)
+			{
+				gpuSizeToClass(bank->freeRanges[index].size, &fl2, &sl2);
+				if (fl2 != fl || sl2 != sl) return 5;
+			}
+		}
+	}
+	return count == bank->freeItem ? 0 : 4;
+}
+
+/* keep track of mesh sizes: will be used to size next banks */
+static void gpuMeshSize(Map map, int size)
+{
+	if (map->meshCount == 65536)
+	{
+		/* old samples weight less and less */
+		int i;
+		for (i = 0; i < 32; i ++)
+			map->meshSizes[i] >>= 1;
+		map->meshCount >>= 1;
+		map->meshBytes >>= 1;
+	}
+	map->meshSizes[31 - __builtin_clz(size)] ++;
+	map->meshCount ++;
+	map->meshBytes += size;
+}
+
+/* size of a new bank that must be able to hold at least <min> bytes */
+static int gpuBankSize(Map map, int min)
+{
+	int size = MEMPOOL;
+
+	if (map->meshCount >= MEMITEM)
+	{
+		int i, n;
+		/* enough space for GPU_BANK_MESHES average meshes, or a few of the biggest (99th percentile) */
+		for (i = 31, n = map->meshCount / 100; i > 0 && n >= (int) map->meshSizes[i]; n -= map->meshSizes[i], i --);
+		size = map->meshBytes / map->meshCount * GPU_BANK_MESHES;
+		n = i < 20 ? (2 << i) * 8 : GPU_BANK_MAX;
+		if (size < n) size = n;
+		if (size < GPU_BANK_MIN) size = GPU_BANK_MIN;
+		if (size > GPU_BANK_MAX) size = GPU_BANK_MAX;
+	}
+	if (size <= min) size = min + 1;
+	/* round to next power of 2 */
+	return 1 << (32 - __builtin_clz(size - 1));
+}
+
+static GPUBank gpuNewBank(Map map, int min)
+{
+	GPUBank bank = calloc(sizeof *bank, 1);
+	bank->memAvail  = gpuBankSize(map, min);
+	bank->maxItems  = MEMITEM;
+	bank->usedList  = calloc(sizeof *bank->usedList, MEMITEM);
+	bank->allocMode = map->allocMode;
+	bank->id        = map->bankId ++;
+
+	#if 0
+	glGenVertexArrays(1, &bank->vaoTerrain);
+	/* will also init vboLocation and vboMDAI */
+	glGenBuffers(3, &bank->vboTerrain);
+
+	/* pre-configure terrain VAO: 5 bytes per vertex */
+	glBindVertexArray(bank->vaoTerrain);
+	glBindBuffer(GL_ARRAY_BUFFER, bank->vboTerrain);
+	/* this will allocate memory on the GPU: mem chunks of 20Mb */
+	glBufferData(GL_ARRAY_BUFFER, bank->memAvail, NULL, GL_STATIC_DRAW);
+	glVertexAttribIPointer(0, 4, GL_UNSIGNED_INT, VERTEX_DATA_SIZE, 0);
+	glEnableVertexAttribArray(0);
+	glVertexAttribIPointer(1, 3, GL_UNSIGNED_INT, VERTEX_DATA_SIZE, (void *) 16);
+	glEnableVertexAttribArray(1);
+	/* 16 bytes of per-instance data (3 float for loc and 1 uint for flags) */
+	glBindBuffer(GL_ARRAY_BUFFER, bank->vboLocation);
+	glVertexAttribPointer(2, 4, GL_FLOAT, 0, 0, 0);
+	glEnableVertexAttribArray(2);
+	glVertexAttribDivisor(2, 1);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	#endif
+
+	ListAddTail(&map->gpuBanks, &bank->node);
+	return bank;
+}
+
+static void gpuFreeBank(GPUBank bank)
+{
+	/* in the real engine: glDeleteBuffers/glDeleteVertexArrays */
+	free(bank->usedList);
+	free(bank->freeRanges);
+	free(bank);
+}
+
+/* make room for <count> more items in usedList */
+static Bool gpuGrowItems(GPUBank bank, int count)
+{
+	/* free list is only stored at the end of usedList with ALLOC_FIRSTFIT */
+	int    freeItem = bank->allocMode == ALLOC_FIRSTFIT ? bank->freeItem : 0;
+	GPUMem store;
+
+	if (bank->nbItem + freeItem + count > bank->maxItems)
+	{
+		/* not enough items */
+		store = realloc(bank->usedList, (bank->maxItems + MEMITEM) * sizeof *store);
+		if (store)
+		{
+			/* keep free list at the end */
+			fprintf(stderr, "reallocating from %d to %d\n", bank->maxItems, bank->maxItems+MEMITEM);
+			memmove(store + bank->maxItems + MEMITEM - freeItem, store + bank->maxItems - freeItem, freeItem * sizeof *store);
+			memset(store + bank->maxItems - freeItem, 0, MEMITEM * sizeof *store);
+			bank->maxItems += MEMITEM;
+			bank->usedList = store;
+		}
+		else { fprintf(stderr, "alloc failed: aborting\n"); return False; }
+	}
+	return True;
+}
+
+/* make sure gpuStoreItem() will succeed on <bank> */
+static Bool gpuReserveItem(GPUBank bank)
+{
+	/* retired ranges will end up in free list too (ALLOC_FIRSTFIT) */
+	return gpuGrowItems(bank, bank->allocMode == ALLOC_FIRSTFIT ? bank->retired + 1 : 1);
+}
+
+/* add <cd> to usedList of <bank>, mesh is located at <off> */
+static int gpuStoreItem(GPUBank bank, ChunkData cd, int off, int size)
+{
+	GPUMem store;
+
+	if (! gpuReserveItem(bank))
+		return -1;
+
+	store = bank->usedList + bank->nbItem;
+	store->size = size;
+	store->offset = off;
+
+	bank->nbItem ++;
+	bank->memLive += size;
+	store->cd = cd;
+	store->id = cd->chunk->color;
+	cd->glSlot = bank->nbItem - 1;
+	cd->glSize = size;
+	cd->glBank = bank;
+
+	return off;
+}
+
+/* allocation policy of <bank>: return offset of <size> bytes or -1 */
+static int gpuAllocIn(GPUBank bank, int * size)
+{
+	int off;
+
+	if (bank->allocMode == ALLOC_SIZECLASS)
+		return gpuAllocRange(bank, size);
+
+	/* ALLOC_FIRSTFIT: bank is full if nothing can be added at the end */
+	if (bank->memAvail <= bank->memUsed + size[0])
+		return -1;
+
+	/* check for free space in the bank */
+	off = gpuFirstFit(bank, size, bank->memUsed);
+
+	if (off < 0)
+	{
+		/* no free block big enough: alloc at the end */
+		off = bank->memUsed;
+		bank->memUsed += size[0];
+	}
+	return off;
+}
+
+/* find <size> bytes in one of the banks (a new one is allocated if needed) */
+static int gpuAlloc(Map map, GPUBank * ret, int * size)
+{
+	GPUBank bank;
+	int     off = -1;
+
+	/* don't refill the bank renderCompactBanks() is trying to empty */
+	for (bank = HEAD(map->gpuBanks); bank; NEXT(bank))
+		if (bank != map->evacuate && (off = gpuAllocIn(bank, size)) >= 0) break;
+
+	if (bank == NULL && map->evacuate)
+	{
+		/* it is needed after all */
+		bank = map->evacuate;
+		map->evacuate = NULL;
+		off = gpuAllocIn(bank, size);
+		if (off < 0) bank = NULL;
+	}
+
+	if (bank == NULL)
+	{
+		bank = gpuNewBank(map, size[0]);
+		off = gpuAllocIn(bank, size);
+	}
+	*ret = bank;
+	return off;
+}
+
+static void gpuFreeArray(Map map, ChunkData cd);
+static void gpuFreeBlock(GPUBank bank, int start, int size);
+
+/* malloc()-like function */
+static int gpuStoreArrays(Map map, ChunkData cd, int size)
+{
+	GPUBank bank;
+	int     off;
+
+	if (size == 0)
+	{
+		if (cd->glBank)
+			gpuFreeArray(map, cd);
+		return -1;
+	}
+
+	gpuMeshSize(map, size);
+	off = gpuAlloc(map, &bank, &size);
+	if (gpuStoreItem(bank, cd, off, size) < 0)
+	{
+		/* range is not referenced anywhere: give it back right away */
+		gpuFreeBlock(bank, off, size);
+		return -1;
+	}
+
+	TRACE(GPU_TRACE_ALLOC, cd, bank, off, size);
+
+	#ifdef DEBUG
+	int ret = checkMem(bank);
+	if (ret > 0)
+		fprintf(stderr, "error alloc code = %d for chunk %d\n", ret, cd->chunk->color);
+	#endif
+
+	return off;
+}
+
+int renderStoreArrays(Map map, ChunkData cd, int size)
+{
+	MutexEnter(map->gpuLock);
+	size = gpuStoreArrays(map, cd, size);
+	MutexLeave(map->gpuLock);
+	return size;
+}
+
+/* give back range <start> - <start+size> to <bank> */
+static void gpuFreeBlock(GPUBank bank, int start, int size)
+{
+	GPUMem   mem, eof, free;
+	unsigned count;
+	int      end = start + size;
+	Bool     spare;
+
+	if (bank->allocMode == ALLOC_SIZECLASS)
+	{
+		gpuFreeRange(bank, start, size);
+		return;
+	}
+
+	/* need at least one spare item between usedList and free list to insert a range (not to merge one) */
+	spare = gpuGrowItems(bank, 1);
+
+	/* add block <off> - <size> to free list */
+	mem = free = bank->usedList + bank->maxItems - 1;
+	eof = mem - bank->freeItem + 1;
+
+	/* keep free list ordered in increasing offset (from end of array toward beginning) */
+	while (mem >= eof)
+	{
+		if (end < mem->offset)
+		{
+			/* out of memory: range is lost */
+			if (! spare) return;
+			/* insert before mem: items from eof to mem (included) move down one slot */
+			count = mem + 1 - eof;
+			memmove(eof - 1, eof, count * sizeof *mem);
+			mem->offset = start;
+			mem->size   = size;
+			bank->freeItem ++;
+			return;
+		}
+		else if (end == mem->offset)
+		{
+			/* can be merged at beginning of <mem> */
+			mem->offset = start;
+			mem->size += size;
+			/* can we merge with previous item? */
+			if (mem < free && mem[1].offset + mem[1].size == start)
+			{
+				/* remove <mem>: items from eof to mem (excluded) move up one slot */
+				count = mem - eof;
+				mem[1].size += mem->size;
+				memmove(eof + 1, eof, count * sizeof *mem);
+				bank->freeItem --;
+				eof ++;
+				mem ++;
+			}
+			check_free:
+			if (mem->size + mem->offset == bank->memUsed)
+			{
+				/* discard last free block */
+				bank->memUsed -= mem->size;
+				bank->freeItem --;
+			}
+			return;
+		}
+		else if (start == mem->offset + mem->size)
+		{
+			/* can be merged at end of <mem> */
+			mem->size += size;
+			/* can we merge with next item? */
+			if (mem > eof && mem[-1].offset == end)
+			{
+				/* remove mem[-1] */
+				count = mem - 1 - eof;
+				mem->size += mem[-1].size;
+				memmove(eof + 1, eof, count * sizeof *mem);
+				bank->freeItem --;
+			}
+			goto check_free;
+		}
+		else mem --;
+	}
+
+	/* cannot merge with existing free list: add it at the beginning */
+	if (end < bank->memUsed)
+	{
+		if (! spare) return;
+		/* we just removed an item, therefore it is safe to add one back */
+		eof[-1].offset = start;
+		eof[-1].size = size;
+		bank->freeItem ++;
+	}
+	else bank->memUsed -= size;
+	/* else last item being removed: simply discard everything */
+}
+
+/* remove <cd> from usedList, without freeing the range it used */
+static void gpuRemoveItem(GPUBank bank, ChunkData cd)
+{
+	GPUMem mem = bank->usedList + cd->glSlot;
+	GPUMem eof = bank->usedList + bank->nbItem - 1;
+
+	cd->glBank = NULL;
+	bank->memLive -= mem->size;
+
+	if (mem < eof)
+	{
+		/* keep block list contiguous, but not necessarily ordered */
+		mem[0] = eof[0];
+		eof->cd->glSlot = cd->glSlot;
+	}
+	bank->nbItem --;
+}
+
+/* range <start> - <start+size> will be given back to <bank> in GPU_FRAME_LATENCY frames */
+static void gpuRetire(Map map, GPUBank bank, int start, int size)
+{
+	GPURetire retire;
+
+	if (map->retireCount == map->retireMax)
+	{
+		retire = realloc(map->retire, (map->retireMax + MEMITEM) * sizeof *retire);
+		if (! retire)
+		{
+			/* can't wait then */
+			fprintf(stderr, "alloc failed: freeing range immediately\n");
+			gpuFreeBlock(bank, start, size);
+			return;
+		}
+		map->retire = retire;
+		map->retireMax += MEMITEM;
+	}
+	retire = map->retire + map->retireCount ++;
+	retire->bank   = bank;
+	retire->offset = start;
+	retire->size   = size;
+	retire->frame  = map->frame;
+	bank->retired ++;
+	bank->memRetired += size;
+}
+
+/* mark memory occupied by the array as free (once GPU is done with it) */
+static void gpuFreeArray(Map map, ChunkData cd)
+{
+	GPUBank bank = cd->glBank;
+	GPUMem  mem  = bank->usedList + cd->glSlot;
+	int     start = mem->offset;
+	int     size  = mem->size;
+
+	TRACE(GPU_TRACE_FREE, cd, bank, start, size);
+
+	gpuRemoveItem(bank, cd);
+	gpuRetire(map, bank, start, size);
+}
+
+void renderFreeArray(Map map, ChunkData cd)
+{
+	MutexEnter(map->gpuLock);
+	gpuFreeArray(map, cd);
+	MutexLeave(map->gpuLock);
+}
+
+void renderFinishMesh(Map map, ChunkData cd)
+{
+	GPUBank bank;
+	int     total, offset;
+
+	MutexEnter(map->gpuLock);
+	total = cd->glSize;
+	bank = cd->glBank;
+
+	if (cd->glResBank)
+	{
+		/* location reserved by worker: only need to make it visible */
+		if (bank) gpuFreeArray(map, cd);
+		bank = cd->glResBank;
+		bank->memRegions -= cd->glResSize;
+		gpuMeshSize(map, cd->glResSize);
+		offset = gpuStoreItem(bank, cd, cd->glResOffset, cd->glResSize);
+		cd->glResBank = NULL;
+		if (offset < 0)
+			gpuFreeBlock(bank, cd->glResOffset, cd->glResSize);
+		else
+			TRACE(GPU_TRACE_ALLOC, cd, bank, offset, cd->glSize);
+	}
+	else if (bank)
+	{
+		GPUMem mem = bank->usedList + cd->glSlot;
+		if (total > mem->size)
+		{
+			/* not enough space: need to "free" previous mesh before */
+			gpuFreeArray(map, cd);
+			offset = gpuStoreArrays(map, cd, total);
+		}
+		else /* reuse mem segment */
+		{
+			offset = mem->offset, cd->glSize = total;
+			TRACE(GPU_TRACE_RESIZE, cd, bank, offset, total);
+		}
+	}
+	else offset = gpuStoreArrays(map, cd, total);
+	MutexLeave(map->gpuLock);
+
+	(void) offset;
+
+//	fprintf(stderr, "allocating %d bytes at %d for chunk %d, %d / %d\n", total, offset, cd->chunk->X, cd->chunk->Z, cd->Y);
+}
+
+/* give back what hasn't been used in <region> */
+static void gpuReleaseRegion(GPURegion region)
+{
+	GPUBank bank = region->bank;
+	if (bank)
+	{
+		int size = region->end - region->offset;
+		bank->memRegions -= size;
+		if (size > 0)
+			gpuFreeBlock(bank, region->offset, size);
+		memset(region, 0, sizeof *region);
+	}
+}
+
+/* must not be called while owner of <region> is using it */
+void renderReleaseRegion(Map map, GPURegion region)
+{
+	MutexEnter(map->gpuLock);
+	gpuReleaseRegion(region);
+	MutexLeave(map->gpuLock);
+}
+
+/* give back range reserved for <cd> (gpuLock held) */
+static void gpuCancelReserve(ChunkData cd)
+{
+	GPUBank bank = cd->glResBank;
+	if (bank)
+	{
+		bank->memRegions -= cd->glResSize;
+		gpuFreeBlock(bank, cd->glResOffset, cd->glResSize);
+		cd->glResBank = NULL;
+	}
+}
+
+/*
+ * reserve <size> bytes for the mesh of <cd>: can be called from any thread, <region> must be owned by
+ * calling thread though. glRes* fields of <cd> belong to Map_t.gpuLock: renderFinishMesh() can publish
+ * (and reset) them at any time. Return offset in bank, -1 if nothing was reserved (empty mesh).
+ */
+int renderReserveArrays(Map map, GPURegion region, ChunkData cd, int size)
+{
+	GPUBank bank;
+	int     off, carve;
+
+	if (size <= 0) return -1;
+
+	MutexEnter(map->gpuLock);
+	if (cd->glResBank)
+	{
+		/* mesh regenerated before previous one was published: range is still ours */
+		if (size <= cd->glResSize)
+		{
+			off = cd->glResOffset;
+			MutexLeave(map->gpuLock);
+			return off;
+		}
+		gpuCancelReserve(cd);
+	}
+
+	if (size > GPU_REGION/4 && region->end - region->offset < size)
+	{
+		/* big mesh: don't waste the current region */
+		carve = size;
+		off = gpuAlloc(map, &bank, &carve);
+		bank->memRegions += carve;
+		size = carve;
+	}
+	else
+	{
+		if (region->end - region->offset < size)
+		{
+			gpuReleaseRegion(region);
+			carve = GPU_REGION;
+			off = gpuAlloc(map, &bank, &carve);
+			bank->memRegions += carve;
+			region->bank   = bank;
+			region->offset = off;
+			region->end    = off + carve;
+		}
+		bank = region->bank;
+		off  = region->offset;
+		region->offset += size;
+
+		/* nothing left: bank does not count it anymore (memRegions), it could be released once empty */
+		if (region->offset == region->end)
+			memset(region, 0, sizeof *region);
+	}
+
+	cd->glResBank   = bank;
+	cd->glResOffset = off;
+	cd->glResSize   = size;
+	MutexLeave(map->gpuLock);
+
+	return off;
+}
+
+/* mesh reserved by renderReserveArrays() won't be published: GPU has never seen this range */
+void renderCancelReserve(Map map, ChunkData cd)
+{
+	MutexEnter(map->gpuLock);
+	gpuCancelReserve(cd);
+	MutexLeave(map->gpuLock);
+}
+
+static int gpuSortRetire(const void * item1, const void * item2)
+{
+	GPURetire r1 = (GPURetire) item1;
+	GPURetire r2 = (GPURetire) item2;
+
+	if (r1->bank != r2->bank)
+		return r1->bank->id - r2->bank->id;
+	return r1->offset - r2->offset;
+}
+
+/*
+ * must be called once per frame (after buffers have been swapped): ranges freed GPU_FRAME_LATENCY
+ * frames ago are given back to their bank, adjacent ones being merged before.
+ */
+void renderNextFrame(Map map)
+{
+	GPURetire list, eof;
+	int       count;
+
+	MutexEnter(map->gpuLock);
+	map->frame ++;
+
+	/* queue is ordered by frame */
+	for (list = map->retire, eof = list + map->retireCount; list < eof && map->frame - list->frame >= GPU_FRAME_LATENCY; list ++);
+
+	count = list - map->retire;
+	if (count > 0)
+	{
+		qsort(map->retire, count, sizeof *list, gpuSortRetire);
+
+		for (list = map->retire, eof = list + count; list < eof; )
+		{
+			GPUBank bank  = list->bank;
+			int     start = list->offset;
+			int     end   = start + list->size;
+
+			for (bank->retired --, list ++; list < eof && list->bank == bank && list->offset == end; end += list->size, bank->retired --, list ++);
+
+			bank->memRetired -= end - start;
+			gpuFreeBlock(bank, start, end - start);
+
+			#ifdef DEBUG
+			if (checkMem(bank))
+				fprintf(stderr, "error retiring range %d - %d\n", start, end);
+			#endif
+		}
+		map->retireCount -= count;
+		memmove(map->retire, map->retire + count, map->retireCount * sizeof *list);
+	}
+
+	/* release banks that have been empty for a while (but keep one) */
+	GPUBank bank, next;
+	for (bank = next = HEAD(map->gpuBanks); bank; bank = next)
+	{
+		NEXT(next);
+		if (bank->nbItem > 0 || bank->retired > 0 || bank->memRegions > 0)
+			bank->emptySince = 0;
+		else if (bank->emptySince == 0)
+			bank->emptySince = map->frame;
+		else if (map->frame - bank->emptySince >= GPU_BANK_GRACE && (bank->node.ln_Prev || bank->node.ln_Next))
+		{
+			if (map->evacuate == bank) map->evacuate = NULL;
+			ListRemove(&map->gpuBanks, &bank->node);
+			gpuFreeBank(bank);
+		}
+	}
+	MutexLeave(map->gpuLock);
+}
+
+/* find room for <size> bytes in <dest>, free ranges first */
+static int gpuAllocMove(GPUBank dest, int * size)
+{
+	int off = gpuAllocBelow(dest, size, dest->memAvail);
+	if (off < 0 && dest->memUsed + size[0] <= dest->memAvail)
+		off = dest->memUsed, dest->memUsed += size[0];
+	return off;
+}
+
+/* relocate mesh <mem> of <bank> at <off> in <dest>: return bytes moved, -1 if out of memory */
+static int gpuMoveItem(Map map, GPUBank bank, GPUMem mem, GPUBank dest, int off, int size)
+{
+	ChunkData cd    = mem->cd;
+	int       start = mem->offset;
+	int       old   = mem->size;
+
+	/* before touching <bank>: mesh must stay where it is if this fails (<mem> is stale afterward) */
+	if (! gpuReserveItem(dest))
+	{
+		gpuFreeBlock(dest, off, size);
+		return -1;
+	}
+
+	/* in the real engine: glCopyBufferSubData() from <bank> to <dest> */
+	gpuRemoveItem(bank, cd);
+	gpuRetire(map, bank, start, old);
+	gpuStoreItem(dest, cd, off, size);
+	TRACE(GPU_TRACE_MOVE, cd, dest, off, size);
+
+	#ifdef DEBUG
+	if (checkMem(bank) || checkMem(dest))
+		fprintf(stderr, "error compacting chunk %d\n", cd->chunk->color);
+	#endif
+
+	return old;
+}
+
+/* bank with lowest occupancy, if it is below 1/GPU_BANK_SPARSE and other banks can hold its meshes */
+static GPUBank gpuSparseBank(Map map)
+{
+	GPUBank bank, sparse = NULL;
+	int     room = 0;
+
+	for (bank = HEAD(map->gpuBanks); bank; NEXT(bank))
+	{
+		if (bank->nbItem == 0) continue;
+		room += bank->memAvail - bank->memLive - bank->memRetired - bank->memRegions;
+		if (bank->memLive * GPU_BANK_SPARSE < bank->memAvail &&
+		    (sparse == NULL || (int64_t) bank->memLive * sparse->memAvail < (int64_t) sparse->memLive * bank->memAvail))
+			sparse = bank;
+	}
+	if (sparse)
+	{
+		/* free space is probably fragmented: need some leeway */
+		room -= sparse->memAvail - sparse->memLive - sparse->memRetired - sparse->memRegions;
+		if (room >= sparse->memLive * 2)
+			return sparse;
+	}
+	return NULL;
+}
+
+/*
+ * incremental compaction: move meshes toward the beginning of banks (and toward the first banks),
+ * <budget> is the max amount of bytes that can be copied by this call (ie: per frame). Sparse banks
+ * are emptied first. Empty banks are released later by renderNextFrame(). Return the amount of
+ * bytes moved.
+ */
+int renderCompactBanks(Map map, int budget)
+{
+	GPUBank bank, dest, prev;
+	int     moved = 0;
+
+	MutexEnter(map->gpuLock);
+
+	/* first: move everything out of a sparse bank */
+	if (map->evacuate == NULL)
+		map->evacuate = gpuSparseBank(map);
+
+	for (bank = map->evacuate; bank && moved < budget; )
+	{
+		GPUMem mem;
+		int    off = -1, size;
+
+		if (bank->nbItem == 0)
+		{
+			/* done, will be released if nobody needs it */
+			map->evacuate = NULL;
+			break;
+		}
+		mem  = bank->usedList + bank->nbItem - 1;
+		size = mem->size;
+		for (dest = HEAD(map->gpuBanks); dest; NEXT(dest))
+			if (dest != bank && dest->nbItem > 0 && (off = gpuAllocMove(dest, &size)) >= 0) break;
+
+		if (dest == NULL || (size = gpuMoveItem(map, bank, mem, dest, off, size)) < 0)
+		{
+			/* other banks are full after all */
+			map->evacuate = NULL;
+			break;
+		}
+		moved += size;
+	}
+
+	/* start from last bank: they are the ones we want to get rid of */
+	for (bank = TAIL(map->gpuBanks); bank && moved < budget; bank = prev)
+	{
+		prev = bank; PREV(prev);
+
+		if (bank->nbItem == 0 || bank == map->evacuate)
+			continue;
+
+		while (moved < budget && bank->nbItem > 0)
+		{
+			GPUMem top, mem, eof;
+			int    off, size;
+
+			/* highest mesh of the bank */
+			for (top = mem = bank->usedList, eof = mem + bank->nbItem; mem < eof; mem ++)
+				if (mem->offset > top->offset) top = mem;
+
+			/* try previous banks first (not the empty ones: they are about to be released), then the lower part of this bank */
+			size = top->size;
+			for (dest = HEAD(map->gpuBanks), off = -1; dest != bank; NEXT(dest))
+				if (dest->nbItem > 0 && dest != map->evacuate && (off = gpuAllocMove(dest, &size)) >= 0) break;
+
+			if (off < 0 && (off = gpuAllocBelow(bank, &size, top->offset)) < 0)
+				/* can't do better for now */
+				break;
+
+			if ((size = gpuMoveItem(map, bank, top, dest, off, size)) < 0)
+				break;
+			moved += size;
+		}
+	}
+	map->bytesMoved += moved;
+	MutexLeave(map->gpuLock);
+	return moved;
+}
+
+/* memory statistics of all banks */
+void renderGetStats(Map map, GPUStats stats)
+{
+	GPUBank bank;
+
+	memset(stats, 0, sizeof *stats);
+	MutexEnter(map->gpuLock);
+	for (bank = HEAD(map->gpuBanks); bank; NEXT(bank))
+	{
+		stats->banks ++;
+		stats->memUsed += bank->memUsed;
+		stats->memFree += bank->memUsed - bank->memLive - bank->memRetired - bank->memRegions;
+		stats->memRetired += bank->memRetired;
+		stats->memRegions += bank->memRegions;
+		stats->memReserved += bank->memAvail;
+		stats->memLive += bank->memLive;
+	}
+	stats->bytesMoved = map->bytesMoved;
+	MutexLeave(map->gpuLock);
+	/* free bytes inside memUsed / memUsed */
+	stats->fragmentation = stats->memUsed > 0 ? (float) stats->memFree / stats->memUsed : 0;
+}
+
+void renderFreeBanks(Map map)
+{
+	GPUBank bank, next;
+
+	for (bank = next = HEAD(map->gpuBanks); bank; bank = next)
+	{
+		NEXT(next);
+		gpuFreeBank(bank);
+	}
+	ListNew(&map->gpuBanks);
+	free(map->retire);
+	map->retire = NULL;
+	map->retireCount = map->retireMax = 0;
+}
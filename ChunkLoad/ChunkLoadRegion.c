@@ -0,0 +1,477 @@
+/*
+ * ChunkLoadRegion.c : where chunkLoad() gets chunk data from: simulated (random mesh size and loading
+ *                     delay) or region files read through a memory mapping, and a generator for synthetic
+ *                     region files (so that the whole loading path can be benchmarked offline).
+ *
+ * region file r.<RX>.<RZ>.mca: 32x32 chunks (RX = X >> 9, same layout as Anvil files from Minecraft):
+ *   [0, 4096[    : location of each chunk (1024 big endian uint32_t): sector offset (24 bits), sector count (8 bits)
+ *   [4096, 8192[ : timestamp of each chunk (not used here)
+ *   sectors      : 4Kb each, chunk starts with its length (4 bytes big endian, including next byte), compression
+ *                  type (1 byte, only 2 == zlib is supported), then compressed data.
+ *
+ * uncompressed data is not NBT: number of sub-chunks (1 byte), then 16x16x16 block ids (YZX order) for each one.
+ * Mesh size of each sub-chunk is estimated from the number of faces between air and solid blocks.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <zlib.h>
+#include "UtilityLibLite.h"
+#include "ChunkLoad.h"
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define REGION_SECTOR     4096
+#define REGION_HEADER     (2 * REGION_SECTOR)
+#define REGION_ZLIB       2
+#define REGION_NAME       32       /* "/r.X.Z.mca" after folder name */
+#define SECTION_BYTES     (16*16*16)
+#define PAYLOAD_MAX       (1 + CHUNK_LIMIT * SECTION_BYTES)
+
+extern int loadSpeed;
+
+typedef struct RegionFile_t *      RegionFile;
+typedef struct RegionSource_t *    RegionSource;
+
+struct RegionFile_t                /* one memory mapped region file */
+{
+	DATA8     mem;                 /* whole file, read only (NULL == no file for this region) */
+	int       size;
+	int       RX, RZ;              /* region coord */
+	int       refs;                /* threads reading from mem */
+	int       lastUse;             /* LRU: mapping is reused if refs == 0 */
+};
+
+struct RegionSource_t
+{
+	struct ChunkSource_t source;   /* must be first */
+	TEXT      folder[256];
+	Mutex     lock;                /* files[] */
+	int       tick;
+	int       count;
+	struct RegionFile_t files[REGION_MAX];
+	DATA8     buffer[MAX_THREADS]; /* uncompressed chunk, one per worker thread */
+};
+
+uint32_t sourceSeed;
+
+/* integer hash: same value for same seed and coord, from any thread */
+static uint32_t regionHash(uint32_t seed, int x, int y, int z)
+{
+	uint32_t h = seed ^ ((uint32_t) x * 0x27d4eb2du) ^ ((uint32_t) y * 0x165667b1u) ^ ((uint32_t) z * 0x9e3779b1u);
+	h ^= h >> 15; h *= 0x85ebca6b;
+	h ^= h >> 13; h *= 0xc2b2ae35;
+	return h ^ (h >> 16);
+}
+
+/*
+ * simulated source: random mesh size and loading delay (up to loadSpeed ms), drawn from sourceSeed and chunk
+ * coord: a chunk is the same each time it is loaded, whatever thread does it (rand() is neither thread safe
+ * nor reproducible once threads compete for it).
+ */
+static Bool sourceSimLoad(ChunkSource source, Chunk chunk, int X, int Z, int thread)
+{
+	uint32_t rnd = regionHash(sourceSeed, X >> 4, 0, Z >> 4);
+
+	if (loadSpeed > 0)
+		ThreadPause(rnd % loadSpeed);
+
+	ChunkData cd = calloc(sizeof *cd, 1);
+	chunk->layer[0] = cd;
+	chunk->maxy = 1;
+	cd->chunk = chunk;
+	/* should be filled in chunkUpdate(), but that function cannot be included in this test setup */
+	cd->glSize = (4 + (rnd >> 16) % 8) * 4096;
+	cd->Y = 0;
+	__atomic_add_fetch(&source->chunks, 1, __ATOMIC_RELAXED);
+	return True;
+}
+
+static void sourceSimClose(ChunkSource source)
+{
+	/* static object */
+}
+
+struct ChunkSource_t sourceSimulated = {.load = sourceSimLoad, .close = sourceSimClose};
+ChunkSource chunkSource = &sourceSimulated;
+
+/*
+ * region files
+ */
+static DATA8 regionMap(STRPTR path, int * size)
+{
+	DATA8 mem = NULL;
+#ifdef WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+	size[0] = GetFileSize(file, NULL);
+	if (size[0] >= REGION_HEADER)
+	{
+		HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping)
+		{
+			/* view keeps a reference on both handles */
+			mem = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(file);
+#else
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) == 0 && st.st_size >= REGION_HEADER)
+	{
+		size[0] = st.st_size;
+		mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mem == MAP_FAILED) mem = NULL;
+		/* chunks are scattered in the file */
+		else madvise(mem, st.st_size, MADV_RANDOM);
+	}
+	close(fd);
+#endif
+	return mem;
+}
+
+static void regionUnmap(RegionFile file)
+{
+	if (file->mem)
+	{
+		#ifdef WIN32
+		UnmapViewOfFile(file->mem);
+		#else
+		munmap(file->mem, file->size);
+		#endif
+		file->mem = NULL;
+	}
+}
+
+/* get region file at <RX>, <RZ> mapped in memory: must be released with regionRelease() */
+static RegionFile regionGet(RegionSource source, int RX, int RZ)
+{
+	RegionFile file, lru;
+	int i;
+
+	MutexEnter(source->lock);
+	for (i = 0, file = source->files, lru = NULL; i < source->count; i ++, file ++)
+	{
+		if (file->RX == RX && file->RZ == RZ)
+			goto found;
+		if (file->refs == 0 && (lru == NULL || lru->lastUse > file->lastUse))
+			lru = file;
+	}
+	if (source->count < REGION_MAX)
+		file = source->files + source->count ++;
+	else if ((file = lru) == NULL)
+	{
+		/* all mappings are being read (more threads than REGION_MAX): shouldn't happen */
+		MutexLeave(source->lock);
+		return NULL;
+	}
+	else regionUnmap(file);
+
+	/* missing file is cached too: region not generated */
+	TEXT path[sizeof source->folder + REGION_NAME];
+	snprintf(path, sizeof path, "%s/r.%d.%d.mca", source->folder, RX, RZ);
+	file->RX  = RX;
+	file->RZ  = RZ;
+	file->mem = regionMap(path, &file->size);
+
+	found:
+	file->refs ++;
+	file->lastUse = source->tick ++;
+	MutexLeave(source->lock);
+	return file;
+}
+
+static void regionRelease(RegionSource source, RegionFile file)
+{
+	MutexEnter(source->lock);
+	file->refs --;
+	MutexLeave(source->lock);
+}
+
+static inline uint32_t regionBE32(DATA8 p)
+{
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* faces between air and solid blocks in sub-chunk <y> (faces on the sides of chunk need neighbors: ignored) */
+static int regionCountFaces(DATA8 blocks, int y, int count)
+{
+	DATA8 sub = blocks + y * SECTION_BYTES;
+	DATA8 above = y + 1 < count ? sub + SECTION_BYTES : NULL;
+	int   faces, i;
+
+	for (i = faces = 0; i < SECTION_BYTES; i ++)
+	{
+		Bool solid = sub[i] > 0;
+		if ((i & 15)  < 15 && solid != (sub[i+1]  > 0)) faces ++;
+		if ((i & 255) < 240 && solid != (sub[i+16] > 0)) faces ++;
+		if (i < SECTION_BYTES - 256)
+		{
+			if (solid != (sub[i+256] > 0)) faces ++;
+		}
+		/* top of chunk is air */
+		else if (above ? solid != (above[i & 255] > 0) : solid)
+			faces ++;
+	}
+	return faces;
+}
+
+static Bool regionLoad(ChunkSource source, Chunk chunk, int X, int Z, int thread)
+{
+	RegionSource region = (RegionSource) source;
+	RegionFile   file;
+	DATA8        mem, blocks;
+	uLongf       size;
+	uint32_t     loc, length;
+	int          CX = X >> 4, CZ = Z >> 4;
+	int          offset, count, i;
+
+	file = regionGet(region, CX >> 5, CZ >> 5);
+	if (file == NULL || file->mem == NULL)
+		goto empty;
+
+	loc = regionBE32(file->mem + (((CZ & 31) << 5) | (CX & 31)) * 4);
+	if (loc == 0)
+		goto empty;
+	if ((loc >> 8) < REGION_HEADER / REGION_SECTOR || (loc >> 8) >= file->size / REGION_SECTOR)
+		goto error;
+
+	/* decompressed straight from the mapping: only one copy, in a buffer owned by this thread */
+	offset = (loc >> 8) * REGION_SECTOR;
+	mem    = file->mem + offset;
+	length = regionBE32(mem);
+	if (length < 1 || mem[4] != REGION_ZLIB || length > file->size - offset - 4 || length + 4 > (loc & 0xff) * REGION_SECTOR)
+		goto error;
+
+	blocks = region->buffer[thread];
+	if (blocks == NULL)
+		blocks = region->buffer[thread] = malloc(PAYLOAD_MAX);
+	size = PAYLOAD_MAX;
+	if (blocks == NULL || uncompress(blocks, &size, mem + 5, length - 1) != Z_OK)
+		goto error;
+	count = blocks[0];
+	if (count > CHUNK_LIMIT || size != 1 + count * SECTION_BYTES)
+		goto error;
+	regionRelease(region, file);
+
+	__atomic_add_fetch(&source->bytesRead, length - 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&source->bytesInflated, size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&source->chunks, 1, __ATOMIC_RELAXED);
+
+	/* sub-chunks that have something to show */
+	for (i = 0, blocks ++; i < count; i ++)
+	{
+		int faces = regionCountFaces(blocks, i, count);
+		if (faces == 0) continue;
+		ChunkData cd = calloc(sizeof *cd, 1);
+		chunk->layer[chunk->maxy ++] = cd;
+		cd->chunk  = chunk;
+		cd->glSize = faces * REGION_FACE;
+		cd->Y      = i * 16;
+	}
+	return True;
+
+	error:
+	fprintf(stderr, "%s: chunk %d, %d is corrupted\n", region->folder, CX, CZ);
+	__atomic_add_fetch(&source->errors, 1, __ATOMIC_RELAXED);
+	empty:
+	if (file) regionRelease(region, file);
+	__atomic_add_fetch(&source->empty, 1, __ATOMIC_RELAXED);
+	return False;
+}
+
+static void regionClose(ChunkSource source)
+{
+	RegionSource region = (RegionSource) source;
+	int i;
+	for (i = 0; i < region->count; regionUnmap(region->files + i), i ++);
+	for (i = 0; i < MAX_THREADS; free(region->buffer[i]), i ++);
+	MutexDestroy(region->lock);
+	free(region);
+}
+
+/* read region files from <folder>: source must not be changed while worker threads are running */
+ChunkSource sourceOpenRegions(STRPTR folder)
+{
+	RegionSource region;
+
+	/* file names must fit in region->folder + REGION_NAME */
+	if (strlen(folder) >= sizeof region->folder || ! IsDir(folder))
+		return NULL;
+
+	region = calloc(sizeof *region, 1);
+
+	if (region)
+	{
+		region->source.load  = regionLoad;
+		region->source.close = regionClose;
+		region->lock = MutexCreate();
+		CopyString(region->folder, folder, sizeof region->folder);
+		return &region->source;
+	}
+	return NULL;
+}
+
+/* back to simulated source */
+void sourceClose(ChunkSource source)
+{
+	if (chunkSource == source)
+		chunkSource = &sourceSimulated;
+	source->close(source);
+}
+
+/*
+ * synthetic region files: rolling terrain with a few caves, deterministic for a given seed
+ */
+/* value noise in [0, 1], <scale> in blocks */
+static float regionNoise(uint32_t seed, int x, int z, int scale)
+{
+	int   gx = x >= 0 ? x / scale : (x + 1) / scale - 1;
+	int   gz = z >= 0 ? z / scale : (z + 1) / scale - 1;
+	float fx = (x - gx * scale) / (float) scale;
+	float fz = (z - gz * scale) / (float) scale;
+
+	/* smoothstep */
+	fx = fx * fx * (3 - 2 * fx);
+	fz = fz * fz * (3 - 2 * fz);
+
+	float v00 = regionHash(seed, gx,   0, gz)   / 4294967295.f;
+	float v10 = regionHash(seed, gx+1, 0, gz)   / 4294967295.f;
+	float v01 = regionHash(seed, gx,   0, gz+1) / 4294967295.f;
+	float v11 = regionHash(seed, gx+1, 0, gz+1) / 4294967295.f;
+
+	return (v00 + (v10 - v00) * fx) * (1 - fz) + (v01 + (v11 - v01) * fx) * fz;
+}
+
+/* fill <blocks> with chunk <CX>, <CZ> (uncompressed payload), returns its size */
+static int regionGenChunk(DATA8 blocks, uint32_t seed, int CX, int CZ)
+{
+	uint8_t height[256];
+	int     x, y, z, top, count;
+
+	for (z = top = 0; z < 16; z ++)
+	{
+		for (x = 0; x < 16; x ++)
+		{
+			int X = CX * 16 + x, Z = CZ * 16 + z;
+			int h = 40 + regionNoise(seed, X, Z, 64) * 60 + regionNoise(seed + 1, X, Z, 16) * 12;
+			height[(z << 4) | x] = h;
+			if (top < h) top = h;
+		}
+	}
+	count = top / 16 + 1;
+	blocks[0] = count;
+	memset(blocks + 1, 0, count * SECTION_BYTES);
+
+	for (y = 0, blocks ++; y <= top; y ++)
+	{
+		for (z = 0; z < 16; z ++)
+		{
+			for (x = 0; x < 16; x ++)
+			{
+				int h = height[(z << 4) | x];
+				if (y > h) continue;
+				/* stone, dirt, grass: caves are mostly empty 2x2x2 blocks */
+				if (y > 0 && y < h - 4 && regionHash(seed + 2, (CX * 16 + x) >> 1, y >> 1, (CZ * 16 + z) >> 1) % 100 < 4)
+					continue;
+				blocks[(y << 8) | (z << 4) | x] = y == h ? 2 : y > h - 4 ? 3 : 1;
+			}
+		}
+	}
+	return 1 + count * SECTION_BYTES;
+}
+
+/* write region files in <folder> for chunks up to <radius> chunks away from <X>, <Z> (map coord), returns bytes written */
+int sourceGenRegions(STRPTR folder, int X, int Z, int radius, int seed)
+{
+	DATA8 blocks = malloc(PAYLOAD_MAX);
+	int   bound  = compressBound(PAYLOAD_MAX);
+	DATA8 file   = NULL;
+	int   total  = 0;
+	int   CX0 = (X >> 4) - radius, CX1 = (X >> 4) + radius;
+	int   CZ0 = (Z >> 4) - radius, CZ1 = (Z >> 4) + radius;
+	int   RX, RZ;
+
+	/* CreatePath() returns NULL on success: check what it did instead */
+	if (blocks) CreatePath(folder, False);
+	if (blocks == NULL || ! IsDir(folder))
+		goto error;
+
+	for (RZ = CZ0 >> 5; RZ <= CZ1 >> 5; RZ ++)
+	{
+		for (RX = CX0 >> 5; RX <= CX1 >> 5; RX ++)
+		{
+			int size = REGION_HEADER, max = REGION_HEADER + 64 * REGION_SECTOR;
+			int i;
+
+			file = calloc(max, 1);
+			if (file == NULL) goto error;
+
+			for (i = 0; i < 1024; i ++)
+			{
+				int CX = RX * 32 + (i & 31);
+				int CZ = RZ * 32 + (i >> 5);
+				if (CX < CX0 || CX > CX1 || CZ < CZ0 || CZ > CZ1) continue;
+
+				if (size + 5 + bound > max)
+				{
+					/* <file> is still freed by error path if this fails */
+					int   old = max;
+					DATA8 grow;
+					max  = (size + 5 + bound) * 2;
+					grow = realloc(file, max);
+					if (grow == NULL) goto error;
+					file = grow;
+					memset(file + old, 0, max - old);
+				}
+				uLongf packed = bound;
+				DATA8  chunk  = file + size;
+				if (compress2(chunk + 5, &packed, blocks, regionGenChunk(blocks, seed, CX, CZ), 6) != Z_OK)
+					goto error;
+
+				int length  = packed + 1;
+				int sectors = (length + 4 + REGION_SECTOR - 1) / REGION_SECTOR;
+				int loc     = ((size / REGION_SECTOR) << 8) | sectors;
+				chunk[0] = length >> 24; chunk[1] = length >> 16;
+				chunk[2] = length >> 8;  chunk[3] = length;
+				chunk[4] = REGION_ZLIB;
+				file[i*4]   = loc >> 24; file[i*4+1] = loc >> 16;
+				file[i*4+2] = loc >> 8;  file[i*4+3] = loc;
+				size += sectors * REGION_SECTOR;
+			}
+
+			TEXT   path[256];
+			FILE * out;
+			if (snprintf(path, sizeof path, "%s/r.%d.%d.mca", folder, RX, RZ) >= (int) sizeof path) goto error;
+			out = fopen(path, "wb");
+			if (out == NULL) goto error;
+			i = fwrite(file, size, 1, out);
+			fclose(out);
+			if (i != 1) goto error;
+			total += size;
+			free(file);
+			file = NULL;
+		}
+	}
+	free(blocks);
+	return total;
+
+	error:
+	free(blocks);
+	free(file);
+	return -1;
+}
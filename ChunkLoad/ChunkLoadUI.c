@@ -18,9 +18,16 @@ static struct
 {
 	int  width, height;
 	int  mapSize;
+	int  allocMode;
+	int  compactBudget;
+	int  tracing;
 	int  posX, posZ;
+	int  threads, loaders;
+	int  viewPrio, viewFOV;
+	int  cacheSize;
+	int  prefetchRings;
 	APTR nvgCtx, mapLabel;
-	APTR speedVal;
+	APTR speedVal, threadLabel;
 	Map  map;
 }	prefs;
 
@@ -30,10 +37,11 @@ enum
 	CMD_MOVE_RIGHT,
 	CMD_MOVE_TOP,
 	CMD_MOVE_BOTTOM,
+	CMD_TRACE,
+	CMD_LATENCY,
 };
 
 int loadSpeed = 50;
-extern struct Thread_t threads[];
 extern struct Staging_t staging;
 
 static uint8_t memColors[] = {
@@ -107,7 +115,7 @@ static int uiPaintChunks(SIT_Widget w, APTR cd, APTR ud)
 
 	int area = prefs.map->mapArea;
 
-	TEXT  coord[16];
+	TEXT  coord[64];
 	float x0, y0;
 	float x1, y1;
 	float xc, yc;
@@ -124,7 +132,7 @@ static int uiPaintChunks(SIT_Widget w, APTR cd, APTR ud)
 	for (x0 = paint->x + MARGINTL + 0.5f, x1 = paint->x + paint->w - MARGINBR - 0.5f, chunk = prefs.map->chunks,
 	     y0 = paint->y + MARGINTL + 0.5f, y1 = paint->y + paint->h - MARGINBR - 0.5f, i = 0; i < area*area; i ++, chunk ++)
 	{
-		if ((chunk->cflags & CFLAG_GOTDATA) == 0)
+		if ((chunk->state->cflags & CFLAG_GOTDATA) == 0)
 			continue;
 
 		int cx = i % area;
@@ -134,7 +142,7 @@ static int uiPaintChunks(SIT_Widget w, APTR cd, APTR ud)
 		float width = x0 + ((int)paint->w - (MARGINBR+MARGINTL)) * (cx+1) / area - xc;
 		float height = y0 + ((int)paint->h - (MARGINBR+MARGINTL)) * (cy+1) / area - yc;
 
-		if (chunk->cflags & CFLAG_HASMESH)
+		if (chunk->state->cflags & CFLAG_HASMESH)
 		{
 			uint8_t color[4];
 			memcpy(color, memColors + (chunk->color % 19) * 4, 4);
@@ -239,8 +247,32 @@ static int uiPaintChunks(SIT_Widget w, APTR cd, APTR ud)
 	}
 	nvgStroke(vg);
 
+	/* view direction, from center of player chunk */
+	float cell = ((int)paint->w - (MARGINBR+MARGINTL)) / (float) area;
+	xc = x0 + cell * (prefs.map->mapX + 0.5f);
+	yc = y0 + cell * (prefs.map->mapZ + 0.5f);
+	nvgBeginPath(vg);
+	nvgStrokeColorRGBA8(vg, "\xff\x20\x20\xff");
+	nvgMoveTo(vg, xc, yc);
+	nvgLineTo(vg, xc + prefs.map->viewX * cell * 2, yc + prefs.map->viewZ * cell * 2);
+	nvgStroke(vg);
+
 	nvgResetScissor(vg);
 
+	/* time until all chunks in view got a mesh, chunks loaded again from cache */
+	struct ChunkCache_t * cache = &prefs.map->cache;
+	TEXT status[160];
+	if (prefs.map->viewStart > 0)
+		i = snprintf(status, sizeof status, "view: ...");
+	else
+		i = snprintf(status, sizeof status, "view: %.0f ms", prefs.map->viewTime);
+	if (i < (int) sizeof status)
+		i += snprintf(status + i, sizeof status - i, ", cache: %d hits, %d misses, %d Kb", cache->hits, cache->misses, cache->bytes >> 10);
+	if (prefs.map->prefetchRings > 0 && i < (int) sizeof status)
+		snprintf(status + i, sizeof status - i, ", prefetch: %d/%d used", cache->prefetchHits, cache->prefetched);
+	nvgFillColorRGBA8(vg, "\0\0\0\xff");
+	nvgText(vg, x0, paint->y + paint->h - MARGINBR + 3, status, NULL);
+
 	return 1;
 }
 
@@ -268,18 +300,72 @@ static int uiPaintMemory(SIT_Widget w, APTR cd, APTR ud)
 
 	nvgFontSize(vg, fontSize);
 	nvgFillColorRGBA8(vg, "\x20\xff\x20\xff");
-	nvgText(vg, x0, y0, stagmem, EOT(stagmem)-1);
+	/* blocks per cell (STAGING_BLOCKS, STAGING_ATOMIC) */
+	int perCell = staging.usage.count / (ROW_STAGING * COLUMN);
+	if (staging.mode == STAGING_RING)
+	{
+		TEXT title[64];
+		int  len = sprintf(title, "Staging memory (ring buffer, %d Kb per block):", staging.size / (ROW_STAGING * COLUMN * 1024));
+		nvgText(vg, x0, y0, title, title + len);
+	}
+	else if (perCell > 1)
+	{
+		TEXT title[64];
+		int  len = sprintf(title, "Staging memory (%d x 4kb blocks per cell):", perCell);
+		nvgText(vg, x0, y0, title, title + len);
+	}
+	else nvgText(vg, x0, y0, stagmem, EOT(stagmem)-1);
+
+	/* what mapGenFlush() did last frame */
+	StagingStats upload = &staging.stats;
+	TEXT uploadStats[128];
+	int  i = sprintf(uploadStats, "upload: %d meshes, %d Kb, %.2f ms, pending: %d, peak: %d Kb, %.2f ms",
+		upload->meshes, upload->bytes >> 10, upload->time, upload->pending, upload->maxBytes >> 10, upload->maxTime);
+	nvgText(vg, paint->x + paint->w - MEM_MARGIN - nvgTextBounds(vg, 0, 0, uploadStats, uploadStats+i, NULL), y0, uploadStats, uploadStats+i);
 
 	/* staging area */
 	nvgStrokeColorRGBA8(vg, "\x20\xCC\x20\xff");
 	y0 += fontSize;
-	int i;
-	for (i = 0; i < MAX_BUFFER/4096; i ++)
+	if (staging.mode == STAGING_RING)
+	{
+		/* spans from tail to head */
+		int cell = staging.size / (ROW_STAGING * COLUMN);
+		int pos, left;
+		MutexEnter(staging.alloc);
+		for (pos = staging.tail, left = staging.used; left > 0; )
+		{
+			DATA32 mem  = staging.mem + (pos >> 2);
+			int    size = mem[1] & RING_SIZE;
+			if ((mem[1] & RING_PAD) == 0)
+			{
+				Chunk chunk = prefs.map->chunks + STAGING_CHUNK(mem[0]);
+				int   cur, end;
+				nvgFillColorRGBA8(vg, memColors + (chunk->color % 19) * 4);
+				nvgBeginPath(vg);
+				for (cur = pos / cell, end = (pos + size - 1) / cell; cur <= end; cur ++)
+				{
+					yc = y0 + (cur >> 5) * rowSize;
+					xc = COL_PIXEL(cur & COL_MASK);
+					nvgRect(vg, xc, yc, COL_PIXEL((cur & COL_MASK) + 1) - xc, rowSize);
+				}
+				nvgFill(vg);
+			}
+			pos += size;
+			left -= size;
+			if (pos == staging.size) pos = 0;
+		}
+		MutexLeave(staging.alloc);
+	}
+	else for (i = 0; i < ROW_STAGING * COLUMN; i ++)
 	{
-		if (staging.usage[i>>5] & (1 << (i & 31)))
+		/* show first block used in this cell */
+		int block = bitPoolNextUsed(&staging.usage, i * perCell);
+		if (0 <= block && block < (i + 1) * perCell)
 		{
-			DATA32 mem = staging.mem + i * 1024;
-			Chunk chunk = prefs.map->chunks + (mem[0] & 0xffff);
+			DATA32 mem = staging.mem + block * 1024;
+			/* STAGING_ATOMIC: block might be in a thread cache, not filled yet */
+			if (STAGING_CHUNK(mem[0]) >= prefs.map->mapArea * prefs.map->mapArea) continue;
+			Chunk chunk = prefs.map->chunks + STAGING_CHUNK(mem[0]);
 
 			nvgFillColorRGBA8(vg, memColors + (chunk->color % 19) * 4);
 			nvgBeginPath(vg);
@@ -309,19 +395,25 @@ static int uiPaintMemory(SIT_Widget w, APTR cd, APTR ud)
 	nvgFillColorRGBA8(vg, "\x20\xff\x20\xff");
 	nvgText(vg, x0, y0, gpumem, EOT(gpumem)-1);
 
-	/* bank (GPU mem) */
+	/* bank (GPU mem): threads can free ranges while we are reading them */
+	struct GPUStats_t stats;
+	renderGetStats(prefs.map, &stats);
+	MutexEnter(prefs.map->gpuLock);
 	GPUBank bank = HEAD(prefs.map->gpuBanks);
 
 	if (bank)
 	{
-		TEXT   coord[64];
+		TEXT   coord[128];
 		GPUMem mem = bank->usedList;
 		GPUMem eof = mem + bank->nbItem;
 		int    sz, off, length;
+		int    page = bank->memAvail / (COLUMN * ROW_GPUMEM); /* bytes per cell */
 		float  xt, yt;
 		DATA8  color;
 
-		i = sprintf(coord, "used: %d, free: %d, max: %d", bank->nbItem, bank->freeItem, bank->maxItems);
+		i = sprintf(coord, "used: %d, free: %d, retired: %d, max: %d, banks: %d, frag: %.1f%%, live: %.1f / %.1f Mb",
+			bank->nbItem, bank->freeItem, bank->retired, bank->maxItems, stats.banks, stats.fragmentation * 100,
+			stats.memLive / 1048576., stats.memReserved / 1048576.);
 		nvgText(vg, paint->x + paint->w - MEM_MARGIN - nvgTextBounds(vg, 0, 0, coord, coord+i, NULL), y0, coord, coord+i);
 		y0 += fontSize;
 
@@ -350,8 +442,8 @@ static int uiPaintMemory(SIT_Widget w, APTR cd, APTR ud)
 
 		for (; mem < eof; mem ++)
 		{
-			sz  = mem->size / 4096;
-			off = mem->offset / 4096;
+			sz  = mem->size / page;
+			off = mem->offset / page;
 			color = memColors + (mem->id % 19) * 4;
 			sprintf(coord, "%d", mem->id);
 
@@ -359,18 +451,42 @@ static int uiPaintMemory(SIT_Widget w, APTR cd, APTR ud)
 		}
 
 		/* overlay free blocks */
-		mem = bank->usedList + bank->maxItems - 1;
-		eof = mem - bank->freeItem;
-		for (i = 0; mem > eof; mem --, i ++)
+		color = memColors + 19 * 4;
+		if (bank->allocMode == ALLOC_SIZECLASS)
+		{
+			GPUFree range = bank->freeRanges + 1;
+			for (i = 1; i < bank->maxRanges; range ++, i ++)
+			{
+				if (range->size == 0) continue;
+				sz = range->size / page;
+				off = range->offset / page;
+
+				sprintf(coord, "free: %d:%d", sz, i);
+				renderChunk();
+			}
+		}
+		else for (mem = bank->usedList + bank->maxItems - 1, eof = mem - bank->freeItem, i = 0; mem > eof; mem --, i ++)
 		{
-			sz = mem->size / 4096;
-			off = mem->offset / 4096;
-			color = memColors + 19 * 4;
+			sz = mem->size / page;
+			off = mem->offset / page;
 
 			sprintf(coord, "free: %d:%d", sz, i);
 			renderChunk();
 		}
+
+		/* ranges freed, but not reusable yet */
+		GPURetire retire;
+		for (retire = prefs.map->retire, i = prefs.map->retireCount; i > 0; retire ++, i --)
+		{
+			if (retire->bank != bank) continue;
+			sz = retire->size / page;
+			off = retire->offset / page;
+
+			sprintf(coord, "retired: %d", prefs.map->frame - retire->frame);
+			renderChunk();
+		}
 	}
+	MutexLeave(prefs.map->gpuLock);
 
 	nvgBeginPath(vg);
 	for (i = 0; i <= ROW_GPUMEM; i ++)
@@ -398,20 +514,38 @@ static int uiThreadStatus(SIT_Widget w, APTR cd, APTR ud)
 	nvgFillColorRGBA8(vg, "\x20\xCC\x20\xff");
 	float x0 = paint->x + MEM_MARGIN;
 	float y0 = paint->y + MEM_MARGIN;
-	int   i;
-	for (i = 0; i < NUM_THREADS; i ++)
+	int   lines = (paint->h - MEM_MARGIN) / (paint->fontSize + 3);
+	int   i, columns;
+
+	/* utilization is averaged over half a second */
+	static float  load[MAX_THREADS];
+	static double lastSample;
+	double now = FrameGetTime();
+	if (now - lastSample >= 500)
+		mapGenThreadLoad(load, MAX_THREADS), lastSample = now;
+
+	if (lines < 1) lines = 1;
+	columns = (threadCount + lines - 1) / lines;
+	for (i = 0; i < threadCount; i ++)
 	{
 		static STRPTR status[] = {
 			"Waiting for chunk",
 			"Waiting for staging",
-			"Processing"
+			"Processing",
+			"Waiting for meshers"
 		};
+		static STRPTR roles[] = {"", " (load)", " (mesh)"};
 		TEXT msg[128];
-		sprintf(msg, "Thread %d: %s", i + 1, status[threads[i].state]);
+		int  state = threads[i].state;
+		if (columns <= 2)
+			sprintf(msg, "Thread %d%s: %s (%d%%, %d chunks, blocked %.1fs)", i + 1, roles[threads[i].stage], status[state], (int) (load[i] * 100),
+				threads[i].chunks, threads[i].waited / 1000);
+		else /* lots of threads: waiting for Chunk, Staging, Meshers or Processing */
+			sprintf(msg, "%d: %c %d%%", i + 1, "CSPM"[state], (int) (load[i] * 100));
 		nvgText(vg, x0, y0, msg, NULL);
 		y0 += paint->fontSize + 3;
 
-		if (i == 1) x0 += paint->w * 0.5f, y0 = paint->y + MEM_MARGIN;
+		if ((i + 1) % lines == 0) x0 += paint->w / (float) columns, y0 = paint->y + MEM_MARGIN;
 	}
 
 	return 1;
@@ -432,6 +566,19 @@ static int uiSetRenderDist(SIT_Widget w, APTR cd, APTR ud)
 	return 1;
 }
 
+static int uiSetThreadCount(SIT_Widget w, APTR cd, APTR ud)
+{
+	int count = threadCount + (int) ud - 1;
+
+	if (1 <= count && count <= MAX_THREADS)
+	{
+		prefs.threads = mapSetThreadCount(prefs.map, count);
+		SIT_SetValues(prefs.threadLabel, SIT_Title | XfMt, "%d", prefs.threads, NULL);
+	}
+
+	return 1;
+}
+
 static int uiShowSpeed(SIT_Widget w, APTR cd, APTR ud)
 {
 	loadSpeed = (int) cd;
@@ -455,12 +602,16 @@ static void uiCreate(SIT_Widget app)
 		"<label name=msg2 title='Threads: waiting:' left=WIDGET,chunks,1em>"
 		"<slider name=speed left=WIDGET,msg2,0.5em top=MIDDLE,inc width=10em thumbThick=0.8em sliderPos=", loadSpeed, ">"
 		"<label name=speedval left=WIDGET,speed,0.5em top=MIDDLE,speed title=1x>"
+		"<label name=msg4 title='Workers:' left=WIDGET,speedval,1em>"
+		"<button name=tinc title=+ left=WIDGET,msg4,0.5em top=MIDDLE,speed width=2em>"
+		"<button name=tdec title=- left=WIDGET,tinc,0.5em top=MIDDLE,speed width=2em>"
+		"<label name=tcount left=WIDGET,tdec,0.5em>"
 		"<canvas name=threads.plain top=OPPOSITE,chunks left=OPPOSITE,msg2 right=FORM height=3em/>"
 
 		"<label name=msg3 title='Memory layout:' top=WIDGET,threads,1em left=OPPOSITE,msg2>"
 		"<canvas name=gpumem.plain top=WIDGET,msg3,0.5em left=OPPOSITE,msg2 right=FORM bottom=FORM/>"
 	);
-	SIT_SetAttributes(app, "<msg1 top=MIDDLE,inc><msg2 top=MIDDLE,speed>");
+	SIT_SetAttributes(app, "<msg1 top=MIDDLE,inc><msg2 top=MIDDLE,speed><msg4 top=MIDDLE,speed><tcount top=MIDDLE,speed>");
 
 	SIT_AddCallback(SIT_GetById(app, "chunks"),  SITE_OnPaint, uiPaintChunks, NULL);
 	SIT_AddCallback(SIT_GetById(app, "gpumem"),  SITE_OnPaint, uiPaintMemory, NULL);
@@ -469,10 +620,16 @@ static void uiCreate(SIT_Widget app)
 	SIT_AddCallback(SIT_GetById(app, "inc"), SITE_OnActivate, uiSetRenderDist, (APTR) 2);
 	SIT_AddCallback(SIT_GetById(app, "dec"), SITE_OnActivate, uiSetRenderDist, NULL);
 
+	SIT_AddCallback(SIT_GetById(app, "tinc"), SITE_OnActivate, uiSetThreadCount, (APTR) 2);
+	SIT_AddCallback(SIT_GetById(app, "tdec"), SITE_OnActivate, uiSetThreadCount, NULL);
+
 	SIT_AddCallback(SIT_GetById(app, "speed"), SITE_OnChange, uiShowSpeed, NULL);
 
 	prefs.mapLabel = SIT_GetById(app, "size");
 	prefs.speedVal = SIT_GetById(app, "speedval");
+	prefs.threadLabel = SIT_GetById(app, "tcount");
+	/* map (and threads) not created yet */
+	SIT_SetValues(prefs.threadLabel, SIT_Title | XfMt, "%d", prefs.threads > 0 ? prefs.threads : mapGetCoreCount(), NULL);
 	int size = (prefs.mapSize<<1) + 1;
 	SIT_SetValues(prefs.mapLabel, SIT_Title | XfMt, "%dx%d", size, size, NULL);
 
@@ -482,6 +639,7 @@ static void uiCreate(SIT_Widget app)
 static int uiProcessCmd(SIT_Widget w, APTR cd, APTR ud)
 {
 	vec4 oldpos = {prefs.posX, 0, prefs.posZ};
+	vec4 dir;
 	switch ((int) ud) {
 	case CMD_MOVE_LEFT:
 		prefs.posX -= 16;
@@ -494,7 +652,25 @@ static int uiProcessCmd(SIT_Widget w, APTR cd, APTR ud)
 		break;
 	case CMD_MOVE_BOTTOM:
 		prefs.posZ += 16;
+		break;
+	case CMD_TRACE:
+		/* record GPU allocations, can be replayed with ChunkBench */
+		if (prefs.tracing)
+			fprintf(stderr, "trace stopped: %d records\n", renderTraceStop()), prefs.tracing = 0;
+		else if (renderTraceStart("ChunkLoad.trace"))
+			fprintf(stderr, "recording GPU allocations in ChunkLoad.trace\n"), prefs.tracing = 1;
+		return 1;
+	case CMD_LATENCY:
+		/* per stage and per worker thread, since last dump */
+		if (mapGenLatencyDump("ChunkLoad.latency.csv", False))
+			fprintf(stderr, "chunk latency written in ChunkLoad.latency.csv\n");
+		mapGenLatencyReset();
+		return 1;
 	}
+	/* no camera here: player is looking where it is going */
+	dir[VX] = prefs.posX - oldpos[VX];
+	dir[VZ] = prefs.posZ - oldpos[VZ];
+	mapSetViewDir(prefs.map, dir, prefs.viewFOV, prefs.viewPrio);
 	mapMoveCenter(prefs.map, oldpos, (vec4) {prefs.posX, 0, prefs.posZ});
 	SIT_ForceRefresh();
 	return 1;
@@ -508,16 +684,48 @@ static void loadPrefs(void)
 	prefs.height  = GetINIValueInt(ini, "Height", 900);
 	prefs.mapSize = GetINIValueInt(ini, "MapSize", 4);
 	loadSpeed     = GetINIValueInt(ini, "Speed", 50);
+	prefs.allocMode = GetINIValueInt(ini, "AllocMode", ALLOC_SIZECLASS);
+	prefs.compactBudget = GetINIValueInt(ini, "CompactBudget", 256) * 1024;
+	staging.mode     = GetINIValueInt(ini, "StagingMode", STAGING_BLOCKS);
+	staging.size     = GetINIValueInt(ini, "StagingSize", staging.mode == STAGING_RING ? 64 : 1) * 1024 * 1024;
+	/* per frame: 0 == upload everything as soon as it is ready */
+	staging.budgetBytes = GetINIValueInt(ini, "UploadBudget", 0) * 1024;
+	staging.budgetTime  = GetINIValueInt(ini, "UploadTime", 0) / 1000.f;
+	/* 0 == number of cores */
+	prefs.threads = GetINIValueInt(ini, "Threads", 0);
+	/* threads dedicated to loading, others only mesh (0 == all threads do both) */
+	prefs.loaders = GetINIValueInt(ini, "LoaderThreads", 0);
+	/* generate chunks in view first (0 == distance only) */
+	prefs.viewPrio = GetINIValueInt(ini, "ViewPriority", 1);
+	prefs.viewFOV  = GetINIValueInt(ini, "ViewFOV", VIEW_FOV);
+	/* data of chunks that left the map (0 == always load again) */
+	prefs.cacheSize = GetINIValueInt(ini, "CacheSize", CACHE_SIZE >> 10) * 1024;
+	/* rings ahead of the player to load in the cache (0 == no prefetch) */
+	prefs.prefetchRings = GetINIValueInt(ini, "PrefetchRings", PREFETCH_RINGS);
 
 	if (prefs.mapSize < 1)  prefs.mapSize = 1;
 	if (prefs.mapSize > 16) prefs.mapSize = 16;
 	if (loadSpeed < 0)      loadSpeed = 0;
 	if (loadSpeed > 100)    loadSpeed = 100;
+	if (prefs.allocMode != ALLOC_FIRSTFIT) prefs.allocMode = ALLOC_SIZECLASS;
+	if (staging.mode < STAGING_BLOCKS || staging.mode > STAGING_ATOMIC) staging.mode = STAGING_BLOCKS;
+	if (staging.budgetBytes < 0) staging.budgetBytes = 0;
+	if (staging.budgetTime < 0)  staging.budgetTime = 0;
+	if (prefs.threads < 0 || prefs.threads > MAX_THREADS) prefs.threads = 0;
+	if (prefs.loaders < 0 || prefs.loaders >= MAX_THREADS) prefs.loaders = 0;
+	if (prefs.viewFOV < 10 || prefs.viewFOV > 180) prefs.viewFOV = VIEW_FOV;
+	if (prefs.cacheSize < 0) prefs.cacheSize = 0;
+	if (prefs.prefetchRings < 0 || prefs.prefetchRings > 8) prefs.prefetchRings = PREFETCH_RINGS;
 
 	STRPTR pos = GetINIValue(ini, "MapPos");
 	if (pos == NULL || sscanf(pos, "%dx%d", &prefs.posX, &prefs.posZ) != 2)
 		prefs.posX = prefs.posZ = 8;
 
+	/* folder with region files to load chunks from (simulated loading if not set) */
+	STRPTR path = GetINIValue(ini, "RegionPath");
+	ChunkSource source = path ? sourceOpenRegions(path) : NULL;
+	if (source) chunkSource = source;
+
 	FreeINI(ini);
 }
 
@@ -527,6 +735,18 @@ static void savePrefs(void)
 	SetINIValueInt("ChunkLoad.ini", "Height",  prefs.height);
 	SetINIValueInt("ChunkLoad.ini", "MapSize", prefs.mapSize);
 	SetINIValueInt("ChunkLoad.ini", "Speed",   loadSpeed);
+	SetINIValueInt("ChunkLoad.ini", "AllocMode", prefs.allocMode);
+	SetINIValueInt("ChunkLoad.ini", "CompactBudget", prefs.compactBudget / 1024);
+	SetINIValueInt("ChunkLoad.ini", "StagingMode", staging.mode);
+	SetINIValueInt("ChunkLoad.ini", "StagingSize", staging.size >> 20);
+	SetINIValueInt("ChunkLoad.ini", "UploadBudget", staging.budgetBytes >> 10);
+	SetINIValueInt("ChunkLoad.ini", "UploadTime", staging.budgetTime * 1000);
+	SetINIValueInt("ChunkLoad.ini", "Threads", prefs.threads);
+	SetINIValueInt("ChunkLoad.ini", "LoaderThreads", prefs.loaders);
+	SetINIValueInt("ChunkLoad.ini", "ViewPriority", prefs.viewPrio);
+	SetINIValueInt("ChunkLoad.ini", "ViewFOV", prefs.viewFOV);
+	SetINIValueInt("ChunkLoad.ini", "CacheSize", prefs.cacheSize >> 10);
+	SetINIValueInt("ChunkLoad.ini", "PrefetchRings", prefs.prefetchRings);
 }
 
 int main(int nb, char * argv[])
@@ -566,6 +786,8 @@ int main(int nb, char * argv[])
 		{SITK_Right, SITE_OnActivate, CMD_MOVE_RIGHT,  NULL, uiProcessCmd},
 		{SITK_Up,    SITE_OnActivate, CMD_MOVE_TOP,    NULL, uiProcessCmd},
 		{SITK_Down,  SITE_OnActivate, CMD_MOVE_BOTTOM, NULL, uiProcessCmd},
+		{SITK_F8,    SITE_OnActivate, CMD_TRACE,       NULL, uiProcessCmd},
+		{SITK_F9,    SITE_OnActivate, CMD_LATENCY,     NULL, uiProcessCmd},
 
 		{'=',  SITE_OnActivate, 0, "inc"},
 		{'-',  SITE_OnActivate, 0, "dec"},
@@ -593,7 +815,13 @@ int main(int nb, char * argv[])
 
 //	srand(time(NULL));
 	FrameSetFPS(40);
-	prefs.map = mapInitFromPath(prefs.mapSize, &prefs.posX);
+	mapNotify = SIT_ForceRefresh;
+	threadCount = prefs.threads;
+	threadLoaders = prefs.loaders;
+	prefs.map = mapInitFromPath(prefs.mapSize, &prefs.posX, prefs.allocMode);
+	mapSetViewDir(prefs.map, (vec4) {prefs.map->viewX, 0, prefs.map->viewZ}, prefs.viewFOV, prefs.viewPrio);
+	mapSetCacheSize(prefs.map, prefs.cacheSize);
+	mapSetPrefetch(prefs.map, prefs.prefetchRings);
 //	renderTestAlloc(prefs.map);
 
 	while (! exitProg)
@@ -653,18 +881,31 @@ int main(int nb, char * argv[])
 			SIT_ForceRefresh();
 		}
 
+		/* chunks left outside render distance (see mapSetRenderDist()) */
+		if (mapTrimChunks(prefs.map, TRIM_CHUNKS) > 0)
+			SIT_ForceRefresh();
+
+		/* background defragmentation of GPU banks */
+		if (prefs.compactBudget > 0 && renderCompactBanks(prefs.map, prefs.compactBudget) > 0)
+			SIT_ForceRefresh();
+
 		/* update and render */
 		if (SIT_RenderNodes(FrameGetTime()))
 			SDL_GL_SwapBuffers();
 
+		/* ranges freed a few frames ago can be reused now */
+		renderNextFrame(prefs.map);
+
 		FrameWaitNext();
 	}
 
 	savePrefs();
+	renderTraceStop();
 	SIT_Nuke(SITV_NukeAll);
 	SDL_FreeSurface(screen);
 	SDL_Quit();
 	mapFreeAll(prefs.map);
+	sourceClose(chunkSource);
 
 	return 0;
 }
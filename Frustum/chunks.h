@@ -27,7 +27,7 @@ struct ChunkData_t                     /* one sub-chunk of 16x16x16 blocks */
 	uint16_t  cnxGraph;                /* face graph connection (cave culling) */
 
 	uint16_t  cdFlags;                 /* CDFLAG_* */
-	uint8_t   slot;                    /* used by ChunkFake (0 ~ 31) */
+	uint16_t  slot;                    /* fake chunks: slot in Map_t.cdUsage + 1 (0 == real chunk) */
 	int8_t    comingFrom;              /* cave culling (face id 0 ~ 5) */
 	int       frame;
 
@@ -11,6 +11,7 @@
 #include <malloc.h>
 #include <math.h>
 #include "SIT.h"
+#define BITPOOL_IMPL
 #include "maps.h"
 #include "Frustum.h"
 
@@ -46,11 +47,6 @@ static uint8_t edgeCheck[] = {
 /* given a direction encoded as bitfield (S, E, N, W), return offset of where that chunk is */
 int16_t chunkNeighbor[16*9];
 
-uint8_t multiplyDeBruijnBitPosition[] = {
-	0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
-	31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
-};
-
 uint8_t mask8bit[] = {0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
 
 static uint8_t opp[] = {2, 3, 0, 1, 5, 4};
@@ -86,22 +82,6 @@ uint8_t slotsX[] = {1<<SIDE_WEST,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1<<SIDE_EAST};
 
 #define popcount     __builtin_popcount
 
-int mapFirstFree(DATA32 usage, int count)
-{
-	int base, i;
-	for (i = count, base = 0; i > 0; i --, usage ++, base += 32)
-	{
-		/* from https://graphics.stanford.edu/~seander/bithacks.html#ZerosOnRightMultLookup */
-		uint32_t bits = *usage ^ 0xffffffff;
-		if (bits == 0) continue;
-		/* count leading 0 */
-		bits = multiplyDeBruijnBitPosition[((uint32_t)((bits & -(signed)bits) * 0x077CB531U)) >> 27];
-		*usage |= 1 << bits;
-		return base + bits;
-	}
-	return -1;
-}
-
 static int mapGetCnxFromPos(ChunkData cd, int start, DATA8 visited)
 {
 	uint8_t track[CELLSZ*3/2];
@@ -322,19 +302,16 @@ Map mapInit(int renderDist, DATA8 chunkData, int chunkX, int chunkY)
  */
 
 #define FAKE_CHUNK_SIZE     (offsetof(struct ChunkData_t, blockIds)) /* fields after blockIds are completely useless for frustum */
+#define FAKE_CHUNK_POOL     64  /* fake chunks per buffer of Map_t.cdPool */
+#define FAKE_CHUNK(map, slot)  ((ChunkData) ((map)->cdPool[(slot) / FAKE_CHUNK_POOL] + FAKE_CHUNK_SIZE * ((slot) % FAKE_CHUNK_POOL)))
 #define UNVISITED           0x40
 #define VISIBLE             0x80
 //#define FRUSTUM_DEBUG
 
 #if 0
-static void mapPrintUsage(ChunkFake cf, int dir)
+static void mapPrintUsage(Map map, int dir)
 {
-	uint32_t flags, i;
-	cf->total += dir;
-	fprintf(stderr, "%c%d: ", dir < 0 ? '-' : '+', cf->total);
-	for (flags = cf->usage, i = 0; i < 16; i ++, flags >>= 1)
-		fputc(flags & 1 ? '1' : '0', stderr);
-	fputc('\n', stderr);
+	fprintf(stderr, "%c%d: %d buffers\n", dir < 0 ? '-' : '+', map->cdUsage.used, map->cdPoolMax);
 }
 #else
 #define mapPrintUsage(x, y)
@@ -342,41 +319,42 @@ static void mapPrintUsage(ChunkFake cf, int dir)
 
 static ChunkData mapAllocFakeChunk(Map map)
 {
-	ChunkFake * prev;
-	ChunkFake   cf;
-	ChunkData   cd;
-	int         slot;
-
-	for (prev = &map->cdPool, cf = *prev; cf && cf->usage == 0xffffffff; prev = &cf->next, cf = cf->next);
+	ChunkData cd;
+	int       slot = bitPoolAlloc(&map->cdUsage);
 
-	if (cf == NULL)
+	if (slot < 0)
 	{
-		cf = calloc(sizeof *cf + FAKE_CHUNK_SIZE * 32, 1);
-		if (cf == NULL) return NULL;
-		*prev = cf;
+		/* all buffers are full: need one more */
+		int     max  = map->cdPoolMax;
+		DATA8 * pool = realloc(map->cdPool, (max + 1) * sizeof *pool);
+		if (pool == NULL) return NULL;
+		map->cdPool = pool;
+		pool[max] = calloc(FAKE_CHUNK_SIZE, FAKE_CHUNK_POOL);
+		if (pool[max] == NULL || ! bitPoolResize(&map->cdUsage, (max + 1) * FAKE_CHUNK_POOL))
+		{
+			free(pool[max]);
+			return NULL;
+		}
+		map->cdPoolMax = max + 1;
+		slot = bitPoolAlloc(&map->cdUsage);
 	}
 
-	slot = mapFirstFree(&cf->usage, 1);
-	cd = (ChunkData) (cf->buffer + FAKE_CHUNK_SIZE * slot);
+	cd = FAKE_CHUNK(map, slot);
 	memset(cd, 0, FAKE_CHUNK_SIZE);
 	cd->slot   = slot+1;
-	cf->usage |= 1<<slot;
 	cd->cnxGraph = 0xffff;
 
-	mapPrintUsage(cf, 1);
+	mapPrintUsage(map, 1);
 
 	return cd;
 }
 
-static void mapFreeFakeChunk(ChunkData cd)
+static void mapFreeFakeChunk(Map map, ChunkData cd)
 {
-	/* as ugly as it looks, it is portable however... */
-	int       slot = cd->slot-1;
-	ChunkFake cf = (ChunkFake) ((DATA8) cd - FAKE_CHUNK_SIZE * slot - offsetof(struct ChunkFake_t, buffer));
-	Chunk     c  = cd->chunk;
-	cf->usage &= ~(1 << slot);
+	Chunk c = cd->chunk;
+	bitPoolFree(&map->cdUsage, cd->slot-1);
 	c->layer[cd->Y>>4] = NULL;
-	mapPrintUsage(cf, -1);
+	mapPrintUsage(map, -1);
 }
 
 static int mapGetOutFlags(Map map, ChunkData cur, DATA8 outflags)
@@ -587,17 +565,9 @@ static void mapCullCave(ChunkData cur, vec4 camera)
 
 static void mapFreeFakeChunks(Map map)
 {
-	ChunkFake pool;
-	for (pool = map->cdPool; pool; pool = pool->next)
-	{
-		uint32_t slot, usage;
-		for (usage = pool->usage, slot = 0; usage > 0; usage >>= 1, slot ++)
-		{
-			if (usage & 1)
-				mapFreeFakeChunk((ChunkData) (pool->buffer + FAKE_CHUNK_SIZE * slot));
-		}
-		pool->usage = 0;
-	}
+	int slot;
+	for (slot = bitPoolNextUsed(&map->cdUsage, 0); slot >= 0; slot = bitPoolNextUsed(&map->cdUsage, slot + 1))
+		mapFreeFakeChunk(map, FAKE_CHUNK(map, slot));
 }
 
 static void renderClearBank(Map map);
@@ -783,7 +753,7 @@ void mapViewFrustum(Map map, vec4 camera)
 			/* fake or empty chunk: remove from list */
 			#if 0
 			if (cur->slot > 0)
-				mapFreeFakeChunk(cur);
+				mapFreeFakeChunk(map, cur);
 			else /* still need to mark from direction we went */
 				mapCullCave(cur, camera);
 			*prev = cur->visible;
@@ -9,11 +9,11 @@
 
 #include <stdint.h>
 #include "chunks.h"
+#include "BitPool.h"
 
 typedef struct Map_t *             Map;
 typedef struct MapExtraData_t *    MapExtraData;
 typedef struct BlockIter_t *       BlockIter;
-typedef struct ChunkFake_t *       ChunkFake;
 
 Map  mapInit(int renderDist, DATA8 chunkData, int chunkX, int chunkY);
 void mapViewFrustum(Map map, vec4 camera);
@@ -55,7 +55,9 @@ struct Map_t
 	ChunkData firstVisible;        /* list of visible chunks according to the MVP matrix */
 	Chunk     needSave;            /* linked list of chunk that have been modified */
 	Chunk     chunks;              /* 2d array of chunk containing the entire area around player */
-	ChunkFake cdPool;              /* pool of partial ChunkData for frustum culling */
+	DATA8 *   cdPool;              /* partial ChunkData for frustum culling, FAKE_CHUNK_POOL per buffer */
+	int       cdPoolMax;           /* buffers allocated in cdPool */
+	struct BitPool_t cdUsage;      /* one slot per partial ChunkData */
 };
 
 struct MapFrustum_t                /* frustum culling static tables (see doc/internals.html for detail) */
@@ -67,12 +69,4 @@ struct MapFrustum_t                /* frustum culling static tables (see doc/int
 	uint16_t  lazyCount;
 };
 
-struct ChunkFake_t
-{
-	ChunkFake next;
-	uint32_t  usage;
-	uint8_t   total;
-	uint8_t   buffer[0]; /* more bytes will follow */
-};
-
 #endif
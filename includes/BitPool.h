@@ -0,0 +1,235 @@
+/*
+ * BitPool.h : slot allocator based on a hierarchical bitmap. Level 0 has one bit per slot (1 == used),
+ *             each level above has one bit per full word of the level below, which allows to find a
+ *             free slot in O(log64(n)) instead of scanning the whole bitmap.
+ *
+ * Define BITPOOL_IMPL before including this file in one (and only one) source file.
+ */
+
+#ifndef BITPOOL_H
+#define BITPOOL_H
+
+#include <stdint.h>
+
+#define BITPOOL_LEVELS     4           /* up to 64^4 = 16M slots */
+
+typedef struct BitPool_t *     BitPool;
+
+struct BitPool_t
+{
+	uint64_t * level[BITPOOL_LEVELS];  /* level[n]: 1 bit per full word of level[n-1] */
+	int        words[BITPOOL_LEVELS];  /* number of words in level[n] */
+	int        depth;                  /* number of levels: last one has only 1 word */
+	int        count;                  /* number of slots */
+	int        used;                   /* slots allocated */
+};
+
+int  bitPoolInit(BitPool, int count);
+int  bitPoolResize(BitPool, int count);
+void bitPoolRelease(BitPool);
+void bitPoolClearAll(BitPool);
+int  bitPoolAlloc(BitPool);
+int  bitPoolAllocRun(BitPool, int count);
+int  bitPoolFindRun(BitPool, int count);
+int  bitPoolNextFree(BitPool, int slot);
+int  bitPoolNextUsed(BitPool, int slot);
+void bitPoolSet(BitPool, int slot);
+void bitPoolFree(BitPool, int slot);
+
+#define bitPoolIsSet(pool, slot)   (((pool)->level[0][(slot) >> 6] >> ((slot) & 63)) & 1)
+
+#ifdef BITPOOL_IMPL
+#include <stdlib.h>
+#include <string.h>
+
+#define BITPOOL_FULL       0xffffffffffffffffULL
+#define BITPOOL_CTZ(x)     __builtin_ctzll(x)
+
+/* recompute upper levels from level 0, bits past the end of each level are marked as used */
+static void bitPoolSummary(BitPool pool)
+{
+	int i, w, count;
+	for (i = 0, count = pool->count; i < pool->depth; count = pool->words[i], i ++)
+	{
+		uint64_t * level = pool->level[i];
+		if (i > 0)
+		{
+			uint64_t * below = pool->level[i-1];
+			memset(level, 0, pool->words[i] * sizeof *level);
+			for (w = 0; w < count; w ++)
+				if (below[w] == BITPOOL_FULL) level[w >> 6] |= 1ULL << (w & 63);
+		}
+		if (count & 63)
+			level[count >> 6] |= BITPOOL_FULL << (count & 63);
+	}
+}
+
+int bitPoolInit(BitPool pool, int count)
+{
+	memset(pool, 0, sizeof *pool);
+	return bitPoolResize(pool, count);
+}
+
+/* change number of slots: state of slots below MIN(count, pool->count) is kept */
+int bitPoolResize(BitPool pool, int count)
+{
+	uint64_t * mem;
+	int words[BITPOOL_LEVELS];
+	int depth, total, n, i;
+
+	for (depth = total = 0, n = count; depth < BITPOOL_LEVELS; )
+	{
+		n = (n + 63) >> 6;
+		words[depth ++] = n;
+		total += n;
+		if (n <= 1) break;
+	}
+	/* too many slots */
+	if (n > 1) return 0;
+
+	mem = calloc(total + 1, sizeof *mem);
+	if (mem == NULL) return 0;
+
+	pool->used = 0;
+	if (pool->level[0])
+	{
+		/* remove padding of old last word */
+		n = pool->count < count ? pool->count : count;
+		memcpy(mem, pool->level[0], ((n + 63) >> 6) * sizeof *mem);
+		if (n & 63) mem[n >> 6] &= ~(BITPOOL_FULL << (n & 63));
+		for (i = (n + 63) >> 6; i > 0; pool->used += __builtin_popcountll(mem[-- i]));
+		free(pool->level[0]);
+	}
+	memset(pool->level, 0, sizeof pool->level);
+	for (i = 0; i < depth; mem += words[i], i ++)
+		pool->level[i] = mem, pool->words[i] = words[i];
+	pool->depth = depth;
+	pool->count = count;
+	bitPoolSummary(pool);
+	return 1;
+}
+
+void bitPoolRelease(BitPool pool)
+{
+	free(pool->level[0]);
+	memset(pool, 0, sizeof *pool);
+}
+
+void bitPoolClearAll(BitPool pool)
+{
+	memset(pool->level[0], 0, pool->words[0] * sizeof (uint64_t));
+	pool->used = 0;
+	bitPoolSummary(pool);
+}
+
+void bitPoolSet(BitPool pool, int slot)
+{
+	uint64_t * word = pool->level[0] + (slot >> 6);
+	uint64_t   bit  = 1ULL << (slot & 63);
+	int        i;
+
+	if (*word & bit) return;
+	pool->used ++;
+	for (i = 1; ; i ++)
+	{
+		*word |= bit;
+		/* parent only needs to be updated if this word became full */
+		if (*word != BITPOOL_FULL || i == pool->depth) break;
+		slot >>= 6;
+		word = pool->level[i] + (slot >> 6);
+		bit  = 1ULL << (slot & 63);
+	}
+}
+
+void bitPoolFree(BitPool pool, int slot)
+{
+	uint64_t * word = pool->level[0] + (slot >> 6);
+	uint64_t   bit  = 1ULL << (slot & 63);
+	int        i;
+
+	if ((*word & bit) == 0) return;
+	pool->used --;
+	for (i = 1; ; i ++)
+	{
+		uint64_t full = *word == BITPOOL_FULL;
+		*word &= ~bit;
+		/* parent was not marked as full */
+		if (! full || i == pool->depth) break;
+		slot >>= 6;
+		word = pool->level[i] + (slot >> 6);
+		bit  = 1ULL << (slot & 63);
+	}
+}
+
+/* first free slot at or after <slot>, -1 if none */
+int bitPoolNextFree(BitPool pool, int slot)
+{
+	uint64_t bits;
+	int      i, w;
+
+	/* go up until a word with a free bit is found */
+	for (i = 0; ; i ++, slot = w + 1)
+	{
+		w = slot >> 6;
+		if (i == pool->depth || w >= pool->words[i]) return -1;
+		bits = ~pool->level[i][w] & (BITPOOL_FULL << (slot & 63));
+		if (bits) break;
+	}
+	/* then down to level 0: any word marked as not full has a free bit */
+	for (slot = (w << 6) | BITPOOL_CTZ(bits); i > 0; i --)
+		slot = (slot << 6) | BITPOOL_CTZ(~pool->level[i-1][slot]);
+
+	return slot;
+}
+
+/* first used slot at or after <slot>, -1 if none */
+int bitPoolNextUsed(BitPool pool, int slot)
+{
+	int w, max;
+	if (slot >= pool->count) return -1;
+	for (w = slot >> 6, max = (pool->count - 1) >> 6; w <= max; w ++, slot = w << 6)
+	{
+		uint64_t bits = pool->level[0][w] & (BITPOOL_FULL << (slot & 63));
+		if (bits)
+		{
+			slot = (w << 6) | BITPOOL_CTZ(bits);
+			/* padding */
+			return slot < pool->count ? slot : -1;
+		}
+	}
+	return -1;
+}
+
+int bitPoolAlloc(BitPool pool)
+{
+	int slot = pool->used < pool->count ? bitPoolNextFree(pool, 0) : -1;
+	if (slot >= 0) bitPoolSet(pool, slot);
+	return slot;
+}
+
+/* first run of <count> consecutive free slots, -1 if none */
+int bitPoolFindRun(BitPool pool, int count)
+{
+	int start, end;
+	for (start = bitPoolNextFree(pool, 0); start >= 0; start = bitPoolNextFree(pool, end))
+	{
+		end = bitPoolNextUsed(pool, start);
+		if (end < 0) end = pool->count;
+		if (end - start >= count) return start;
+	}
+	return -1;
+}
+
+int bitPoolAllocRun(BitPool pool, int count)
+{
+	int start = bitPoolFindRun(pool, count);
+	int i;
+	for (i = start < 0 ? 0 : count; i > 0; i --)
+		bitPoolSet(pool, start + i - 1);
+	return start;
+}
+
+#undef BITPOOL_FULL
+#undef BITPOOL_CTZ
+#endif
+#endif